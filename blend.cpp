@@ -0,0 +1,612 @@
+// blend.cpp --- Blending glyph coverage into 32bpp pixels
+// Author: katahiromz
+// License: MIT
+#include "blend.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define BLEND_X86
+    #include <emmintrin.h>
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
+
+// GCC and Clang compile a SIMD kernel only for a function marked with its target
+#if defined(BLEND_X86) && (defined(__GNUC__) || defined(__clang__))
+    #define BLEND_TARGET_SSE2 __attribute__((target("sse2")))
+    #define BLEND_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+    #define BLEND_TARGET_SSE2
+    #define BLEND_TARGET_AVX2
+#endif
+
+// ---------------------------------------------------------------------------
+// Scalar kernels
+
+static inline uint32_t blend_pixel(uint32_t fg, uint32_t bg, int ar, int ag, int ab)
+{
+    uint32_t r = (((fg >> 16) & 0xFF) * ar + ((bg >> 16) & 0xFF) * (255 - ar)) / 255;
+    uint32_t g = (((fg >> 8) & 0xFF) * ag + ((bg >> 8) & 0xFF) * (255 - ag)) / 255;
+    uint32_t b = ((fg & 0xFF) * ab + (bg & 0xFF) * (255 - ab)) / 255;
+    return (bg & 0xFF000000) | (r << 16) | (g << 8) | b;
+}
+
+static void gray_transparent_scalar(uint32_t* dst, const uint8_t* coverage, int count,
+                                    uint32_t fg_pixel, uint32_t /*bg_pixel*/)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int alpha = coverage[i];
+        if (alpha)
+            dst[i] = blend_pixel(fg_pixel, dst[i], alpha, alpha, alpha);
+    }
+}
+
+static void gray_opaque_scalar(uint32_t* dst, const uint8_t* coverage, int count,
+                               uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    for (int i = 0; i < count; ++i)
+    {
+        int alpha = coverage[i];
+        dst[i] = blend_pixel(fg_pixel, bg_pixel, alpha, alpha, alpha);
+    }
+}
+
+// LCD coverage has three subpixel bytes per pixel, in R, G, B order
+static void lcd_transparent_scalar(uint32_t* dst, const uint8_t* coverage, int count,
+                                   uint32_t fg_pixel, uint32_t /*bg_pixel*/)
+{
+    for (int i = 0; i < count; ++i, coverage += 3)
+    {
+        if (coverage[0] | coverage[1] | coverage[2])
+            dst[i] = blend_pixel(fg_pixel, dst[i], coverage[0], coverage[1], coverage[2]);
+    }
+}
+
+static void lcd_opaque_scalar(uint32_t* dst, const uint8_t* coverage, int count,
+                              uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    for (int i = 0; i < count; ++i, coverage += 3)
+        dst[i] = blend_pixel(fg_pixel, bg_pixel, coverage[0], coverage[1], coverage[2]);
+}
+
+// 1bpp coverage is MSB first, starting at bit x of bits
+static void mono_transparent_scalar(uint32_t* dst, const uint8_t* bits, int x, int count,
+                                    uint32_t fg_pixel, uint32_t /*bg_pixel*/)
+{
+    for (int i = 0; i < count; ++i, ++x)
+    {
+        if ((bits[x >> 3] >> (7 - (x & 7))) & 1)
+            dst[i] = fg_pixel;
+    }
+}
+
+static void mono_opaque_scalar(uint32_t* dst, const uint8_t* bits, int x, int count,
+                               uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    for (int i = 0; i < count; ++i, ++x)
+        dst[i] = ((bits[x >> 3] >> (7 - (x & 7))) & 1) ? fg_pixel : bg_pixel;
+}
+
+// Draw the bits before the first whole byte. Returns the pixels drawn.
+static inline int mono_head(uint32_t* dst, const uint8_t* bits, int x, int count,
+                            uint32_t fg_pixel, uint32_t bg_pixel, bool opaque)
+{
+    int head = (8 - (x & 7)) & 7;
+    if (head > count)
+        head = count;
+    if (opaque)
+        mono_opaque_scalar(dst, bits, x, head, fg_pixel, bg_pixel);
+    else
+        mono_transparent_scalar(dst, bits, x, head, fg_pixel, bg_pixel);
+    return head;
+}
+
+static const BlendKernels scalar_kernels =
+{
+    "scalar",
+    gray_transparent_scalar,
+    gray_opaque_scalar,
+    lcd_transparent_scalar,
+    lcd_opaque_scalar,
+    mono_transparent_scalar,
+    mono_opaque_scalar,
+};
+
+#ifdef BLEND_X86
+
+// ---------------------------------------------------------------------------
+// SIMD kernels
+// The channels are widened to 16 bits, where fg * a + bg * (255 - a) fits.
+// For v <= 65535, v / 255 == (v * 0x8081) >> 23, which is a high multiply
+// and a shift. A pixel of no coverage blends to itself, so the transparent
+// kernels need no per-pixel test; whole blocks of no coverage are skipped.
+
+// Blend 4 pixels. alpha holds the coverage of each channel in pixel layout.
+BLEND_TARGET_SSE2
+static inline __m128i blend4_sse2(__m128i dst, __m128i alpha, __m128i fg16)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c255 = _mm_set1_epi16(255);
+    const __m128i c8081 = _mm_set1_epi16((short)0x8081);
+
+    alpha = _mm_and_si128(alpha, _mm_set1_epi32(0x00FFFFFF)); // Keep X of dst
+    __m128i a_lo = _mm_unpacklo_epi8(alpha, zero);
+    __m128i a_hi = _mm_unpackhi_epi8(alpha, zero);
+    __m128i d_lo = _mm_unpacklo_epi8(dst, zero);
+    __m128i d_hi = _mm_unpackhi_epi8(dst, zero);
+
+    __m128i v_lo = _mm_add_epi16(_mm_mullo_epi16(fg16, a_lo),
+                                 _mm_mullo_epi16(d_lo, _mm_sub_epi16(c255, a_lo)));
+    __m128i v_hi = _mm_add_epi16(_mm_mullo_epi16(fg16, a_hi),
+                                 _mm_mullo_epi16(d_hi, _mm_sub_epi16(c255, a_hi)));
+    v_lo = _mm_srli_epi16(_mm_mulhi_epu16(v_lo, c8081), 7);
+    v_hi = _mm_srli_epi16(_mm_mulhi_epu16(v_hi, c8081), 7);
+
+    return _mm_packus_epi16(v_lo, v_hi);
+}
+
+template <bool opaque>
+BLEND_TARGET_SSE2
+static void gray_row_sse2(uint32_t* dst, const uint8_t* coverage, int count,
+                          uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fg16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)fg_pixel), zero);
+    const __m128i bg = _mm_set1_epi32((int)bg_pixel);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a = _mm_loadl_epi64((const __m128i*)(coverage + i));
+        if (!opaque && _mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) == 0xFFFF)
+            continue;
+
+        a = _mm_unpacklo_epi8(a, a);
+        __m128i a0 = _mm_unpacklo_epi16(a, a);
+        __m128i a1 = _mm_unpackhi_epi16(a, a);
+        __m128i d0 = opaque ? bg : _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i d1 = opaque ? bg : _mm_loadu_si128((const __m128i*)(dst + i + 4));
+        _mm_storeu_si128((__m128i*)(dst + i), blend4_sse2(d0, a0, fg16));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), blend4_sse2(d1, a1, fg16));
+    }
+
+    if (opaque)
+        gray_opaque_scalar(dst + i, coverage + i, count - i, fg_pixel, bg_pixel);
+    else
+        gray_transparent_scalar(dst + i, coverage + i, count - i, fg_pixel, bg_pixel);
+}
+
+// SSE2 has no byte shuffle, so the coverage of 4 pixels is deinterleaved
+// into pixel layout in general registers
+static inline uint32_t lcd_alpha(const uint8_t* coverage)
+{
+    return ((uint32_t)coverage[0] << 16) | ((uint32_t)coverage[1] << 8) | coverage[2];
+}
+
+BLEND_TARGET_SSE2
+static inline __m128i load_lcd_alpha_sse2(const uint8_t* coverage)
+{
+    return _mm_setr_epi32((int)lcd_alpha(coverage), (int)lcd_alpha(coverage + 3),
+                          (int)lcd_alpha(coverage + 6), (int)lcd_alpha(coverage + 9));
+}
+
+template <bool opaque>
+BLEND_TARGET_SSE2
+static void lcd_row_sse2(uint32_t* dst, const uint8_t* coverage, int count,
+                         uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i fg16 = _mm_unpacklo_epi8(_mm_set1_epi32((int)fg_pixel), zero);
+    const __m128i bg = _mm_set1_epi32((int)bg_pixel);
+
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i a0 = load_lcd_alpha_sse2(coverage + i * 3);
+        __m128i a1 = load_lcd_alpha_sse2(coverage + i * 3 + 12);
+        if (!opaque && _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(a0, a1), zero)) == 0xFFFF)
+            continue;
+
+        __m128i d0 = opaque ? bg : _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i d1 = opaque ? bg : _mm_loadu_si128((const __m128i*)(dst + i + 4));
+        _mm_storeu_si128((__m128i*)(dst + i), blend4_sse2(d0, a0, fg16));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), blend4_sse2(d1, a1, fg16));
+    }
+
+    if (opaque)
+        lcd_opaque_scalar(dst + i, coverage + i * 3, count - i, fg_pixel, bg_pixel);
+    else
+        lcd_transparent_scalar(dst + i, coverage + i * 3, count - i, fg_pixel, bg_pixel);
+}
+
+// A byte of 1bpp coverage becomes 8 pixel masks by comparing it, broadcast,
+// with the bit of each pixel. The masks select fg or the other pixel.
+template <bool opaque>
+BLEND_TARGET_SSE2
+static void mono_row_sse2(uint32_t* dst, const uint8_t* bits, int x, int count,
+                          uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    const __m128i bits_lo = _mm_setr_epi32(0x80, 0x40, 0x20, 0x10);
+    const __m128i bits_hi = _mm_setr_epi32(0x08, 0x04, 0x02, 0x01);
+    const __m128i fg = _mm_set1_epi32((int)fg_pixel);
+    const __m128i bg = _mm_set1_epi32((int)bg_pixel);
+
+    int i = mono_head(dst, bits, x, count, fg_pixel, bg_pixel, opaque);
+    const uint8_t* byte = bits + ((x + i) >> 3);
+    for (; i + 8 <= count; i += 8, ++byte)
+    {
+        if (!opaque && *byte == 0)
+            continue;
+
+        __m128i b = _mm_set1_epi32(*byte);
+        __m128i m0 = _mm_cmpeq_epi32(_mm_and_si128(b, bits_lo), bits_lo);
+        __m128i m1 = _mm_cmpeq_epi32(_mm_and_si128(b, bits_hi), bits_hi);
+        __m128i d0 = opaque ? bg : _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i d1 = opaque ? bg : _mm_loadu_si128((const __m128i*)(dst + i + 4));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_and_si128(m0, fg), _mm_andnot_si128(m0, d0)));
+        _mm_storeu_si128((__m128i*)(dst + i + 4), _mm_or_si128(_mm_and_si128(m1, fg), _mm_andnot_si128(m1, d1)));
+    }
+
+    if (opaque)
+        mono_opaque_scalar(dst + i, bits, x + i, count - i, fg_pixel, bg_pixel);
+    else
+        mono_transparent_scalar(dst + i, bits, x + i, count - i, fg_pixel, bg_pixel);
+}
+
+static const BlendKernels sse2_kernels =
+{
+    "sse2",
+    gray_row_sse2<false>,
+    gray_row_sse2<true>,
+    lcd_row_sse2<false>,
+    lcd_row_sse2<true>,
+    mono_row_sse2<false>,
+    mono_row_sse2<true>,
+};
+
+// Blend 8 pixels. The unpacks and the pack work within 128-bit lanes and
+// undo each other, so the pixel order is kept.
+BLEND_TARGET_AVX2
+static inline __m256i blend8_avx2(__m256i dst, __m256i alpha, __m256i fg16)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i c255 = _mm256_set1_epi16(255);
+    const __m256i c8081 = _mm256_set1_epi16((short)0x8081);
+
+    alpha = _mm256_and_si256(alpha, _mm256_set1_epi32(0x00FFFFFF)); // Keep X of dst
+    __m256i a_lo = _mm256_unpacklo_epi8(alpha, zero);
+    __m256i a_hi = _mm256_unpackhi_epi8(alpha, zero);
+    __m256i d_lo = _mm256_unpacklo_epi8(dst, zero);
+    __m256i d_hi = _mm256_unpackhi_epi8(dst, zero);
+
+    __m256i v_lo = _mm256_add_epi16(_mm256_mullo_epi16(fg16, a_lo),
+                                    _mm256_mullo_epi16(d_lo, _mm256_sub_epi16(c255, a_lo)));
+    __m256i v_hi = _mm256_add_epi16(_mm256_mullo_epi16(fg16, a_hi),
+                                    _mm256_mullo_epi16(d_hi, _mm256_sub_epi16(c255, a_hi)));
+    v_lo = _mm256_srli_epi16(_mm256_mulhi_epu16(v_lo, c8081), 7);
+    v_hi = _mm256_srli_epi16(_mm256_mulhi_epu16(v_hi, c8081), 7);
+
+    return _mm256_packus_epi16(v_lo, v_hi);
+}
+
+// Spread 8 coverage bytes to the 4 bytes of their pixels
+BLEND_TARGET_AVX2
+static inline __m256i spread_gray_avx2(const uint8_t* coverage)
+{
+    const __m256i spread = _mm256_setr_epi8(
+        0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12,
+        0, 0, 0, 0, 4, 4, 4, 4, 8, 8, 8, 8, 12, 12, 12, 12);
+    __m256i a = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)coverage));
+    return _mm256_shuffle_epi8(a, spread);
+}
+
+template <bool opaque>
+BLEND_TARGET_AVX2
+static void gray_row_avx2(uint32_t* dst, const uint8_t* coverage, int count,
+                          uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    const __m256i fg16 = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)fg_pixel),
+                                              _mm256_setzero_si256());
+    const __m256i bg = _mm256_set1_epi32((int)bg_pixel);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        if (!opaque)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(coverage + i));
+            if (_mm_testz_si128(a, a))
+                continue;
+        }
+
+        __m256i d0 = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i d1 = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i + 8));
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                            blend8_avx2(d0, spread_gray_avx2(coverage + i), fg16));
+        _mm256_storeu_si256((__m256i*)(dst + i + 8),
+                            blend8_avx2(d1, spread_gray_avx2(coverage + i + 8), fg16));
+    }
+
+    // Small glyphs have rows of fewer than 16 pixels
+    if (i + 8 <= count)
+    {
+        __m256i d = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), blend8_avx2(d, spread_gray_avx2(coverage + i), fg16));
+        i += 8;
+    }
+
+    if (opaque)
+        gray_opaque_scalar(dst + i, coverage + i, count - i, fg_pixel, bg_pixel);
+    else
+        gray_transparent_scalar(dst + i, coverage + i, count - i, fg_pixel, bg_pixel);
+}
+
+// Load the 12 coverage bytes of 4 pixels without reading past them
+BLEND_TARGET_AVX2
+static inline __m128i load_lcd_coverage4(const uint8_t* coverage)
+{
+    uint32_t last;
+    memcpy(&last, coverage + 8, sizeof(last));
+    return _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)coverage),
+                              _mm_cvtsi32_si128((int)last));
+}
+
+// Deinterleave the coverage of 8 pixels into pixel layout (B, G, R, 0)
+BLEND_TARGET_AVX2
+static inline __m256i load_lcd_alpha_avx2(const uint8_t* coverage)
+{
+    const __m256i deinterleave = _mm256_setr_epi8(
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    __m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(load_lcd_coverage4(coverage)),
+                                        load_lcd_coverage4(coverage + 12), 1);
+    return _mm256_shuffle_epi8(c, deinterleave);
+}
+
+template <bool opaque>
+BLEND_TARGET_AVX2
+static void lcd_row_avx2(uint32_t* dst, const uint8_t* coverage, int count,
+                         uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    const __m256i fg16 = _mm256_unpacklo_epi8(_mm256_set1_epi32((int)fg_pixel),
+                                              _mm256_setzero_si256());
+    const __m256i bg = _mm256_set1_epi32((int)bg_pixel);
+
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m256i a0 = load_lcd_alpha_avx2(coverage + i * 3);
+        __m256i a1 = load_lcd_alpha_avx2(coverage + i * 3 + 24);
+        if (!opaque)
+        {
+            __m256i a = _mm256_or_si256(a0, a1);
+            if (_mm256_testz_si256(a, a))
+                continue;
+        }
+
+        __m256i d0 = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i));
+        __m256i d1 = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i + 8));
+        _mm256_storeu_si256((__m256i*)(dst + i), blend8_avx2(d0, a0, fg16));
+        _mm256_storeu_si256((__m256i*)(dst + i + 8), blend8_avx2(d1, a1, fg16));
+    }
+
+    // Small glyphs have rows of fewer than 16 pixels
+    if (i + 8 <= count)
+    {
+        __m256i d = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i),
+                            blend8_avx2(d, load_lcd_alpha_avx2(coverage + i * 3), fg16));
+        i += 8;
+    }
+
+    if (opaque)
+        lcd_opaque_scalar(dst + i, coverage + i * 3, count - i, fg_pixel, bg_pixel);
+    else
+        lcd_transparent_scalar(dst + i, coverage + i * 3, count - i, fg_pixel, bg_pixel);
+}
+
+template <bool opaque>
+BLEND_TARGET_AVX2
+static void mono_row_avx2(uint32_t* dst, const uint8_t* bits, int x, int count,
+                          uint32_t fg_pixel, uint32_t bg_pixel)
+{
+    const __m256i pixel_bits = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+    const __m256i fg = _mm256_set1_epi32((int)fg_pixel);
+    const __m256i bg = _mm256_set1_epi32((int)bg_pixel);
+
+    int i = mono_head(dst, bits, x, count, fg_pixel, bg_pixel, opaque);
+    const uint8_t* byte = bits + ((x + i) >> 3);
+    for (; i + 8 <= count; i += 8, ++byte)
+    {
+        if (!opaque && *byte == 0)
+            continue;
+
+        __m256i b = _mm256_set1_epi32(*byte);
+        __m256i mask = _mm256_cmpeq_epi32(_mm256_and_si256(b, pixel_bits), pixel_bits);
+        __m256i d = opaque ? bg : _mm256_loadu_si256((const __m256i*)(dst + i));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_blendv_epi8(d, fg, mask));
+    }
+
+    if (opaque)
+        mono_opaque_scalar(dst + i, bits, x + i, count - i, fg_pixel, bg_pixel);
+    else
+        mono_transparent_scalar(dst + i, bits, x + i, count - i, fg_pixel, bg_pixel);
+}
+
+static const BlendKernels avx2_kernels =
+{
+    "avx2",
+    gray_row_avx2<false>,
+    gray_row_avx2<true>,
+    lcd_row_avx2<false>,
+    lcd_row_avx2<true>,
+    mono_row_avx2<false>,
+    mono_row_avx2<true>,
+};
+
+// ---------------------------------------------------------------------------
+// CPU detection
+
+#ifdef _MSC_VER
+static bool cpu_has_sse2(void)
+{
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+}
+
+static bool cpu_has_avx2(void)
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    // The OS must save the YMM registers
+    __cpuid(info, 1);
+    if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+#else
+static bool cpu_has_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool cpu_has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+#endif // def BLEND_X86
+
+// ---------------------------------------------------------------------------
+
+const BlendKernels* GetBlendKernels(BlendKernelType type)
+{
+    switch (type)
+    {
+    case BLEND_KERNEL_SCALAR:
+        return &scalar_kernels;
+#ifdef BLEND_X86
+    case BLEND_KERNEL_SSE2:
+        return cpu_has_sse2() ? &sse2_kernels : NULL;
+    case BLEND_KERNEL_AVX2:
+        return cpu_has_avx2() ? &avx2_kernels : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+const BlendKernels* GetBestBlendKernels(void)
+{
+    static const BlendKernels* best = NULL;
+    if (!best)
+    {
+        for (int type = BLEND_KERNEL_COUNT - 1; !best; --type)
+            best = GetBlendKernels((BlendKernelType)type);
+    }
+    return best;
+}
+
+// ---------------------------------------------------------------------------
+// Gamma and contrast correction
+
+struct GammaCacheEntry {
+    bool used;
+    uint32_t fg_pixel;
+    int gamma_level;
+    int contrast_level;
+    BlendGamma tables;
+};
+
+static GammaCacheEntry gamma_cache[BLEND_GAMMA_CACHE_SIZE];
+static int gamma_cache_next = 0; // The entry to replace next
+
+// The coverage table of a channel value. Blending the text over the opposite
+// of its value with the corrected coverage gives what blending in linear
+// light with the original coverage gives; the contrast thickens the text,
+// less so as it gets lighter.
+static void build_gamma_table(uint8_t* table, int value, double gamma, double contrast)
+{
+    double src = value / 255.0, dst = 1.0 - src;
+    double linear_src = pow(src, gamma), linear_dst = pow(dst, gamma);
+    double strength = contrast * linear_dst;
+    for (int i = 0; i < 256; ++i)
+    {
+        double a = i / 255.0;
+        a += (1.0 - a) * strength * a;
+        double result = a;
+        if (fabs(src - dst) >= 1.0 / 256) // Close values make the division unstable
+        {
+            double out = pow(linear_src * a + linear_dst * (1.0 - a), 1.0 / gamma);
+            result = (out - dst) / (src - dst);
+        }
+        result = (result < 0.0) ? 0.0 : (result > 1.0) ? 1.0 : result;
+        table[i] = (uint8_t)(result * 255.0 + 0.5);
+    }
+}
+
+const BlendGamma* GetBlendGamma(uint32_t fg_pixel, int gamma_level, int contrast_level)
+{
+    fg_pixel &= 0xFFFFFF;
+    gamma_level = (gamma_level < BLEND_GAMMA_LINEAR) ? BLEND_GAMMA_LINEAR :
+                  (gamma_level > BLEND_GAMMA_MAX) ? BLEND_GAMMA_MAX : gamma_level;
+    contrast_level = (contrast_level < 0) ? 0 : contrast_level;
+    if (gamma_level == BLEND_GAMMA_LINEAR && contrast_level == 0)
+        return NULL;
+
+    for (int i = 0; i < BLEND_GAMMA_CACHE_SIZE; ++i)
+    {
+        GammaCacheEntry& entry = gamma_cache[i];
+        if (entry.used && entry.fg_pixel == fg_pixel && entry.gamma_level == gamma_level &&
+            entry.contrast_level == contrast_level)
+        {
+            return &entry.tables;
+        }
+    }
+
+    GammaCacheEntry& entry = gamma_cache[gamma_cache_next];
+    gamma_cache_next = (gamma_cache_next + 1) % BLEND_GAMMA_CACHE_SIZE;
+
+    double gamma = gamma_level / 1000.0, contrast = contrast_level / 100.0;
+    int r = (fg_pixel >> 16) & 0xFF, g = (fg_pixel >> 8) & 0xFF, b = fg_pixel & 0xFF;
+    int luminance = (54 * r + 183 * g + 19 * b + 128) >> 8; // Rec. 709
+    build_gamma_table(entry.tables.red, r, gamma, contrast);
+    build_gamma_table(entry.tables.green, g, gamma, contrast);
+    build_gamma_table(entry.tables.blue, b, gamma, contrast);
+    build_gamma_table(entry.tables.gray, luminance, gamma, contrast);
+    entry.used = true;
+    entry.fg_pixel = fg_pixel;
+    entry.gamma_level = gamma_level;
+    entry.contrast_level = contrast_level;
+    return &entry.tables;
+}
+
+void CorrectGrayCoverage(uint8_t* out, const uint8_t* coverage, int count, const BlendGamma* gamma)
+{
+    const uint8_t* table = gamma->gray;
+    for (int i = 0; i < count; ++i)
+        out[i] = table[coverage[i]];
+}
+
+void CorrectLcdCoverage(uint8_t* out, const uint8_t* coverage, int count, const BlendGamma* gamma)
+{
+    for (int i = 0; i < count; ++i, out += 3, coverage += 3)
+    {
+        out[0] = gamma->red[coverage[0]];
+        out[1] = gamma->green[coverage[1]];
+        out[2] = gamma->blue[coverage[2]];
+    }
+}
@@ -0,0 +1,77 @@
+// blend.h --- Blending glyph coverage into 32bpp pixels
+// Author: katahiromz
+// License: MIT
+#pragma once
+
+#include <stdint.h>
+
+// Pixels are 32bpp 0x00RRGGBB (B, G, R, X in memory), as in a BI_RGB DIB.
+// Every kernel computes each channel exactly as (fg * a + bg * (255 - a)) / 255,
+// where a is the coverage of the channel and bg is the destination pixel
+// (transparent) or the background color (opaque), and keeps the X byte of bg.
+// The kernels differ only in speed.
+
+// Blend count pixels of coverage into dst. 8bpp coverage has a byte per pixel;
+// LCD coverage has three, for R, G and B in that order, as FT_PIXEL_MODE_LCD.
+typedef void (*BlendRowProc)(uint32_t* dst, const uint8_t* coverage, int count,
+                             uint32_t fg_pixel, uint32_t bg_pixel);
+
+// Draw count pixels of 1bpp coverage, MSB first, starting at bit x of bits.
+// A set bit makes fg_pixel; a clear bit makes bg_pixel (opaque) or keeps dst.
+typedef void (*BlendMonoRowProc)(uint32_t* dst, const uint8_t* bits, int x, int count,
+                                 uint32_t fg_pixel, uint32_t bg_pixel);
+
+enum BlendKernelType {
+    BLEND_KERNEL_SCALAR,
+    BLEND_KERNEL_SSE2,  // 8 pixels per iteration
+    BLEND_KERNEL_AVX2,  // 16 pixels per iteration
+    BLEND_KERNEL_COUNT,
+};
+
+struct BlendKernels {
+    const char* name;
+    BlendRowProc gray_transparent; // A pixel of no coverage keeps dst
+    BlendRowProc gray_opaque;      // A pixel of no coverage becomes bg_pixel
+    BlendRowProc lcd_transparent;
+    BlendRowProc lcd_opaque;
+    BlendMonoRowProc mono_transparent;
+    BlendMonoRowProc mono_opaque;
+};
+
+// The kernels of the type, or NULL if the build or the CPU lacks them
+const BlendKernels* GetBlendKernels(BlendKernelType type);
+
+// The fastest kernels the CPU supports, chosen on the first call
+const BlendKernels* GetBestBlendKernels(void);
+
+// ---------------------------------------------------------------------------
+// Gamma and contrast correction
+//
+// Coverage blended linearly in sRGB makes light text on a dark background
+// look thin. Remapping the coverage through a table for the text color
+// first makes the linear blend look like one in linear light, as ClearType
+// does, so the kernels above stay as they are.
+
+#define BLEND_GAMMA_LINEAR   1000 // The gamma_level of linear blending
+#define BLEND_GAMMA_MAX      2200
+
+// The coverage tables of a text color
+struct BlendGamma {
+    uint8_t red[256];   // LCD coverage, by channel
+    uint8_t green[256];
+    uint8_t blue[256];
+    uint8_t gray[256];  // 8bpp coverage, by the luminance of the color
+};
+
+// The tables of fg_pixel for gamma_level, the gamma times 1000 as the
+// GammaLevel of Windows (clamped to 1000 to 2200), and contrast_level, the
+// EnhancedContrastLevel in percent (0: none). Returns NULL if the coverage
+// needs no correction, that is, for gamma 1.0 without contrast.
+// The tables are built on the first request and cached; the pointer is
+// valid until BLEND_GAMMA_CACHE_SIZE other tables are requested.
+#define BLEND_GAMMA_CACHE_SIZE 8
+const BlendGamma* GetBlendGamma(uint32_t fg_pixel, int gamma_level, int contrast_level);
+
+// Correct count pixels of 8bpp or LCD coverage into out
+void CorrectGrayCoverage(uint8_t* out, const uint8_t* coverage, int count, const BlendGamma* gamma);
+void CorrectLcdCoverage(uint8_t* out, const uint8_t* coverage, int count, const BlendGamma* gamma);
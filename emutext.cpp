@@ -0,0 +1,208 @@
+// emutext.cpp --- Headless text rendering with FreeType only
+// Author: katahiromz
+// License: MIT
+//
+// Draws a string into a memory surface instead of a device context, so that
+// the layout, alignment and compositing shared with EmulatedExtTextOutW can be
+// profiled on any system. The font side is simpler than that of emutype: one
+// face at one size, glyph indexes from FT_Get_Char_Index, and no VDMX heights,
+// font linking, raster codepages or shared caches. So its output matches that
+// of emutype only where these make no difference.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_LCD_FILTER_H
+#include "textrender.h"
+#include "blend.h"
+#include "utf8.h"
+
+static void usage(void)
+{
+    printf("Usage: emutext [options] <font file> <UTF-8 text>\n"
+           "  --height N      LOGFONT height; negative for the em height (default -32)\n"
+           "  --size WxH      surface size (default 640x160)\n"
+           "  --at X,Y        reference point (default 10,10)\n"
+           "  --align FLAGS   left, center, right, top, baseline, bottom, joined with '+'\n"
+           "  --color RRGGBB  text color (default 000000)\n"
+           "  --bk RRGGBB     background color (default FFFFFF)\n"
+           "  --opaque        OPAQUE background mode\n"
+           "  --mono | --gray 1bpp or 8bpp glyphs instead of LCD\n"
+           "  --gamma N       gamma times 1000, 1000 to 2200 (default 1000: linear)\n"
+           "  --contrast N    enhanced contrast in percent (default 0)\n"
+           "  --out FILE.bmp  save the surface\n"
+           "  --bench N       draw the text N times and report the speed\n");
+}
+
+static unsigned parse_align(const char* flags)
+{
+    unsigned align = TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP;
+    std::string rest = flags;
+    while (!rest.empty())
+    {
+        size_t plus = rest.find('+');
+        std::string flag = rest.substr(0, plus);
+        rest = (plus == std::string::npos) ? "" : rest.substr(plus + 1);
+        if (flag == "left")
+            align &= ~TEXT_ALIGN_CENTER;
+        else if (flag == "top")
+            align &= ~TEXT_ALIGN_BASELINE;
+        else if (flag == "center")
+            align = (align & ~TEXT_ALIGN_CENTER) | TEXT_ALIGN_CENTER;
+        else if (flag == "right")
+            align = (align & ~TEXT_ALIGN_CENTER) | TEXT_ALIGN_RIGHT;
+        else if (flag == "baseline")
+            align = (align & ~TEXT_ALIGN_BASELINE) | TEXT_ALIGN_BASELINE;
+        else if (flag == "bottom")
+            align = (align & ~TEXT_ALIGN_BASELINE) | TEXT_ALIGN_BOTTOM;
+    }
+    return align;
+}
+
+static void put_le(std::vector<unsigned char>& out, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        out.push_back((unsigned char)(value >> (i * 8)));
+}
+
+// Save as a top-down 32bpp BI_RGB bitmap, the format of the DIB sections of emutype
+static bool save_bmp(const char* path, const TextSurface& surface)
+{
+    uint32_t image_size = (uint32_t)surface.width * surface.height * 4;
+    std::vector<unsigned char> out;
+    put_le(out, 0x4D42, 2);            // bfType 'BM'
+    put_le(out, 14 + 40 + image_size, 4);
+    put_le(out, 0, 4);
+    put_le(out, 14 + 40, 4);           // bfOffBits
+    put_le(out, 40, 4);                // biSize
+    put_le(out, surface.width, 4);
+    put_le(out, (uint32_t)-surface.height, 4); // top-down
+    put_le(out, 1, 2);                 // biPlanes
+    put_le(out, 32, 2);                // biBitCount
+    put_le(out, 0, 4);                 // BI_RGB
+    put_le(out, image_size, 4);
+    put_le(out, 0, 4 * 4);
+    for (int y = 0; y < surface.height; ++y)
+    {
+        for (int x = 0; x < surface.width; ++x)
+            put_le(out, surface.bits[y * surface.stride + x], 4);
+    }
+
+    FILE* fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+    size_t written = fwrite(out.data(), 1, out.size(), fp);
+    return fclose(fp) == 0 && written == out.size();
+}
+
+int main(int argc, char** argv)
+{
+    int height = -32, width = 640, surface_height = 160, x = 10, y = 10, rounds = 0;
+    int gamma_level = BLEND_GAMMA_LINEAR, contrast_level = 0;
+    unsigned align = TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP;
+    uint32_t text_pixel = 0x000000, bk_pixel = 0xFFFFFF;
+    bool opaque = false;
+    FT_Int32 load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_LCD;
+    const char* out_path = NULL;
+    std::vector<const char*> args;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        bool has_value = (i + 1 < argc);
+        if (strcmp(arg, "--height") == 0 && has_value)
+            height = atoi(argv[++i]);
+        else if (strcmp(arg, "--size") == 0 && has_value)
+            sscanf(argv[++i], "%dx%d", &width, &surface_height);
+        else if (strcmp(arg, "--at") == 0 && has_value)
+            sscanf(argv[++i], "%d,%d", &x, &y);
+        else if (strcmp(arg, "--align") == 0 && has_value)
+            align = parse_align(argv[++i]);
+        else if (strcmp(arg, "--color") == 0 && has_value)
+            text_pixel = (uint32_t)strtoul(argv[++i], NULL, 16) & 0xFFFFFF;
+        else if (strcmp(arg, "--bk") == 0 && has_value)
+            bk_pixel = (uint32_t)strtoul(argv[++i], NULL, 16) & 0xFFFFFF;
+        else if (strcmp(arg, "--opaque") == 0)
+            opaque = true;
+        else if (strcmp(arg, "--mono") == 0)
+            load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_MONO;
+        else if (strcmp(arg, "--gray") == 0)
+            load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_NORMAL;
+        else if (strcmp(arg, "--gamma") == 0 && has_value)
+            gamma_level = atoi(argv[++i]);
+        else if (strcmp(arg, "--contrast") == 0 && has_value)
+            contrast_level = atoi(argv[++i]);
+        else if (strcmp(arg, "--out") == 0 && has_value)
+            out_path = argv[++i];
+        else if (strcmp(arg, "--bench") == 0 && has_value)
+            rounds = atoi(argv[++i]);
+        else if (arg[0] == '-' && arg[1] == '-')
+        {
+            usage();
+            return 1;
+        }
+        else
+            args.push_back(arg);
+    }
+    if (args.size() != 2 || width <= 0 || surface_height <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    FT_Library library;
+    FT_Face face;
+    if (FT_Init_FreeType(&library) != 0)
+        return -1;
+    FT_Library_SetLcdFilter(library, FT_LCD_FILTER_DEFAULT);
+    if (FT_New_Face(library, args[0], 0, &face) != 0)
+    {
+        fprintf(stderr, "%s: cannot open\n", args[0]);
+        FT_Done_FreeType(library);
+        return -1;
+    }
+
+    int ret = 0;
+    TextFace* text_face = OpenTextFace(face, height, load_flags);
+    if (text_face)
+    {
+        std::vector<uint32_t> pixels((size_t)width * surface_height, bk_pixel);
+        TextSurface surface = { pixels.data(), width, width, surface_height,
+                                { 0, 0, width, surface_height } };
+        TextState state = { text_pixel, bk_pixel, opaque, align, gamma_level, contrast_level };
+        std::vector<uint16_t> text = utf16_from_utf8(args[1]);
+        const uint16_t* chars = text.empty() ? NULL : text.data();
+        RenderText(&surface, text_face, &state, x, y, 0, NULL, chars, (int)text.size(), NULL);
+
+        if (rounds > 0)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < rounds; ++i)
+                RenderText(&surface, text_face, &state, x, y, 0, NULL, chars, (int)text.size(), NULL);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            printf("%d strings of %d characters: %.3f us per string (%s kernels)\n",
+                   rounds, (int)text.size(), elapsed.count() * 1e6 / rounds,
+                   GetBestBlendKernels()->name);
+        }
+
+        if (out_path && !save_bmp(out_path, surface))
+        {
+            fprintf(stderr, "%s: cannot write\n", out_path);
+            ret = -1;
+        }
+        CloseTextFace(text_face);
+    }
+    else
+    {
+        fprintf(stderr, "%s: cannot set the height %d\n", args[0], height);
+        ret = -1;
+    }
+
+    FT_Done_Face(face);
+    FT_Done_FreeType(library);
+    return ret;
+}
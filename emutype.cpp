@@ -6,26 +6,43 @@
 #include <shlwapi.h>
 #include <vector>
 #include <string>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
 #include <cstdlib>
 #include <cstdio>
+#include <cmath>
 #include <strsafe.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
+#include FT_SIZES_H
 #include FT_SFNT_NAMES_H
 #include FT_TRUETYPE_IDS_H
 #include FT_TRUETYPE_TABLES_H
 #include FT_WINFONTS_H
 #include FT_LCD_FILTER_H
+#include FT_OUTLINE_H
 
 #include "SaveBitmapToFile.h"
 #include "util.h"
+#include "fontmap.h"
+#include "fontwatch.h"
+#include "blend.h"
+#include "textrender.h"
 
 #define MAKE_SURROGATE_PAIR(w1, w2) \
     (0x10000 + (((DWORD)(w1) - HIGH_SURROGATE_START) << 10) + ((DWORD)(w2) - LOW_SURROGATE_START));
 
 #define _TMPF_VARIABLE_PITCH TMPF_FIXED_PITCH // TMPF_FIXED_PITCH is a brain-dead API
 
+// Debug output of font realization and drawing; build with EMUTYPE_TRACE to see it
+#ifdef EMUTYPE_TRACE
+    #define trace_printf(...) wprintf(__VA_ARGS__)
+#else
+    #define trace_printf(...) ((void)0)
+#endif
+
 const int WIDTH  = 300;
 const int HEIGHT = 100;
 const COLORREF BG = RGB(255, 255, 0);
@@ -39,25 +56,9 @@ const COLORREF color2 = RGB(255, 255, 0);
 // Using a different registry key for this test.
 const WCHAR* reg_key = L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\FontsEmulated";
 
-struct FontInfo {
-    WCHAR wide_path[MAX_PATH];
-    CHAR ansi_path[MAX_PATH];
-    FT_Long face_index;
-    std::wstring family_name;
-    std::wstring english_name;
-    FT_Long style_flags; // See FT_Face.style_flags
-    BYTE charset;
-    INT raster_height;
-    INT raster_internal_leading;
-};
-std::vector<FontInfo*> registered_fonts;
-
 WCHAR fonts_dir[MAX_PATH];
 FT_Library library;
 
-HBITMAP hbmMask_cache = NULL;
-int hbmMask_cache_w = 0, hbmMask_cache_h = 0;
-
 HRESULT
 _StringCchWideFromAnsi(UINT codepage, PWSTR wide, INT cchWide, PCSTR ansi)
 {
@@ -98,6 +99,256 @@ bool is_supported_font(const WCHAR *filename) {
            lstrcmpiW(pchDotExt, L".fnt") == 0;
 }
 
+// ---------------------------------------------------------------------------
+// Font table
+// Registered fonts are stored column by column and addressed by a 32-bit
+// FontId. A row is one charset of a face, or one strike of a raster face.
+// Rows from the same file share one FontFile record. Paths and names are
+// interned once in font_strings and referred to by their WCHAR offset.
+// ---------------------------------------------------------------------------
+
+typedef DWORD FontStringId; // WCHAR offset in font_strings; 0 is the empty string
+typedef DWORD FontId;       // Row of font_table
+#define INVALID_FONT_ID ((FontId)-1)
+
+std::vector<WCHAR> font_strings(1, UNICODE_NULL);
+std::unordered_map<std::wstring, FontStringId> font_string_ids;
+
+static FontStringId intern_font_string(const std::wstring& str)
+{
+    if (str.empty())
+        return 0;
+
+    auto it = font_string_ids.find(str);
+    if (it != font_string_ids.end())
+        return it->second;
+
+    FontStringId id = (FontStringId)font_strings.size();
+    font_strings.insert(font_strings.end(), str.begin(), str.end());
+    font_strings.push_back(UNICODE_NULL);
+    font_string_ids[str] = id;
+    return id;
+}
+
+// The returned pointer is valid until the next string is interned
+static inline PCWSTR font_string(FontStringId id)
+{
+    return &font_strings[id];
+}
+
+#define INVALID_FONT_FILE ((DWORD)-1)
+
+// A registered font file. Its fonts are the rows first_font to
+// first_font + num_fonts - 1. A removed file keeps its rows, but they are
+// no longer indexed.
+struct FontFile {
+    FontStringId path;
+    bool is_raster;
+    bool removed;
+    FontId first_font;
+    DWORD num_fonts;
+    ULONGLONG file_size;  // 0 if the file was not registered by a scan
+    ULONGLONG write_time;
+};
+
+// The metrics of a font as enumerated, in font units for an outline font
+// (at a size of one em) and in pixels for a raster font
+struct FontEnumMetrics {
+    SHORT ascent;
+    SHORT descent;
+    SHORT internal_leading;
+    SHORT external_leading;
+    SHORT avg_width;
+    SHORT max_width;
+    WORD size_em;    // ntmSizeEM; 0 for a raster font
+    WCHAR first_char;
+    WCHAR last_char;
+    WCHAR default_char;
+    WCHAR break_char;
+    WORD reserved;
+    DWORD ntm_flags; // NTM_*
+    FONTSIGNATURE signature;
+};
+
+// A font as read from a file or from the catalog, before it is registered
+struct FontRecord {
+    FT_Long face_index;
+    std::wstring family_name;
+    std::wstring english_name;
+    FT_Long style_flags; // See FT_Face.style_flags
+    BYTE charset;
+    INT raster_height;
+    INT raster_internal_leading;
+    INT raster_size; // Strike height as in FT_Bitmap_Size.height; 0 if none
+    BYTE pitch_and_family; // As in TEXTMETRIC.tmPitchAndFamily
+    BYTE font_flags; // FONT_FLAG_*
+    INT weight;
+    INT avg_width;   // Pixels for a raster font, 1/1000 em for an outline font
+    INT cell_height; // Pixels for a raster font, 1/1000 em for an outline font
+    std::wstring full_name;
+    std::wstring style_name;
+    FontEnumMetrics metrics;
+};
+
+#define FONT_FLAG_ITALIC    1
+#define FONT_FLAG_UNDERLINE 2
+#define FONT_FLAG_STRIKEOUT 4
+
+struct FontTable {
+    std::vector<FontFile> files;
+    std::unordered_map<FontStringId, DWORD> file_ids; // Path to index in files
+
+    // One entry per FontId
+    std::vector<DWORD> file;
+    std::vector<FontStringId> family_name;
+    std::vector<FontStringId> english_name;
+    std::vector<LONG> face_index;
+    std::vector<LONG> style_flags;
+    std::vector<BYTE> charset;
+    std::vector<SHORT> raster_height;
+    std::vector<SHORT> raster_internal_leading;
+    std::vector<SHORT> raster_size;
+
+    // Matching features; see the font matcher
+    std::vector<BYTE> pitch_and_family;
+    std::vector<BYTE> font_flags;
+    std::vector<SHORT> weight;
+    std::vector<SHORT> avg_width;
+    std::vector<SHORT> cell_height;
+    std::vector<UINT> base_penalty; // The penalties that do not depend on the request
+
+    // Font enumeration
+    std::vector<FontStringId> full_name;
+    std::vector<FontStringId> style_name;
+    std::vector<FontEnumMetrics> enum_metrics;
+
+    DWORD size() const { return (DWORD)file.size(); }
+};
+
+FontTable font_table;
+static DWORD font_set_serial = 0; // Bumped whenever a font file is added or removed
+
+// Get the registered file of a path, or INVALID_FONT_FILE
+static DWORD find_font_file(PCWSTR path)
+{
+    auto string_it = font_string_ids.find(path);
+    if (string_it == font_string_ids.end())
+        return INVALID_FONT_FILE;
+
+    auto it = font_table.file_ids.find(string_it->second);
+    if (it == font_table.file_ids.end() || font_table.files[it->second].removed)
+        return INVALID_FONT_FILE;
+    return it->second;
+}
+
+// Get the registered file of a path, adding a record if there is none.
+// Call add_font right after for each of its fonts.
+static DWORD add_font_file(PCWSTR path)
+{
+    DWORD index = find_font_file(path);
+    if (index != INVALID_FONT_FILE)
+        return index;
+
+    FontFile file;
+    file.path = intern_font_string(path);
+    file.is_raster = is_raster_font(path);
+    file.removed = false;
+    file.first_font = font_table.size();
+    file.num_fonts = 0;
+    file.file_size = file.write_time = 0;
+
+    index = (DWORD)font_table.files.size();
+    font_table.files.push_back(file);
+    font_table.file_ids[file.path] = index;
+    ++font_set_serial;
+    return index;
+}
+
+static inline LONG clamp_long(LONG value, LONG low, LONG high)
+{
+    return (value < low) ? low : ((value > high) ? high : value);
+}
+
+// The terms of GetFontPenalty that do not depend on the LOGFONT
+static UINT get_base_penalty(const FontRecord& record)
+{
+    UINT penalty = 2; // DeviceFavor: there is no device font
+
+    if ((record.pitch_and_family & 0xF0) == FF_DONTCARE)
+        penalty += 8000; // FamilyUnknown
+
+    // Aspect: the aspect ratio is 3 or more
+    LONG width = record.avg_width, height = record.cell_height;
+    if (width >= 5 && height >= 5)
+    {
+        if (width / height >= 3)
+            penalty += (width / height - 2) * 30;
+        else if (height / width >= 3)
+            penalty += (height / width - 2) * 30;
+    }
+
+    return penalty;
+}
+
+// The base penalty of a removed font. It loses to any live font.
+#define FONT_PENALTY_REMOVED 0x40000000
+
+static FontId add_font(DWORD file, const FontRecord& record)
+{
+    FontId id = font_table.size();
+    font_table.file.push_back(file);
+    font_table.family_name.push_back(intern_font_string(record.family_name));
+    font_table.english_name.push_back(intern_font_string(record.english_name));
+    font_table.face_index.push_back((LONG)record.face_index);
+    font_table.style_flags.push_back((LONG)record.style_flags);
+    font_table.charset.push_back(record.charset);
+    font_table.raster_height.push_back((SHORT)record.raster_height);
+    font_table.raster_internal_leading.push_back((SHORT)record.raster_internal_leading);
+    font_table.raster_size.push_back((SHORT)record.raster_size);
+    font_table.pitch_and_family.push_back(record.pitch_and_family);
+    font_table.font_flags.push_back(record.font_flags);
+    font_table.weight.push_back((SHORT)record.weight);
+    font_table.avg_width.push_back((SHORT)record.avg_width);
+    font_table.cell_height.push_back((SHORT)record.cell_height);
+    font_table.base_penalty.push_back(get_base_penalty(record));
+    font_table.full_name.push_back(intern_font_string(record.full_name));
+    font_table.style_name.push_back(intern_font_string(record.style_name));
+    font_table.enum_metrics.push_back(record.metrics);
+    ++font_table.files[file].num_fonts;
+    return id;
+}
+
+// Get the FontRecord of a registered font
+static void get_font_record(FontId id, FontRecord* record)
+{
+    record->face_index = font_table.face_index[id];
+    record->family_name = font_string(font_table.family_name[id]);
+    record->english_name = font_string(font_table.english_name[id]);
+    record->style_flags = font_table.style_flags[id];
+    record->charset = font_table.charset[id];
+    record->raster_height = font_table.raster_height[id];
+    record->raster_internal_leading = font_table.raster_internal_leading[id];
+    record->raster_size = font_table.raster_size[id];
+    record->pitch_and_family = font_table.pitch_and_family[id];
+    record->font_flags = font_table.font_flags[id];
+    record->weight = font_table.weight[id];
+    record->avg_width = font_table.avg_width[id];
+    record->cell_height = font_table.cell_height[id];
+    record->full_name = font_string(font_table.full_name[id]);
+    record->style_name = font_string(font_table.style_name[id]);
+    record->metrics = font_table.enum_metrics[id];
+}
+
+static inline const FontFile* get_font_file(FontId id)
+{
+    return &font_table.files[font_table.file[id]];
+}
+
+static inline PCWSTR get_font_path(FontId id)
+{
+    return font_string(get_font_file(id)->path);
+}
+
 // ---------------------------------------------------------------------------
 // VDMX (Vertical Device Metrics) table support
 // Mirrors Wine's load_VDMX() in dlls/win32u/freetype.c
@@ -138,14 +389,28 @@ struct VdmxEntry {
     int  yMin;   // pixel descent (negative, from baseline downward)
 };
 
-// Load and search the VDMX table embedded in an SFNT font.
-// lfHeight > 0 : search for the entry where yMax + (-yMin) == lfHeight
-//                (Windows "cell height" semantics)
-// lfHeight < 0 : search for the entry where yPelHeight == |lfHeight|
-//                (Windows "em height" / ppem semantics)
-// Returns true and fills *out on success.
-static bool load_VDMX(FT_Face face, int lfHeight, VdmxEntry* out)
+// Compact VDMX record: ppem == 0 marks an empty slot
+struct VdmxRecord {
+    WORD  ppem;
+    SHORT yMax;
+    SHORT yMin;
+};
+
+// The VDMX table of a face, parsed once and indexed for direct lookup.
+//   by_height[h] : entry for lfHeight == h  (Windows "cell height" semantics)
+//   by_ppem[p]   : entry for lfHeight == -p (Windows "em height" / ppem semantics)
+struct VdmxTable {
+    std::vector<VdmxRecord> by_height;
+    std::vector<VdmxRecord> by_ppem;
+};
+
+// Parse the VDMX table embedded in an SFNT font into *table.
+// Returns false (leaving *table empty) if the font has no usable VDMX.
+static bool parse_VDMX(FT_Face face, VdmxTable* table)
 {
+    table->by_height.clear();
+    table->by_ppem.clear();
+
     if (!FT_IS_SFNT(face)) return false;
 
     const FT_ULong VDMX_TAG = FT_MAKE_TAG('V','D','M','X');
@@ -165,7 +430,6 @@ static bool load_VDMX(FT_Face face, int lfHeight, VdmxEntry* out)
     VDMX_Header hdr;
     memcpy(&hdr, p, sizeof(hdr));
     WORD numRatios = be16(hdr.numRatios);
-    WORD numRecs   = be16(hdr.numRecs);
 
     // Find a matching ratio record.
     // We use device ratio 1:1 (same as Wine's fixed devXRatio/devYRatio = 1).
@@ -214,247 +478,768 @@ static bool load_VDMX(FT_Face face, int lfHeight, VdmxEntry* out)
 
     const VDMX_vTable* vt = reinterpret_cast<const VDMX_vTable*>(p + vtable_off);
 
-    if (lfHeight > 0)
+    std::vector<VdmxRecord> records(recs);
+    for (WORD i = 0; i < recs; ++i)
     {
-        // Cell-height mode: find entry where yMax + (-yMin) == lfHeight.
-        // Iterate in ascending ppem order; if we overshoot use the previous.
-        int prev_ppem = 0, prev_yMax = 0, prev_yMin = 0;
-        for (WORD i = 0; i < recs; ++i)
-        {
-            int ppem = (int)be16(vt[i].yPelHeight);
-            int yMax = (int)(SHORT)be16(vt[i].yMax);
-            int yMin = (int)(SHORT)be16(vt[i].yMin);
-            int cell = yMax + (-yMin);
+        records[i].ppem = be16(vt[i].yPelHeight);
+        records[i].yMax = (SHORT)be16(vt[i].yMax);
+        records[i].yMin = (SHORT)be16(vt[i].yMin);
+    }
 
-            if (cell == lfHeight)
-            {
-                out->ppem = ppem;
-                out->yMax = yMax;
-                out->yMin = yMin;
-                return true;
-            }
-            if (cell > lfHeight)
-            {
-                if (prev_ppem == 0) return false;
-                out->ppem = prev_ppem;
-                out->yMax = prev_yMax;
-                out->yMin = prev_yMin;
-                return true;
-            }
-            prev_ppem = ppem;
-            prev_yMax = yMax;
-            prev_yMin = yMin;
+    // Cell-height mode: use the entry where yMax + (-yMin) == lfHeight.
+    // Records are in ascending ppem order; if we overshoot use the previous.
+    // Every height up to the first cell that reaches it resolves to that record.
+    int max_cell = 0;
+    for (WORD i = 0; i < recs; ++i)
+    {
+        int cell = records[i].yMax - records[i].yMin;
+        if (cell <= max_cell)
+            continue;
+
+        table->by_height.resize(cell + 1);
+        for (int height = max_cell + 1; height <= cell; ++height)
+        {
+            VdmxRecord& slot = table->by_height[height];
+            if (height == cell)
+                slot = records[i];
+            else if (i > 0 && records[i - 1].ppem != 0)
+                slot = records[i - 1];
+            else
+                slot.ppem = 0;
         }
-        return false;   // no entry found within range
+        max_cell = cell;
     }
-    else
-    {
-        // Em-height / ppem mode: |lfHeight| must be in [startsz, endsz]
-        int target = -lfHeight;
-        if (target < startsz || target > endsz) return false;
 
-        for (WORD i = 0; i < recs; ++i)
+    // Em-height / ppem mode: |lfHeight| must be in [startsz, endsz].
+    // A scan for a ppem stops at the first record past it.
+    table->by_ppem.resize(endsz + 1);
+    WORD max_ppem = 0;
+    for (WORD i = 0; i < recs; ++i)
+    {
+        WORD ppem = records[i].ppem;
+        if (ppem >= max_ppem && startsz <= ppem && ppem <= endsz &&
+            table->by_ppem[ppem].ppem == 0)
         {
-            int ppem = (int)be16(vt[i].yPelHeight);
-            if (ppem > target) return false;   // past our target
-            if (ppem == target)
-            {
-                out->ppem = ppem;
-                out->yMax = (int)(SHORT)be16(vt[i].yMax);
-                out->yMin = (int)(SHORT)be16(vt[i].yMin);
-                return true;
-            }
+            table->by_ppem[ppem] = records[i];
         }
-        return false;
+        if (ppem > max_ppem)
+            max_ppem = ppem;
     }
+
+    return true;
 }
 
-// ---------------------------------------------------------------------------
-// calc_ppem_for_height  (Wine-compatible)
-//
-// Converts a LOGFONT lfHeight value to a FreeType ppem value.
-//
-//   lfHeight > 0  ?? cell height  ??  ppem = units_per_EM * lfHeight / (winAscent+winDescent)
-//   lfHeight < 0  ?? em   height  ??  ppem = |lfHeight|
-//   lfHeight == 0 ?? default 16px em
-//
-// Uses usWinAscent/usWinDescent from OS/2 table exactly as Windows does.
-// Falls back to hhea Ascender/Descender when the OS/2 values sum to zero.
-// ---------------------------------------------------------------------------
-static int calc_ppem_for_height(FT_Face face, int lfHeight)
+// Look up the parsed VDMX table.
+// lfHeight > 0 : the entry where yMax + (-yMin) == lfHeight
+//                (Windows "cell height" semantics)
+// lfHeight < 0 : the entry where yPelHeight == |lfHeight|
+//                (Windows "em height" / ppem semantics)
+// Returns true and fills *out on success.
+static bool lookup_VDMX(const VdmxTable* table, int lfHeight, VdmxEntry* out)
 {
-    if (lfHeight == 0) lfHeight = -16;   // Windows default
-
-    if (lfHeight < 0)
-        return -lfHeight;   // em-height: ppem == |lfHeight|
-
-    // Cell-height path: derive ppem from usWinAscent + usWinDescent
-    TT_OS2*        pOS2  = (TT_OS2*)       FT_Get_Sfnt_Table(face, FT_SFNT_OS2);
-    TT_HoriHeader* pHori = (TT_HoriHeader*)FT_Get_Sfnt_Table(face, FT_SFNT_HHEA);
-
-    int units;
-    if (pOS2)
+    const VdmxRecord* rec;
+    if (lfHeight > 0)
     {
-        // Some broken fonts store a huge negative value in usWinDescent
-        // (signed overflow). Take the absolute value to compensate.
-        int winAscent  = (int)pOS2->usWinAscent;
-        int winDescent = (int)abs((SHORT)pOS2->usWinDescent);
-
-        if (winAscent + winDescent != 0)
-            units = winAscent + winDescent;
-        else if (pHori)
-            units = (int)pHori->Ascender - (int)pHori->Descender;
-        else
-            units = (int)face->units_per_EM;
+        if ((size_t)lfHeight >= table->by_height.size()) return false;
+        rec = &table->by_height[lfHeight];
     }
-    else if (pHori)
-        units = (int)pHori->Ascender - (int)pHori->Descender;
     else
-        units = (int)face->units_per_EM;
-
-    // ppem = units_per_EM * lfHeight / units
-    int ppem = (int)FT_MulDiv((FT_Long)face->units_per_EM, (FT_Long)lfHeight, (FT_Long)units);
+    {
+        if ((size_t)-lfHeight >= table->by_ppem.size()) return false;
+        rec = &table->by_ppem[-lfHeight];
+    }
 
-    // If rounding caused us to exceed the requested height, step down by one
-    if (ppem > 1 && (int)FT_MulDiv((FT_Long)units, (FT_Long)ppem, (FT_Long)face->units_per_EM) > lfHeight)
-        --ppem;
+    if (rec->ppem == 0) return false;
 
-    return (ppem > 0) ? ppem : 1;
+    out->ppem = rec->ppem;
+    out->yMax = rec->yMax;
+    out->yMin = rec->yMin;
+    return true;
 }
 
-static std::wstring get_family_name(FT_Face face, FT_UShort name_id, bool localized, PCWSTR default_value)
-{
-    if (!FT_IS_SFNT(face))
-        return default_value;
+// ---------------------------------------------------------------------------
+// FT_Face cache
+// A face is opened once per (wide_path, face_index) and shared by every draw.
+// Unreferenced faces stay open until the LRU bound pushes them out.
+// ---------------------------------------------------------------------------
 
-    FT_UInt count = FT_Get_Sfnt_Name_Count(face);
+#define MAX_CACHED_FACES 32
+#define MAX_SIZES_PER_FACE 8
 
-    int best_priority = -1;
-    std::wstring best_name;
+// A realized scaler state of a face: pixel size (or bitmap strike) plus transform
+struct CachedSize {
+    FT_Int strike_index; // -1 for scalable sizes
+    FT_UInt ppem;
+    FT_Matrix matrix;
+    FT_Size size;
+};
 
-    for (FT_UInt i = 0; i < count; ++i)
-    {
-        FT_SfntName sname;
-        if (FT_Get_Sfnt_Name(face, i, &sname) != 0)
-            continue;
-        if (sname.name_id != name_id)
-            continue;
+// Codepoint to glyph index map of the active charmap of a face.
+// The BMP is a lazily filled two-level table of 256 pages of 256 glyph IDs;
+// other planes go through a hash map.
+struct CmapTable {
+    FT_CharMap charmap; // The charmap the table was built from
+    std::vector<std::vector<WORD> > pages;
+    std::unordered_map<FT_ULong, FT_UInt> astral;
+};
 
-        int priority = -1;
-        std::wstring name;
+// The set of codepoints a face maps, as 256-bit pages by codepoint >> 8.
+// Pages without any mapped codepoint share the empty page 0.
+struct CoverageSet {
+    std::vector<DWORD> pages; // By codepoint >> 8; index of the page in bits
+    std::vector<DWORD> bits;  // 8 DWORDs per page
+};
 
-        if (sname.platform_id == TT_PLATFORM_MICROSOFT &&
-            sname.encoding_id == TT_MS_ID_UNICODE_CS)
-        {
-            int wlen = (int)sname.string_len / 2;
-            std::vector<wchar_t> wbuf(wlen + 1, 0);
-            for (int j = 0; j < wlen; ++j) {
-                wbuf[j] = (wchar_t)((sname.string[j * 2] << 8) | sname.string[j * 2 + 1]);
-            }
-            name = std::wstring(wbuf.data(), wlen);
+struct CachedFace {
+    std::wstring wide_path;
+    FT_Long face_index;
+    const FontFileMapping* mapping; // The memory the face was created from
+    FT_Face face;
+    DWORD serial; // Unique per opened face; FT_Face pointers may be reused
+    LONG ref_count;
+    size_t hash;
+    std::list<CachedFace*>::iterator lru_it;
+    std::list<CachedSize> sizes; // The front is the active size
+    bool vdmx_parsed;
+    VdmxTable vdmx;
+    CmapTable cmap;
+    bool coverage_built;
+    CoverageSet coverage;
+    bool stale; // Its file changed; out of face_table, closed at the last release
+};
 
-            if (sname.language_id == GetUserDefaultLangID() && localized)
-                priority = 3;
-            else if (sname.language_id == TT_MS_LANGID_ENGLISH_UNITED_STATES)
-                priority = 2;
-            else
-                priority = 1;
-        }
-        else if (sname.platform_id == TT_PLATFORM_MACINTOSH &&
-                 sname.encoding_id == TT_MAC_ID_ROMAN)
-        {
-            // Mac Roman: usable as-is within the ASCII range
-            std::string aname = std::string(reinterpret_cast<const char*>(sname.string), sname.string_len);
-            WCHAR szWide[MAX_PATH];
-            _StringCchWideFromAnsi(CP_ACP, szWide, _countof(szWide), aname.c_str());
-            name = szWide;
-            priority = 0;
-        }
+static std::list<CachedFace*> face_lru; // The front is the most recently used
+static std::unordered_multimap<size_t, CachedFace*> face_table;
+static DWORD face_serial_counter = 0;
 
-        if (priority > best_priority)
+static size_t hash_face_key(PCWSTR wide_path, FT_Long face_index)
+{
+    // FNV-1a
+    size_t hash = 2166136261U;
+    for (; *wide_path; ++wide_path)
+        hash = (hash ^ (size_t)*wide_path) * 16777619U;
+    return (hash ^ (size_t)face_index) * 16777619U;
+}
+
+// Take the face out of face_table, so that AcquireFace no longer finds it
+static void unlist_cached_face(CachedFace* entry)
+{
+    auto range = face_table.equal_range(entry->hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second == entry)
         {
-            best_priority = priority;
-            best_name = name;
+            face_table.erase(it);
+            break;
         }
     }
+}
 
-    if (!best_name.empty())
-        return best_name;
+static void close_cached_face(CachedFace* entry)
+{
+    unlist_cached_face(entry);
+    FT_Done_Face(entry->face);
+    UnmapFontFile(entry->mapping);
+    delete entry;
+}
 
-    return default_value;
+// Close unreferenced faces from the cold end until we are within the bound
+static void trim_face_cache(void)
+{
+    auto it = face_lru.end();
+    while (face_table.size() > MAX_CACHED_FACES && it != face_lru.begin())
+    {
+        --it;
+        CachedFace* entry = *it;
+        if (entry->ref_count > 0)
+            continue;
+        it = face_lru.erase(it);
+        close_cached_face(entry);
+    }
 }
 
-static std::string get_style_name(FT_Face face, bool localized)
+// Get a shared face for the font. Call ReleaseFace when done with it.
+static FT_Face AcquireFace(FontId font_id)
 {
-    if (!FT_IS_SFNT(face))
-        return face->style_name ? face->style_name : "";
+    PCWSTR wide_path = get_font_path(font_id);
+    FT_Long face_index = font_table.face_index[font_id];
+    size_t hash = hash_face_key(wide_path, face_index);
 
-    FT_UInt count = FT_Get_Sfnt_Name_Count(face);
+    auto range = face_table.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        CachedFace* entry = it->second;
+        if (entry->face_index == face_index &&
+            lstrcmpW(entry->wide_path.c_str(), wide_path) == 0)
+        {
+            ++entry->ref_count;
+            face_lru.splice(face_lru.begin(), face_lru, entry->lru_it);
+            return entry->face;
+        }
+    }
 
-    int best_priority = -1;
-    std::string best_name;
+    const FontFileMapping* mapping = MapFontFile(wide_path);
+    if (!mapping)
+        return NULL;
 
-    for (FT_UInt i = 0; i < count; ++i)
+    FT_Face face;
+    if (FT_New_Memory_Face(library, mapping->data, (FT_Long)mapping->size, face_index, &face) != 0)
     {
-        FT_SfntName sname;
-        if (FT_Get_Sfnt_Name(face, i, &sname) != 0)
-            continue;
+        UnmapFontFile(mapping);
+        return NULL;
+    }
 
-        // TT_NAME_ID_FONT_SUBFAMILY refers to style names such as "Regular" or "Bold"
-        if (sname.name_id != TT_NAME_ID_FONT_SUBFAMILY)
-            continue;
+    CachedFace* entry = new CachedFace();
+    entry->wide_path = wide_path;
+    entry->face_index = face_index;
+    entry->mapping = mapping;
+    entry->face = face;
+    entry->serial = ++face_serial_counter;
+    entry->ref_count = 1;
+    entry->hash = hash;
+    entry->vdmx_parsed = false;
+    entry->coverage_built = false;
+    entry->stale = false;
+    face_lru.push_front(entry);
+    entry->lru_it = face_lru.begin();
+    face_table.insert(std::make_pair(hash, entry));
+    face->generic.data = entry;
+
+    trim_face_cache();
+    return face;
+}
 
-        int priority = -1;
-        std::string name;
+static void ReleaseFace(FT_Face face)
+{
+    if (!face)
+        return;
 
-        if (sname.platform_id == TT_PLATFORM_MICROSOFT &&
-            sname.encoding_id == TT_MS_ID_UNICODE_CS)
-        {
-            // Convert from UTF-16BE to UTF-8
-            int wlen = static_cast<int>(sname.string_len) / 2;
-            std::vector<wchar_t> wbuf(wlen + 1, 0);
-            for (int j = 0; j < wlen; ++j)
-            {
-                wbuf[j] = static_cast<wchar_t>(
-                    (sname.string[j * 2] << 8) | sname.string[j * 2 + 1]);
-            }
-            int mblen = WideCharToMultiByte(CP_UTF8, 0, &wbuf[0], wlen, NULL, 0, NULL, NULL);
-            if (mblen > 0)
-            {
-                std::string mbstr(mblen, '\0');
-                WideCharToMultiByte(CP_UTF8, 0, &wbuf[0], wlen, &mbstr[0], mblen, NULL, NULL);
-                name = mbstr;
-            }
+    CachedFace* entry = (CachedFace*)face->generic.data;
+    if (--entry->ref_count == 0 && entry->stale)
+    {
+        face_lru.erase(entry->lru_it);
+        close_cached_face(entry);
+        return;
+    }
+    trim_face_cache();
+}
 
-            if (sname.language_id == GetUserDefaultLangID() && localized)
-                priority = 3;
-            else if (sname.language_id == TT_MS_LANGID_ENGLISH_UNITED_STATES)
-                priority = 2;
-            else
-                priority = 1;
+// Retire the faces of a file that changed or went away. The unreferenced
+// ones are closed; the ones still in use are hidden from AcquireFace, so
+// that the file registered again gets faces of its new contents, and are
+// closed at their last release.
+static void RetireFaces(PCWSTR wide_path)
+{
+    for (auto it = face_lru.begin(); it != face_lru.end(); )
+    {
+        CachedFace* entry = *it;
+        if (entry->stale || lstrcmpW(entry->wide_path.c_str(), wide_path) != 0)
+        {
+            ++it;
         }
-        else if (sname.platform_id == TT_PLATFORM_MACINTOSH &&
-                 sname.encoding_id == TT_MAC_ID_ROMAN)
+        else if (entry->ref_count == 0)
         {
-            name = std::string(reinterpret_cast<const char*>(sname.string), sname.string_len);
-            priority = 0;
+            it = face_lru.erase(it);
+            close_cached_face(entry);
         }
-
-        if (priority > best_priority)
+        else
         {
-            best_priority = priority;
-            best_name = name;
+            unlist_cached_face(entry);
+            entry->stale = true;
+            ++it;
         }
     }
+}
 
-    if (!best_name.empty())
-        return best_name;
+static const FT_Matrix identity_matrix = { 0x10000, 0, 0, 0x10000 };
 
-    // Fallback: use the style name held by FreeType by default
-    return face->style_name ? face->style_name : "";
+static inline bool equal_matrix(const FT_Matrix& m1, const FT_Matrix& m2)
+{
+    return m1.xx == m2.xx && m1.xy == m2.xy && m1.yx == m2.yx && m1.yy == m2.yy;
 }
 
-TEXTMETRICW* get_raster_text_metrics(FT_Face face, FontInfo* info) {
+// Make a pooled FT_Size of the face active, creating it on first use.
+// strike_index >= 0 selects a bitmap strike, otherwise ppem is used.
+// matrix may be NULL for the identity transform.
+static FT_Error ActivateFaceSize(FT_Face face, FT_UInt ppem, FT_Int strike_index,
+                                 const FT_Matrix* matrix)
+{
+    CachedFace* entry = (CachedFace*)face->generic.data;
+    if (!matrix)
+        matrix = &identity_matrix;
+    if (strike_index >= 0)
+        ppem = 0;
+
+    for (auto it = entry->sizes.begin(); it != entry->sizes.end(); ++it)
+    {
+        if (it->strike_index == strike_index && it->ppem == ppem &&
+            equal_matrix(it->matrix, *matrix))
+        {
+            if (it != entry->sizes.begin())
+                entry->sizes.splice(entry->sizes.begin(), entry->sizes, it);
+            FT_Activate_Size(it->size);
+            FT_Set_Transform(face, const_cast<FT_Matrix*>(matrix), NULL);
+            return 0;
+        }
+    }
+
+    CachedSize cached;
+    FT_Error error = FT_New_Size(face, &cached.size);
+    if (error)
+        return error;
+
+    FT_Activate_Size(cached.size);
+    if (strike_index >= 0)
+        error = FT_Select_Size(face, strike_index);
+    else
+        error = FT_Set_Pixel_Sizes(face, 0, ppem);
+    if (error)
+    {
+        FT_Done_Size(cached.size);
+        return error;
+    }
+    FT_Set_Transform(face, const_cast<FT_Matrix*>(matrix), NULL);
+
+    cached.strike_index = strike_index;
+    cached.ppem = ppem;
+    cached.matrix = *matrix;
+    entry->sizes.push_front(cached);
+
+    if (entry->sizes.size() > MAX_SIZES_PER_FACE)
+    {
+        FT_Done_Size(entry->sizes.back().size);
+        entry->sizes.pop_back();
+    }
+
+    return 0;
+}
+
+// Keep the active size of the face but switch to another transform
+static FT_Error SetFaceTransform(FT_Face face, const FT_Matrix* matrix)
+{
+    CachedFace* entry = (CachedFace*)face->generic.data;
+    if (entry->sizes.empty())
+    {
+        FT_Set_Transform(face, const_cast<FT_Matrix*>(matrix), NULL);
+        return 0;
+    }
+
+    const CachedSize& active = entry->sizes.front();
+    return ActivateFaceSize(face, active.ppem, active.strike_index, matrix);
+}
+
+// Get the VDMX table of the face, parsing it on first use
+static const VdmxTable* GetFaceVdmx(FT_Face face)
+{
+    CachedFace* entry = (CachedFace*)face->generic.data;
+    if (!entry->vdmx_parsed)
+    {
+        parse_VDMX(face, &entry->vdmx);
+        entry->vdmx_parsed = true;
+    }
+    return &entry->vdmx;
+}
+
+static void build_coverage(FT_Face face, CoverageSet* coverage)
+{
+    coverage->pages.clear();
+    coverage->bits.assign(8, 0);
+
+    FT_UInt glyph_index;
+    FT_ULong code = FT_Get_First_Char(face, &glyph_index);
+    while (glyph_index != 0 && code < 0x110000)
+    {
+        FT_ULong page = code >> 8;
+        if (page >= coverage->pages.size())
+            coverage->pages.resize(page + 1, 0);
+        if (coverage->pages[page] == 0)
+        {
+            coverage->pages[page] = (DWORD)(coverage->bits.size() / 8);
+            coverage->bits.resize(coverage->bits.size() + 8, 0);
+        }
+        coverage->bits[coverage->pages[page] * 8 + ((code & 0xFF) >> 5)] |= 1U << (code & 31);
+        code = FT_Get_Next_Char(face, code, &glyph_index);
+    }
+}
+
+// Does the active charmap of the face map the codepoint?
+// A bit test on the coverage of the face, built on first use.
+static bool FaceHasChar(FT_Face face, FT_ULong codepoint)
+{
+    CachedFace* entry = (CachedFace*)face->generic.data;
+    if (!entry->coverage_built)
+    {
+        build_coverage(face, &entry->coverage);
+        entry->coverage_built = true;
+    }
+
+    const CoverageSet& coverage = entry->coverage;
+    FT_ULong page = codepoint >> 8;
+    if (page >= coverage.pages.size())
+        return false;
+    DWORD bits = coverage.bits[coverage.pages[page] * 8 + ((codepoint & 0xFF) >> 5)];
+    return (bits >> (codepoint & 31)) & 1;
+}
+
+// Map a codepoint to a glyph index like FT_Get_Char_Index, through the
+// per-face table
+static FT_UInt GetGlyphIndex(FT_Face face, FT_ULong codepoint)
+{
+    CachedFace* entry = (CachedFace*)face->generic.data;
+    CmapTable& cmap = entry->cmap;
+    if (cmap.charmap != face->charmap || cmap.pages.empty())
+    {
+        cmap.charmap = face->charmap;
+        cmap.pages.assign(256, std::vector<WORD>());
+        cmap.astral.clear();
+    }
+
+    if (codepoint >= 0x10000)
+    {
+        auto found = cmap.astral.find(codepoint);
+        if (found != cmap.astral.end())
+            return found->second;
+        FT_UInt glyph_index = FT_Get_Char_Index(face, codepoint);
+        cmap.astral[codepoint] = glyph_index;
+        return glyph_index;
+    }
+
+    std::vector<WORD>& page = cmap.pages[codepoint >> 8];
+    if (page.empty())
+    {
+        // Fill the whole page, walking only the mapped codepoints in it
+        page.assign(256, 0);
+        FT_ULong first = codepoint & ~0xFF;
+        page[0] = (WORD)FT_Get_Char_Index(face, first);
+
+        FT_UInt glyph_index;
+        FT_ULong code = FT_Get_Next_Char(face, first, &glyph_index);
+        while (glyph_index != 0 && code < first + 256)
+        {
+            page[code - first] = (WORD)glyph_index;
+            code = FT_Get_Next_Char(face, code, &glyph_index);
+        }
+    }
+    return page[codepoint & 0xFF];
+}
+
+static void FreeFaceCache(void)
+{
+    for (auto* entry : face_lru)
+    {
+        FT_Done_Face(entry->face);
+        UnmapFontFile(entry->mapping);
+        delete entry;
+    }
+    face_lru.clear();
+    face_table.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Rendered glyph cache
+// Like ReactOS's IntGetBitmapGlyphWithCache, but hash-indexed and bounded by
+// a byte budget instead of an entry count.
+// ---------------------------------------------------------------------------
+
+#define DEFAULT_GLYPH_CACHE_BUDGET (4 * 1024 * 1024)
+
+struct GlyphKey {
+    DWORD face_serial;
+    FT_Int strike_index;
+    FT_UInt ppem;
+    FT_Matrix matrix;
+    FT_Int32 load_flags;
+    FT_UInt glyph_index;
+
+    bool operator==(const GlyphKey& other) const
+    {
+        return face_serial == other.face_serial &&
+               strike_index == other.strike_index && ppem == other.ppem &&
+               equal_matrix(matrix, other.matrix) &&
+               load_flags == other.load_flags && glyph_index == other.glyph_index;
+    }
+};
+
+struct GlyphKeyHash {
+    size_t operator()(const GlyphKey& key) const
+    {
+        size_t hash = key.face_serial;
+        hash = hash * 31 + (size_t)key.strike_index;
+        hash = hash * 31 + key.ppem;
+        hash = hash * 31 + (size_t)key.matrix.xx;
+        hash = hash * 31 + (size_t)key.matrix.xy;
+        hash = hash * 31 + (size_t)key.matrix.yx;
+        hash = hash * 31 + (size_t)key.matrix.yy;
+        hash = hash * 31 + (size_t)key.load_flags;
+        return hash * 31 + key.glyph_index;
+    }
+};
+
+struct CachedGlyph {
+    GlyphKey key;
+    FT_Bitmap bitmap; // bitmap.buffer points into pixels
+    FT_Int bitmap_left;
+    FT_Int bitmap_top;
+    FT_Vector advance;
+    std::vector<BYTE> pixels;
+    size_t bytes;
+};
+
+struct GlyphCacheStats {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t bytes;
+    size_t count;
+};
+
+typedef std::list<CachedGlyph> GlyphList;
+static GlyphList glyph_lru; // The front is the most recently used
+static std::unordered_map<GlyphKey, GlyphList::iterator, GlyphKeyHash> glyph_table;
+static size_t glyph_cache_budget = DEFAULT_GLYPH_CACHE_BUDGET;
+static GlyphCacheStats glyph_cache_stats;
+static int glyph_cache_holds = 0; // Nothing is evicted while held
+
+static void trim_glyph_cache(void)
+{
+    if (glyph_cache_holds > 0)
+        return;
+
+    // Never evict the front entry; the caller is about to use it
+    while (glyph_cache_stats.bytes > glyph_cache_budget && glyph_lru.size() > 1)
+    {
+        CachedGlyph& victim = glyph_lru.back();
+        glyph_cache_stats.bytes -= victim.bytes;
+        glyph_table.erase(victim.key);
+        glyph_lru.pop_back();
+        ++glyph_cache_stats.evictions;
+    }
+    glyph_cache_stats.count = glyph_lru.size();
+}
+
+void SetGlyphCacheBudget(size_t bytes)
+{
+    glyph_cache_budget = bytes;
+    trim_glyph_cache();
+}
+
+void GetGlyphCacheStats(GlyphCacheStats* stats)
+{
+    *stats = glyph_cache_stats;
+}
+
+// Keep every glyph returned by GetCachedGlyph valid until ReleaseGlyphCache,
+// so that the glyphs of a whole string can be composited at once
+static void HoldGlyphCache(void)
+{
+    ++glyph_cache_holds;
+}
+
+static void ReleaseGlyphCache(void)
+{
+    --glyph_cache_holds;
+    trim_glyph_cache();
+}
+
+// Look up a glyph rendered at the active size and transform of the face,
+// loading it with load_flags on a miss. The result stays valid until the
+// next call, or while the cache is held.
+static const CachedGlyph* GetCachedGlyph(FT_Face face, FT_UInt glyph_index, FT_Int32 load_flags)
+{
+    CachedFace* entry = (CachedFace*)face->generic.data;
+
+    GlyphKey key;
+    key.face_serial = entry->serial;
+    if (entry->sizes.empty())
+    {
+        key.strike_index = -1;
+        key.ppem = 0;
+        key.matrix = identity_matrix;
+    }
+    else
+    {
+        const CachedSize& active = entry->sizes.front();
+        key.strike_index = active.strike_index;
+        key.ppem = active.ppem;
+        key.matrix = active.matrix;
+    }
+    key.load_flags = load_flags;
+    key.glyph_index = glyph_index;
+
+    auto found = glyph_table.find(key);
+    if (found != glyph_table.end())
+    {
+        ++glyph_cache_stats.hits;
+        glyph_lru.splice(glyph_lru.begin(), glyph_lru, found->second);
+        return &*found->second;
+    }
+
+    ++glyph_cache_stats.misses;
+    if (FT_Load_Glyph(face, glyph_index, load_flags) != 0)
+        return NULL;
+
+    FT_GlyphSlot slot = face->glyph;
+    glyph_lru.push_front(CachedGlyph());
+    CachedGlyph& glyph = glyph_lru.front();
+    glyph.key = key;
+    glyph.bitmap = slot->bitmap;
+    glyph.bitmap_left = slot->bitmap_left;
+    glyph.bitmap_top = slot->bitmap_top;
+    glyph.advance = slot->advance;
+
+    size_t src_pitch = (slot->bitmap.pitch < 0) ? -slot->bitmap.pitch : slot->bitmap.pitch;
+    size_t size = src_pitch * slot->bitmap.rows;
+    if (size && slot->bitmap.buffer)
+        glyph.pixels.assign(slot->bitmap.buffer, slot->bitmap.buffer + size);
+    glyph.bitmap.buffer = glyph.pixels.empty() ? NULL : glyph.pixels.data();
+    glyph.bytes = sizeof(CachedGlyph) + size;
+
+    glyph_table[key] = glyph_lru.begin();
+    glyph_cache_stats.bytes += glyph.bytes;
+    trim_glyph_cache();
+    return &glyph;
+}
+
+static void FreeGlyphCache(void)
+{
+    glyph_table.clear();
+    glyph_lru.clear();
+    glyph_cache_stats.bytes = glyph_cache_stats.count = 0;
+}
+
+static std::wstring get_family_name(FT_Face face, FT_UShort name_id, bool localized, PCWSTR default_value)
+{
+    if (!FT_IS_SFNT(face))
+        return default_value;
+
+    FT_UInt count = FT_Get_Sfnt_Name_Count(face);
+
+    int best_priority = -1;
+    std::wstring best_name;
+
+    for (FT_UInt i = 0; i < count; ++i)
+    {
+        FT_SfntName sname;
+        if (FT_Get_Sfnt_Name(face, i, &sname) != 0)
+            continue;
+        if (sname.name_id != name_id)
+            continue;
+
+        int priority = -1;
+        std::wstring name;
+
+        if (sname.platform_id == TT_PLATFORM_MICROSOFT &&
+            sname.encoding_id == TT_MS_ID_UNICODE_CS)
+        {
+            int wlen = (int)sname.string_len / 2;
+            std::vector<wchar_t> wbuf(wlen + 1, 0);
+            for (int j = 0; j < wlen; ++j) {
+                wbuf[j] = (wchar_t)((sname.string[j * 2] << 8) | sname.string[j * 2 + 1]);
+            }
+            name = std::wstring(wbuf.data(), wlen);
+
+            if (sname.language_id == GetUserDefaultLangID() && localized)
+                priority = 3;
+            else if (sname.language_id == TT_MS_LANGID_ENGLISH_UNITED_STATES)
+                priority = 2;
+            else
+                priority = 1;
+        }
+        else if (sname.platform_id == TT_PLATFORM_MACINTOSH &&
+                 sname.encoding_id == TT_MAC_ID_ROMAN)
+        {
+            // Mac Roman: usable as-is within the ASCII range
+            std::string aname = std::string(reinterpret_cast<const char*>(sname.string), sname.string_len);
+            WCHAR szWide[MAX_PATH];
+            _StringCchWideFromAnsi(CP_ACP, szWide, _countof(szWide), aname.c_str());
+            name = szWide;
+            priority = 0;
+        }
+
+        if (priority > best_priority)
+        {
+            best_priority = priority;
+            best_name = name;
+        }
+    }
+
+    if (!best_name.empty())
+        return best_name;
+
+    return default_value;
+}
+
+static std::string get_style_name(FT_Face face, bool localized)
+{
+    if (!FT_IS_SFNT(face))
+        return face->style_name ? face->style_name : "";
+
+    FT_UInt count = FT_Get_Sfnt_Name_Count(face);
+
+    int best_priority = -1;
+    std::string best_name;
+
+    for (FT_UInt i = 0; i < count; ++i)
+    {
+        FT_SfntName sname;
+        if (FT_Get_Sfnt_Name(face, i, &sname) != 0)
+            continue;
+
+        // TT_NAME_ID_FONT_SUBFAMILY refers to style names such as "Regular" or "Bold"
+        if (sname.name_id != TT_NAME_ID_FONT_SUBFAMILY)
+            continue;
+
+        int priority = -1;
+        std::string name;
+
+        if (sname.platform_id == TT_PLATFORM_MICROSOFT &&
+            sname.encoding_id == TT_MS_ID_UNICODE_CS)
+        {
+            // Convert from UTF-16BE to UTF-8
+            int wlen = static_cast<int>(sname.string_len) / 2;
+            std::vector<wchar_t> wbuf(wlen + 1, 0);
+            for (int j = 0; j < wlen; ++j)
+            {
+                wbuf[j] = static_cast<wchar_t>(
+                    (sname.string[j * 2] << 8) | sname.string[j * 2 + 1]);
+            }
+            int mblen = WideCharToMultiByte(CP_UTF8, 0, &wbuf[0], wlen, NULL, 0, NULL, NULL);
+            if (mblen > 0)
+            {
+                std::string mbstr(mblen, '\0');
+                WideCharToMultiByte(CP_UTF8, 0, &wbuf[0], wlen, &mbstr[0], mblen, NULL, NULL);
+                name = mbstr;
+            }
+
+            if (sname.language_id == GetUserDefaultLangID() && localized)
+                priority = 3;
+            else if (sname.language_id == TT_MS_LANGID_ENGLISH_UNITED_STATES)
+                priority = 2;
+            else
+                priority = 1;
+        }
+        else if (sname.platform_id == TT_PLATFORM_MACINTOSH &&
+                 sname.encoding_id == TT_MAC_ID_ROMAN)
+        {
+            name = std::string(reinterpret_cast<const char*>(sname.string), sname.string_len);
+            priority = 0;
+        }
+
+        if (priority > best_priority)
+        {
+            best_priority = priority;
+            best_name = name;
+        }
+    }
+
+    if (!best_name.empty())
+        return best_name;
+
+    // Fallback: use the style name held by FreeType by default
+    return face->style_name ? face->style_name : "";
+}
+
+TEXTMETRICW* get_raster_text_metrics(FT_Face face) {
     FT_WinFNT_HeaderRec WinFNT;
     if (FT_Get_WinFNT_Header(face, &WinFNT) != 0)
         return NULL;
@@ -604,18 +1389,168 @@ OUTLINETEXTMETRICW* get_outline_text_metrics(FT_Face face, BYTE charset) {
     return potm;
 }
 
-bool load_font(PCWSTR path, int face_index)
+// Set the matching features and the enumeration metrics of an outline face.
+// The family is guessed from the PANOSE classification like Wine does.
+static void get_outline_features(FT_Face face, FontRecord* info)
 {
-    CHAR ansi_path[MAX_PATH];
-    _StringCchAnsiFromWide(CP_ACP, ansi_path, _countof(ansi_path), path);
+    TT_OS2* pOS2 = (TT_OS2*)FT_Get_Sfnt_Table(face, FT_SFNT_OS2);
 
-    int iStart = (face_index == -1) ? 0 : face_index;
-    FT_Face face;
-    FT_Error error = FT_New_Face(library, ansi_path, iStart, &face);
-    if (error)
-        return false;
+    bool fixed = FT_IS_FIXED_WIDTH(face);
+    BYTE pitch = fixed ? 0 : _TMPF_VARIABLE_PITCH;
+    if (FT_IS_SCALABLE(face))
+        pitch |= TMPF_VECTOR;
+    if (FT_IS_SFNT(face))
+        pitch |= TMPF_TRUETYPE;
+
+    BYTE family = FF_DONTCARE;
+    if (pOS2 && pOS2->panose[0] == 3) // PAN_FAMILY_SCRIPT
+        family = FF_SCRIPT;
+    else if (pOS2 && pOS2->panose[0] == 4) // PAN_FAMILY_DECORATIVE
+        family = FF_DECORATIVE;
+    else if (fixed)
+        family = FF_MODERN;
+    else if (pOS2 && 2 <= pOS2->panose[1] && pOS2->panose[1] <= 10) // Cove to Triangle
+        family = FF_ROMAN;
+    else if (pOS2 && 11 <= pOS2->panose[1] && pOS2->panose[1] <= 15) // Normal Sans to Rounded
+        family = FF_SWISS;
+    info->pitch_and_family = pitch | family;
+
+    info->font_flags = 0;
+    if (face->style_flags & FT_STYLE_FLAG_ITALIC)
+        info->font_flags |= FONT_FLAG_ITALIC;
+    if (pOS2 && (pOS2->fsSelection & 0x80))
+        info->font_flags |= FONT_FLAG_UNDERLINE;
+    if (pOS2 && (pOS2->fsSelection & 0x10))
+        info->font_flags |= FONT_FLAG_STRIKEOUT;
+
+    if (pOS2 && pOS2->usWeightClass)
+        info->weight = pOS2->usWeightClass;
+    else
+        info->weight = (face->style_flags & FT_STYLE_FLAG_BOLD) ? FW_BOLD : FW_NORMAL;
+
+    LONG em = face->units_per_EM ? face->units_per_EM : 1000;
+    LONG width = pOS2 ? pOS2->xAvgCharWidth : face->max_advance_width / 2;
+    LONG height = (pOS2 && pOS2->usWinAscent + pOS2->usWinDescent) ?
+                  pOS2->usWinAscent + pOS2->usWinDescent : face->ascender - face->descender;
+    info->avg_width = (INT)clamp_long(width * 1000 / em, 0, 0x7FFF);
+    info->cell_height = (INT)clamp_long(height * 1000 / em, 0, 0x7FFF);
+
+    // The metrics at a size of one em, like Wine enumerates them
+    FontEnumMetrics& metrics = info->metrics;
+    ZeroMemory(&metrics, sizeof(metrics));
+    TT_HoriHeader* hhea = (TT_HoriHeader*)FT_Get_Sfnt_Table(face, FT_SFNT_HHEA);
+    if (pOS2 && (pOS2->usWinAscent || pOS2->usWinDescent))
+    {
+        metrics.ascent = (SHORT)clamp_long(pOS2->usWinAscent, 0, 0x7FFF);
+        metrics.descent = (SHORT)clamp_long(pOS2->usWinDescent, 0, 0x7FFF);
+    }
+    else
+    {
+        metrics.ascent = (SHORT)clamp_long(face->ascender, 0, 0x7FFF);
+        metrics.descent = (SHORT)clamp_long(-face->descender, 0, 0x7FFF);
+    }
+    metrics.internal_leading = (SHORT)clamp_long(metrics.ascent + metrics.descent - em, 0, 0x7FFF);
+    if (hhea)
+    {
+        LONG line_gap = hhea->Line_Gap - ((metrics.ascent + metrics.descent) -
+                                          (hhea->Ascender - hhea->Descender));
+        metrics.external_leading = (SHORT)clamp_long(line_gap, 0, 0x7FFF);
+    }
+    metrics.avg_width = (SHORT)clamp_long(width, 0, 0x7FFF);
+    metrics.max_width = (SHORT)clamp_long(face->max_advance_width, 0, 0x7FFF);
+    metrics.size_em = (WORD)em;
+
+    metrics.first_char = pOS2 ? pOS2->usFirstCharIndex : 0x20;
+    metrics.last_char = pOS2 ? pOS2->usLastCharIndex : 0xFFFF;
+    metrics.default_char = (pOS2 && pOS2->version >= 2 && pOS2->usDefaultChar) ? pOS2->usDefaultChar : 0x1F;
+    metrics.break_char = (pOS2 && pOS2->version >= 2 && pOS2->usBreakChar) ? pOS2->usBreakChar : 0x20;
+
+    if (face->style_flags & FT_STYLE_FLAG_ITALIC)
+        metrics.ntm_flags |= NTM_ITALIC;
+    if (info->weight >= FW_BOLD)
+        metrics.ntm_flags |= NTM_BOLD;
+    if (!metrics.ntm_flags)
+        metrics.ntm_flags = NTM_REGULAR;
+
+    if (pOS2)
+    {
+        metrics.signature.fsUsb[0] = pOS2->ulUnicodeRange1;
+        metrics.signature.fsUsb[1] = pOS2->ulUnicodeRange2;
+        metrics.signature.fsUsb[2] = pOS2->ulUnicodeRange3;
+        metrics.signature.fsUsb[3] = pOS2->ulUnicodeRange4;
+        metrics.signature.fsCsb[0] = pOS2->ulCodePageRange1;
+        metrics.signature.fsCsb[1] = pOS2->ulCodePageRange2;
+    }
+}
+
+// Set the matching features and the enumeration metrics of the selected
+// strike of a bitmap face
+static void get_raster_features(FT_Face face, const FT_WinFNT_HeaderRec* WinFNT, FontRecord* info)
+{
+    if (WinFNT)
+    {
+        info->pitch_and_family = WinFNT->pitch_and_family & ~(TMPF_VECTOR | TMPF_TRUETYPE | TMPF_DEVICE);
+        info->font_flags = 0;
+        if (WinFNT->italic)
+            info->font_flags |= FONT_FLAG_ITALIC;
+        if (WinFNT->underline)
+            info->font_flags |= FONT_FLAG_UNDERLINE;
+        if (WinFNT->strike_out)
+            info->font_flags |= FONT_FLAG_STRIKEOUT;
+        info->weight = WinFNT->weight;
+        info->avg_width = WinFNT->avg_width;
+        info->cell_height = WinFNT->pixel_height;
+    }
+    else
+    {
+        info->pitch_and_family = FT_IS_FIXED_WIDTH(face) ? FF_MODERN : (_TMPF_VARIABLE_PITCH | FF_DONTCARE);
+        info->font_flags = (face->style_flags & FT_STYLE_FLAG_ITALIC) ? FONT_FLAG_ITALIC : 0;
+        info->weight = (face->style_flags & FT_STYLE_FLAG_BOLD) ? FW_BOLD : FW_NORMAL;
+        info->avg_width = info->cell_height = 0;
+        if (face->size)
+        {
+            info->avg_width = (INT)((face->size->metrics.max_advance + 32) >> 6);
+            info->cell_height = (INT)((face->size->metrics.height + 32) >> 6);
+        }
+    }
+
+    FontEnumMetrics& metrics = info->metrics;
+    ZeroMemory(&metrics, sizeof(metrics));
+    if (WinFNT)
+    {
+        metrics.ascent = WinFNT->ascent;
+        metrics.descent = WinFNT->pixel_height - WinFNT->ascent;
+        metrics.internal_leading = WinFNT->internal_leading;
+        metrics.external_leading = WinFNT->external_leading;
+        metrics.avg_width = WinFNT->avg_width;
+        metrics.max_width = WinFNT->max_width;
+        metrics.first_char = WinFNT->first_char;
+        metrics.last_char = WinFNT->last_char;
+        metrics.default_char = WinFNT->first_char + WinFNT->default_char;
+        metrics.break_char = WinFNT->first_char + WinFNT->break_char;
+    }
+    else if (face->size)
+    {
+        metrics.ascent = (SHORT)((face->size->metrics.ascender + 32) >> 6);
+        metrics.descent = (SHORT)(info->cell_height - metrics.ascent);
+        metrics.avg_width = metrics.max_width = (SHORT)info->avg_width;
+        metrics.first_char = 0x20;
+        metrics.last_char = 0xFF;
+        metrics.default_char = 0x1F;
+        metrics.break_char = 0x20;
+    }
+
+    if (info->font_flags & FONT_FLAG_ITALIC)
+        metrics.ntm_flags |= NTM_ITALIC;
+    if (info->weight >= FW_BOLD)
+        metrics.ntm_flags |= NTM_BOLD;
+    if (!metrics.ntm_flags)
+        metrics.ntm_flags = NTM_REGULAR;
+}
 
-    FT_Long num_faces = face->num_faces;
+// Append the FontRecords of an opened face to fonts
+static void add_face_records(FT_Face face, FT_Long face_index, std::vector<FontRecord>& fonts)
+{
     std::vector<BYTE> charsets;
 
     TT_OS2* pOS2 = (TT_OS2*)FT_Get_Sfnt_Table(face, FT_SFNT_OS2);
@@ -643,6 +1578,16 @@ bool load_font(PCWSTR path, int face_index)
     WCHAR szFamilyName[MAX_PATH];
     _StringCchWideFromAnsi(CP_ACP, szFamilyName, _countof(szFamilyName), face->family_name);
 
+    FontRecord info;
+    info.face_index = face_index;
+    info.family_name = get_family_name(face, TT_NAME_ID_FONT_FAMILY, true, szFamilyName);
+    info.english_name = get_family_name(face, TT_NAME_ID_FONT_FAMILY, false, szFamilyName);
+    info.style_flags = face->style_flags;
+    info.full_name = get_family_name(face, TT_NAME_ID_FULL_NAME, true, info.family_name.c_str());
+    info.style_name = utf8_to_wide(get_style_name(face, true));
+    if (face->num_fixed_sizes == 0)
+        get_outline_features(face, &info);
+
     for (BYTE cs : charsets) {
         if (face->num_fixed_sizes > 0) {
             for (int i = 0; i < face->num_fixed_sizes; ++i)
@@ -654,86 +1599,205 @@ bool load_font(PCWSTR path, int face_index)
                 {
                     raster_height = WinFNT.pixel_height;
                     raster_internal_leading = WinFNT.internal_leading;
+                    get_raster_features(face, &WinFNT, &info);
+                }
+                else
+                {
+                    get_raster_features(face, NULL, &info);
                 }
-                FontInfo* info = new FontInfo();
-                _StringCchAnsiFromWide(CP_ACP, info->ansi_path, _countof(info->ansi_path), path);
-                StringCchCopyW(info->wide_path, _countof(info->wide_path), path);
-
-                info->face_index = iStart;
-                info->family_name = get_family_name(face, TT_NAME_ID_FONT_FAMILY, true, szFamilyName);
-                info->english_name = get_family_name(face, TT_NAME_ID_FONT_FAMILY, false, szFamilyName);
-                info->style_flags = face->style_flags;
-                info->charset = cs;
-                info->raster_height = raster_height;
-                info->raster_internal_leading = raster_internal_leading;
-                registered_fonts.push_back(info);
+                info.charset = cs;
+                info.raster_height = raster_height;
+                info.raster_internal_leading = raster_internal_leading;
+                info.raster_size = height;
+                fonts.push_back(info);
             }
         } else {
-            FontInfo* info = new FontInfo();
-            _StringCchAnsiFromWide(CP_ACP, info->ansi_path, _countof(info->ansi_path), path);
-            StringCchCopyW(info->wide_path, _countof(info->wide_path), path);
-            info->face_index = iStart;
-            info->family_name = get_family_name(face, TT_NAME_ID_FONT_FAMILY, true, szFamilyName);
-            info->english_name = get_family_name(face, TT_NAME_ID_FONT_FAMILY, false, szFamilyName);
-            info->style_flags = face->style_flags;
-            info->charset = cs;
-            info->raster_height = raster_height;
-            info->raster_internal_leading = raster_internal_leading;
-            registered_fonts.push_back(info);
+            info.charset = cs;
+            info.raster_height = raster_height;
+            info.raster_internal_leading = raster_internal_leading;
+            info.raster_size = 0;
+            fonts.push_back(info);
         }
     }
+}
 
-    FT_Done_Face(face);
+// Append the FontRecords of a font file to fonts.
+// face_index == -1 loads every face of a collection. The file is mapped once
+// and all of its faces are created from that memory.
+static bool load_font_ex(FT_Library lib, PCWSTR path, int face_index, std::vector<FontRecord>& fonts)
+{
+    const FontFileMapping* mapping = MapFontFile(path);
+    if (!mapping)
+        return false;
 
-    if (face_index == -1)
+    // A face that fails to load is skipped; the faces of the collection that
+    // load are kept. The file fails only if its first face does.
+    bool ok = false;
+    FT_Long iFace = (face_index == -1) ? 0 : face_index;
+    FT_Long num_faces = iFace + 1;
+    for (; iFace < num_faces; ++iFace)
     {
-        for (FT_Long iFace = 1; iFace < num_faces; ++iFace)
+        FT_Face face;
+        if (FT_New_Memory_Face(lib, mapping->data, (FT_Long)mapping->size, iFace, &face) != 0)
         {
-            if (!load_font(path, iFace))
-                return false;
+            if (!ok)
+                break; // The number of faces is unknown
+            continue;
         }
+        ok = true;
+
+        if (face_index == -1)
+            num_faces = face->num_faces;
+
+        add_face_records(face, iFace, fonts);
+        FT_Done_Face(face);
     }
 
+    UnmapFontFile(mapping);
+    return ok;
+}
+
+// A file is registered once; loading it again succeeds without adding fonts
+bool load_font(PCWSTR path, int face_index)
+{
+    if (find_font_file(path) != INVALID_FONT_FILE)
+        return true;
+
+    std::vector<FontRecord> fonts;
+    if (!load_font_ex(library, path, face_index, fonts))
+        return false;
+
+    DWORD file = add_font_file(path);
+    for (auto& record : fonts)
+        add_font(file, record);
     return true;
 }
 
-void free_fonts(void)
+// ---------------------------------------------------------------------------
+// Font name index
+// Maps a case-folded face name (family_name and english_name) to the
+// registered fonts carrying it, in registration order. Fonts appended to
+// font_table are indexed lazily on the next lookup.
+// ---------------------------------------------------------------------------
+
+typedef std::vector<FontId> FontCandidates;
+
+std::unordered_map<std::wstring, FontCandidates> font_name_index;
+FontId font_name_index_count = 0; // Number of font_table rows indexed
+
+static std::wstring fold_font_name(PCWSTR name)
+{
+    std::wstring folded = name;
+    if (!folded.empty())
+        CharUpperBuffW(&folded[0], (DWORD)folded.size());
+    return folded;
+}
+
+static void update_font_name_index(void)
+{
+    for (; font_name_index_count < font_table.size(); ++font_name_index_count)
+    {
+        FontId id = font_name_index_count;
+        if (get_font_file(id)->removed)
+            continue;
+
+        std::wstring family = fold_font_name(font_string(font_table.family_name[id]));
+        font_name_index[family].push_back(id);
+
+        if (font_table.english_name[id] == 0)
+            continue;
+        std::wstring english = fold_font_name(font_string(font_table.english_name[id]));
+        if (english != family)
+            font_name_index[english].push_back(id);
+    }
+}
+
+static const FontCandidates* find_font_candidates(PCWSTR name)
+{
+    update_font_name_index();
+    auto it = font_name_index.find(fold_font_name(name));
+    if (it == font_name_index.end())
+        return NULL;
+    return &it->second;
+}
+
+static void remove_from_candidates(PCWSTR name, FontId id)
+{
+    auto it = font_name_index.find(fold_font_name(name));
+    if (it == font_name_index.end())
+        return;
+
+    FontCandidates& candidates = it->second;
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        if (candidates[i] == id)
+        {
+            candidates.erase(candidates.begin() + i);
+            break;
+        }
+    }
+    if (candidates.empty())
+        font_name_index.erase(it);
+}
+
+// Take the fonts of a removed file out of the index
+static void remove_file_from_font_name_index(const FontFile* file)
 {
-    for (auto* info : registered_fonts)
+    for (DWORD i = 0; i < file->num_fonts; ++i)
     {
-        delete info;
+        FontId id = file->first_font + i;
+        if (id >= font_name_index_count)
+            break; // Not indexed yet
+        remove_from_candidates(font_string(font_table.family_name[id]), id);
+        if (font_table.english_name[id] != 0)
+            remove_from_candidates(font_string(font_table.english_name[id]), id);
     }
-    registered_fonts.clear();
 }
 
-// Return the list of available sizes for a raster font as a string like "8,10,12"
-static std::wstring get_raster_sizes(FT_Face face)
+static void free_font_name_index(void)
+{
+    font_name_index.clear();
+    font_name_index_count = 0;
+}
+
+void free_fonts(void)
+{
+    free_font_name_index();
+    font_table = FontTable();
+    font_strings.assign(1, UNICODE_NULL);
+    font_string_ids.clear();
+    ++font_set_serial;
+}
+
+// Return the list of strike sizes of the face of a raster font as a string
+// like "8,10,12"
+static std::wstring get_raster_sizes(const std::vector<FontId>& group)
 {
     std::wstring result;
-    for (int i = 0; i < face->num_fixed_sizes; ++i)
+    for (FontId id : group)
     {
+        if (font_table.face_index[id] != font_table.face_index[group[0]])
+            continue;
         if (!result.empty())
             result += L",";
         WCHAR buf[16];
-        // fixed_sizes[i].height is in pixels
-        StringCchPrintfW(buf, _countof(buf), L"%d", static_cast<int>(face->available_sizes[i].height));
+        StringCchPrintfW(buf, _countof(buf), L"%d", static_cast<int>(font_table.raster_size[id]));
         result += buf;
     }
     return result;
 }
 
-// Generate a registry value name by grouping FontInfos from the same file.
+// Generate a registry value name by grouping the fonts from the same file.
 // TrueType / OpenType: "MS Gothic & MS UI Gothic & MS PGothic (TrueType)"
 // Raster:              "MS Sans Serif 8,10,12,14,18,24"
-static std::wstring make_registry_value_name(
-    const std::vector<FontInfo*>& group, FT_Face first_face)
+static std::wstring make_registry_value_name(const std::vector<FontId>& group)
 {
-    bool raster = is_raster_font(group[0]->wide_path);
+    bool raster = get_font_file(group[0])->is_raster;
     if (raster)
     {
         // Raster fonts include a size list (Windows-compatible)
-        std::wstring sizes = get_raster_sizes(first_face);
-        std::wstring name = group[0]->family_name;
+        std::wstring sizes = get_raster_sizes(group);
+        std::wstring name = font_string(font_table.family_name[group[0]]);
         if (!sizes.empty())
             name += L" " + sizes;
         return name;
@@ -742,21 +1806,21 @@ static std::wstring make_registry_value_name(
     // Outline fonts: concatenate all family_names in the group with " & "
     // (duplicates are removed)
     std::vector<std::wstring> names;
-    for (std::vector<FontInfo*>::const_iterator it = group.begin();
+    for (std::vector<FontId>::const_iterator it = group.begin();
          it != group.end(); ++it)
     {
-        const FontInfo* info = *it;
+        PCWSTR family_name = font_string(font_table.family_name[*it]);
         bool found = false;
         for (std::vector<std::wstring>::const_iterator ni = names.begin(); ni != names.end(); ++ni)
         {
-            if (lstrcmpiW(ni->c_str(), info->family_name.c_str()) == 0)
+            if (lstrcmpiW(ni->c_str(), family_name) == 0)
             {
                 found = true;
                 break;
             }
         }
         if (!found)
-            names.push_back(info->family_name);
+            names.push_back(family_name);
     }
 
     std::wstring value_name;
@@ -770,530 +1834,2210 @@ static std::wstring make_registry_value_name(
     return value_name;
 }
 
+// Bring the values of hKey in line with the registered fonts.
+// Only the values that were added, changed or removed are written.
 void write_fonts_to_registry(HKEY hKey)
 {
-    // Delete all existing values
-    WCHAR szValue[MAX_PATH];
-    for (;;) {
-        DWORD cchValue = _countof(szValue);
-        if (RegEnumValueW(hKey, 0, szValue, &cchValue, NULL, NULL, NULL, NULL) != ERROR_SUCCESS)
-            break;
-        RegDeleteValueW(hKey, szValue);
+    // The values we want, keyed by case-folded value name
+    typedef std::pair<std::wstring, std::wstring> RegistryValue; // Name and data
+    std::unordered_map<std::wstring, RegistryValue> wanted;
+
+    // One value per file
+    std::vector<FontId> group;
+    for (auto& file : font_table.files)
+    {
+        if (file.removed || file.num_fonts == 0)
+            continue;
+
+        group.clear();
+        for (DWORD i = 0; i < file.num_fonts; ++i)
+            group.push_back(file.first_font + i);
+
+        std::wstring value_name = make_registry_value_name(group);
+
+        // Value data: filename only (matching the Windows registry format)
+        std::wstring path = font_string(file.path);
+        if (path.find(fonts_dir) == 0)
+            path = PathFindFileNameW(path.c_str());
+
+        wanted[fold_font_name(value_name.c_str())] = RegistryValue(value_name, path);
     }
 
-    // Group by path
-    typedef std::pair<std::wstring, std::vector<FontInfo*> > FontGroup;
-    std::vector<FontGroup> groups;
+    // Collect the current values
+    DWORD cValues = 0, cchMaxName = 0, cbMaxData = 0;
+    if (RegQueryInfoKeyW(hKey, NULL, NULL, NULL, NULL, NULL, NULL, &cValues,
+                         &cchMaxName, &cbMaxData, NULL, NULL) != ERROR_SUCCESS)
+    {
+        return;
+    }
 
-    for (std::vector<FontInfo*>::iterator it = registered_fonts.begin();
-         it != registered_fonts.end(); ++it)
+    std::vector<WCHAR> name(cchMaxName + 1);
+    std::vector<WCHAR> data(cbMaxData / sizeof(WCHAR) + 1);
+    std::unordered_map<std::wstring, std::wstring> existing;
+    std::vector<std::wstring> stale;
+    for (DWORD index = 0; index < cValues; ++index)
     {
-        FontInfo* info = *it;
-        bool found = false;
-        for (std::vector<FontGroup>::iterator gi = groups.begin(); gi != groups.end(); ++gi)
+        DWORD cchName = (DWORD)name.size();
+        DWORD cbData = (DWORD)((data.size() - 1) * sizeof(WCHAR));
+        DWORD type;
+        if (RegEnumValueW(hKey, index, name.data(), &cchName, NULL, &type,
+                          reinterpret_cast<PBYTE>(data.data()), &cbData) != ERROR_SUCCESS)
+        {
+            continue;
+        }
+        data[cbData / sizeof(WCHAR)] = UNICODE_NULL;
+
+        std::wstring key = fold_font_name(name.data());
+        if (wanted.find(key) == wanted.end())
+            stale.push_back(name.data());
+        else if (type == REG_SZ)
+            existing[key] = data.data();
+    }
+
+    // Deleting shifts the enumeration indexes, so do it afterwards
+    for (auto& value_name : stale)
+        RegDeleteValueW(hKey, value_name.c_str());
+
+    for (auto& item : wanted)
+    {
+        const RegistryValue& value = item.second;
+        auto found = existing.find(item.first);
+        if (found != existing.end() && found->second == value.second)
+            continue;
+
+        DWORD cbValue = (DWORD)((value.second.size() + 1) * sizeof(WCHAR));
+        RegSetValueExW(hKey, value.first.c_str(), 0, REG_SZ,
+                       reinterpret_cast<const BYTE*>(value.second.c_str()), cbValue);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Font substitutes and font links
+// FontSubstitutes maps a face name, optionally of one charset, to another
+// face name and optionally charset, like "Helv" to "MS Sans Serif" or
+// "Arial,204" to "Arial,0". SystemLink lists, per face name, the fonts that
+// supply the characters the face lacks, as "FILE.TTF,Face Name" entries.
+// Both are read once from the system registry.
+// ---------------------------------------------------------------------------
+
+#define MAX_SUBSTITUTE_DEPTH 10
+
+struct FontSubstitute {
+    std::wstring name;
+    INT charset; // -1 to keep the requested charset
+};
+
+struct FontLinkEntry {
+    std::wstring file;      // File name without directory
+    std::wstring face_name; // May be empty
+};
+
+// By the folded face name, with ",charset" appended for an entry of one charset
+static std::unordered_map<std::wstring, FontSubstitute> font_substitutes;
+// By the folded face name
+static std::unordered_map<std::wstring, std::vector<FontLinkEntry> > font_links;
+
+static const WCHAR font_substitutes_key[] =
+    L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\FontSubstitutes";
+static const WCHAR font_links_key[] =
+    L"SOFTWARE\\Microsoft\\Windows NT\\CurrentVersion\\FontLink\\SystemLink";
+
+// Call fn(name, type, data) for each value of a key. The data is followed by
+// two NULs so that a REG_MULTI_SZ without its terminator parses safely.
+template <typename FN>
+static void enum_registry_values(HKEY hKey, FN fn)
+{
+    DWORD cValues, cchMaxName, cbMaxData;
+    if (RegQueryInfoKeyW(hKey, NULL, NULL, NULL, NULL, NULL, NULL, &cValues,
+                         &cchMaxName, &cbMaxData, NULL, NULL) != ERROR_SUCCESS)
+    {
+        return;
+    }
+
+    std::vector<WCHAR> name(cchMaxName + 1);
+    std::vector<WCHAR> data(cbMaxData / sizeof(WCHAR) + 2);
+    for (DWORD index = 0; index < cValues; ++index)
+    {
+        DWORD cchName = (DWORD)name.size();
+        DWORD cbData = (DWORD)((data.size() - 2) * sizeof(WCHAR));
+        DWORD type;
+        if (RegEnumValueW(hKey, index, name.data(), &cchName, NULL, &type,
+                          reinterpret_cast<PBYTE>(data.data()), &cbData) != ERROR_SUCCESS)
+        {
+            continue;
+        }
+        data[cbData / sizeof(WCHAR)] = data[cbData / sizeof(WCHAR) + 1] = UNICODE_NULL;
+        fn(name.data(), type, data.data());
+    }
+}
+
+// Split "Name,charset" into its parts. charset is -1 if there is none.
+static void split_name_charset(PCWSTR value, std::wstring* name, INT* charset)
+{
+    PCWSTR comma = wcschr(value, L',');
+    if (!comma)
+    {
+        *name = value;
+        *charset = -1;
+        return;
+    }
+    name->assign(value, comma - value);
+    *charset = _wtoi(comma + 1);
+}
+
+static std::wstring make_substitute_key(PCWSTR name, INT charset)
+{
+    std::wstring key = fold_font_name(name);
+    if (charset >= 0)
+        key += L"," + std::to_wstring(charset);
+    return key;
+}
+
+static void load_font_substitutes(void)
+{
+    HKEY hKey;
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, font_substitutes_key, 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+        return;
+
+    enum_registry_values(hKey, [](PCWSTR name, DWORD type, PCWSTR data) {
+        if (type != REG_SZ)
+            return;
+
+        std::wstring from_name, to_name;
+        INT from_charset, to_charset;
+        split_name_charset(name, &from_name, &from_charset);
+        split_name_charset(data, &to_name, &to_charset);
+        if (from_name.empty() || to_name.empty())
+            return;
+
+        FontSubstitute& substitute = font_substitutes[make_substitute_key(from_name.c_str(), from_charset)];
+        substitute.name = to_name;
+        substitute.charset = to_charset;
+    });
+
+    RegCloseKey(hKey);
+}
+
+static void load_font_links(void)
+{
+    HKEY hKey;
+    if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, font_links_key, 0, KEY_READ, &hKey) != ERROR_SUCCESS)
+        return;
+
+    enum_registry_values(hKey, [](PCWSTR name, DWORD type, PCWSTR data) {
+        if (type != REG_MULTI_SZ && type != REG_SZ)
+            return;
+
+        std::vector<FontLinkEntry>& entries = font_links[fold_font_name(name)];
+        for (PCWSTR item = data; *item; item += lstrlenW(item) + 1)
         {
-            if (lstrcmpiW(gi->first.c_str(), info->wide_path) == 0)
+            // "FILE.TTF,Face Name[,scaling factors]"
+            FontLinkEntry entry;
+            PCWSTR comma = wcschr(item, L',');
+            if (comma)
             {
-                gi->second.push_back(info);
-                found = true;
-                break;
+                entry.file.assign(item, comma - item);
+                PCWSTR next = wcschr(comma + 1, L',');
+                entry.face_name = next ? std::wstring(comma + 1, next - comma - 1) : std::wstring(comma + 1);
+            }
+            else
+            {
+                entry.file = item;
             }
+            entries.push_back(entry);
         }
-        if (!found)
+    });
+
+    RegCloseKey(hKey);
+}
+
+// Apply FontSubstitutes to the face name and charset of a LOGFONT, again on
+// the result like ReactOS SubstituteFontRecurse does
+static void substitute_font(LOGFONTW* plf)
+{
+    for (int depth = 0; depth < MAX_SUBSTITUTE_DEPTH && plf->lfFaceName[0]; ++depth)
+    {
+        auto it = font_substitutes.find(make_substitute_key(plf->lfFaceName, plf->lfCharSet));
+        if (it == font_substitutes.end())
+            it = font_substitutes.find(make_substitute_key(plf->lfFaceName, -1));
+        if (it == font_substitutes.end())
+            break;
+
+        const FontSubstitute& substitute = it->second;
+        if (lstrcmpiW(substitute.name.c_str(), plf->lfFaceName) == 0 &&
+            (substitute.charset < 0 || substitute.charset == plf->lfCharSet))
         {
-            groups.push_back(FontGroup(info->wide_path, std::vector<FontInfo*>(1, info)));
+            break; // Substituted by itself
         }
+
+        lstrcpynW(plf->lfFaceName, substitute.name.c_str(), LF_FACESIZE);
+        if (substitute.charset >= 0)
+            plf->lfCharSet = (BYTE)substitute.charset;
+    }
+}
+
+static void free_font_substitutes_and_links(void)
+{
+    font_substitutes.clear();
+    font_links.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Font catalog cache
+// The font records of every scanned file are saved to a versioned binary
+// file, stamped with the file size and last write time of each font file.
+// At startup the catalog is mapped into memory and files whose stamps did not
+// change are registered straight from it, without any FreeType call.
+//
+// Layout: CatalogHeader, CatalogFile[num_files], CatalogFont[num_fonts],
+// then a pool of NUL-terminated UTF-16 strings addressed by WCHAR offset.
+// ---------------------------------------------------------------------------
+
+#define CATALOG_MAGIC   0x43465445 // 'ETFC'
+#define CATALOG_VERSION 4
+
+struct CatalogHeader {
+    DWORD magic;
+    DWORD version;
+    DWORD header_size;
+    DWORD num_files;
+    DWORD num_fonts;
+    DWORD cch_strings;
+};
+
+struct CatalogFile {
+    DWORD path;
+    DWORD first_font;
+    DWORD num_fonts;
+    DWORD reserved;
+    ULONGLONG file_size;
+    ULONGLONG write_time;
+};
+
+struct CatalogFont {
+    DWORD family_name;
+    DWORD english_name;
+    LONG face_index;
+    LONG style_flags;
+    LONG raster_height;
+    LONG raster_internal_leading;
+    BYTE charset;
+    BYTE reserved;
+    SHORT raster_size;
+    BYTE pitch_and_family;
+    BYTE font_flags;
+    SHORT weight;
+    SHORT avg_width;
+    SHORT cell_height;
+    DWORD full_name;
+    DWORD style_name;
+    FontEnumMetrics metrics;
+};
+
+static WCHAR catalog_path[MAX_PATH];
+static HANDLE catalog_mapping = NULL;
+static const BYTE* catalog_view = NULL;
+static const CatalogHeader* catalog_header = NULL;
+static const CatalogFile* catalog_files = NULL;
+static const CatalogFont* catalog_fonts = NULL;
+static const WCHAR* catalog_strings = NULL;
+static std::unordered_map<std::wstring, const CatalogFile*> catalog_index;
+static bool catalog_dirty = false;
+
+static inline ULONGLONG make_ulonglong(DWORD low, DWORD high)
+{
+    return ((ULONGLONG)high << 32) | low;
+}
+
+static void unmap_font_catalog(void)
+{
+    catalog_index.clear();
+    if (catalog_view)
+        UnmapViewOfFile(catalog_view);
+    if (catalog_mapping)
+        CloseHandle(catalog_mapping);
+    catalog_view = NULL;
+    catalog_mapping = NULL;
+    catalog_header = NULL;
+}
+
+// Map the catalog file and index its file records by path
+static bool map_font_catalog(void)
+{
+    HANDLE hFile = CreateFileW(catalog_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(hFile, &size) || size.QuadPart < (LONGLONG)sizeof(CatalogHeader) ||
+        size.QuadPart > 0x7FFFFFFF)
+    {
+        CloseHandle(hFile);
+        return false;
     }
 
-    for (std::vector<FontGroup>::iterator gi = groups.begin(); gi != groups.end(); ++gi)
+    catalog_mapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(hFile);
+    if (!catalog_mapping)
+        return false;
+
+    catalog_view = (const BYTE*)MapViewOfFile(catalog_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!catalog_view)
     {
-        const std::wstring& path = gi->first;
-        const std::vector<FontInfo*>& group = gi->second;
+        unmap_font_catalog();
+        return false;
+    }
 
-        char ansi_path[MAX_PATH];
-        _StringCchAnsiFromWide(CP_ACP, ansi_path, _countof(ansi_path), path.c_str());
+    // Validate everything before trusting any offset
+    const CatalogHeader* header = (const CatalogHeader*)catalog_view;
+    ULONGLONG expected = sizeof(CatalogHeader) +
+                         (ULONGLONG)header->num_files * sizeof(CatalogFile) +
+                         (ULONGLONG)header->num_fonts * sizeof(CatalogFont) +
+                         (ULONGLONG)header->cch_strings * sizeof(WCHAR);
+    if (header->magic != CATALOG_MAGIC || header->version != CATALOG_VERSION ||
+        header->header_size != sizeof(CatalogHeader) ||
+        expected != (ULONGLONG)size.QuadPart || header->cch_strings == 0)
+    {
+        unmap_font_catalog();
+        return false;
+    }
 
-        // Temporarily open the face to generate the value name
-        FT_Face first_face;
-        if (FT_New_Face(library, ansi_path, group[0]->face_index, &first_face) != 0)
-            continue;
+    catalog_header = header;
+    catalog_files = (const CatalogFile*)(catalog_view + sizeof(CatalogHeader));
+    catalog_fonts = (const CatalogFont*)(catalog_files + header->num_files);
+    catalog_strings = (const WCHAR*)(catalog_fonts + header->num_fonts);
+    if (catalog_strings[header->cch_strings - 1] != UNICODE_NULL)
+    {
+        unmap_font_catalog();
+        return false;
+    }
 
-        std::wstring value_name = make_registry_value_name(group, first_face);
-        FT_Done_Face(first_face);
+    for (DWORD i = 0; i < header->num_files; ++i)
+    {
+        const CatalogFile* file = &catalog_files[i];
+        if (file->path >= header->cch_strings ||
+            file->first_font > header->num_fonts ||
+            file->num_fonts > header->num_fonts - file->first_font)
+        {
+            unmap_font_catalog();
+            return false;
+        }
+        catalog_index[catalog_strings + file->path] = file;
+    }
 
-        // Value data: filename only (matching the Windows registry format)
-        WCHAR filename[MAX_PATH];
-        if (path.find(fonts_dir) == 0)
-            lstrcpynW(filename, PathFindFileNameW(path.c_str()), _countof(filename));
-        else
-            lstrcpynW(filename, path.c_str(), _countof(filename));
+    for (DWORD i = 0; i < header->num_fonts; ++i)
+    {
+        if (catalog_fonts[i].family_name >= header->cch_strings ||
+            catalog_fonts[i].english_name >= header->cch_strings ||
+            catalog_fonts[i].full_name >= header->cch_strings ||
+            catalog_fonts[i].style_name >= header->cch_strings)
+        {
+            unmap_font_catalog();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Get the fonts of a file from the catalog if its stamps are unchanged
+static bool load_from_catalog(PCWSTR path, ULONGLONG file_size, ULONGLONG write_time,
+                              std::vector<FontRecord>& fonts)
+{
+    auto found = catalog_index.find(path);
+    if (found == catalog_index.end() ||
+        found->second->file_size != file_size || found->second->write_time != write_time)
+    {
+        return false;
+    }
 
-        DWORD cbValue = (lstrlenW(filename) + 1) * sizeof(WCHAR);
-        RegSetValueExW(hKey, value_name.c_str(), 0, REG_SZ, (PBYTE)filename, cbValue);
+    const CatalogFile* file = found->second;
+    for (DWORD i = 0; i < file->num_fonts; ++i)
+    {
+        const CatalogFont* record = &catalog_fonts[file->first_font + i];
+        FontRecord info;
+        info.face_index = record->face_index;
+        info.family_name = catalog_strings + record->family_name;
+        info.english_name = catalog_strings + record->english_name;
+        info.style_flags = record->style_flags;
+        info.charset = record->charset;
+        info.raster_height = record->raster_height;
+        info.raster_internal_leading = record->raster_internal_leading;
+        info.raster_size = record->raster_size;
+        info.pitch_and_family = record->pitch_and_family;
+        info.font_flags = record->font_flags;
+        info.weight = record->weight;
+        info.avg_width = record->avg_width;
+        info.cell_height = record->cell_height;
+        info.full_name = catalog_strings + record->full_name;
+        info.style_name = catalog_strings + record->style_name;
+        info.metrics = record->metrics;
+        fonts.push_back(info);
     }
+    return true;
 }
 
-void read_fonts_from_registry(HKEY hKey)
+// Is the file part of the catalog?
+static inline bool is_cataloged_file(const FontFile& file)
 {
-    DWORD index = 0;
-    WCHAR value_name[512];
-    WCHAR value_data[MAX_PATH];
-    DWORD name_size, data_size, type;
+    return !file.removed && file.file_size != 0;
+}
+
+// Write the catalog of the files registered by scanning.
+// The interned strings of the font table are the string pool as they are.
+static bool write_font_catalog(void)
+{
+    std::vector<CatalogFile> files;
+    std::vector<CatalogFont> fonts;
+    const std::vector<WCHAR>& strings = font_strings;
+
+    for (auto& entry : font_table.files)
+    {
+        if (!is_cataloged_file(entry))
+            continue;
+
+        CatalogFile file = {};
+        file.path = entry.path;
+        file.first_font = (DWORD)fonts.size();
+        file.num_fonts = entry.num_fonts;
+        file.file_size = entry.file_size;
+        file.write_time = entry.write_time;
+        files.push_back(file);
+
+        for (DWORD i = 0; i < entry.num_fonts; ++i)
+        {
+            FontId id = entry.first_font + i;
+            CatalogFont font = {};
+            font.family_name = font_table.family_name[id];
+            font.english_name = font_table.english_name[id];
+            font.face_index = font_table.face_index[id];
+            font.style_flags = font_table.style_flags[id];
+            font.raster_height = font_table.raster_height[id];
+            font.raster_internal_leading = font_table.raster_internal_leading[id];
+            font.raster_size = font_table.raster_size[id];
+            font.charset = font_table.charset[id];
+            font.pitch_and_family = font_table.pitch_and_family[id];
+            font.font_flags = font_table.font_flags[id];
+            font.weight = font_table.weight[id];
+            font.avg_width = font_table.avg_width[id];
+            font.cell_height = font_table.cell_height[id];
+            font.full_name = font_table.full_name[id];
+            font.style_name = font_table.style_name[id];
+            font.metrics = font_table.enum_metrics[id];
+            fonts.push_back(font);
+        }
+    }
+
+    CatalogHeader header = {};
+    header.magic = CATALOG_MAGIC;
+    header.version = CATALOG_VERSION;
+    header.header_size = sizeof(CatalogHeader);
+    header.num_files = (DWORD)files.size();
+    header.num_fonts = (DWORD)fonts.size();
+    header.cch_strings = (DWORD)strings.size();
+
+    // Write to a temporary file and swap it in, so a reader never sees half a catalog
+    WCHAR temp_path[MAX_PATH];
+    StringCchCopyW(temp_path, _countof(temp_path), catalog_path);
+    StringCchCatW(temp_path, _countof(temp_path), L".tmp");
+
+    HANDLE hFile = CreateFileW(temp_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+
+    DWORD cbWritten;
+    bool ok = WriteFile(hFile, &header, sizeof(header), &cbWritten, NULL) &&
+              (files.empty() || WriteFile(hFile, files.data(), (DWORD)(files.size() * sizeof(CatalogFile)), &cbWritten, NULL)) &&
+              (fonts.empty() || WriteFile(hFile, fonts.data(), (DWORD)(fonts.size() * sizeof(CatalogFont)), &cbWritten, NULL)) &&
+              WriteFile(hFile, strings.data(), (DWORD)(strings.size() * sizeof(WCHAR)), &cbWritten, NULL);
+    CloseHandle(hFile);
+
+    if (!ok || !MoveFileExW(temp_path, catalog_path, MOVEFILE_REPLACE_EXISTING))
+    {
+        DeleteFileW(temp_path);
+        return false;
+    }
+    return true;
+}
+
+// Prepare the catalog before scanning the fonts
+static void begin_font_catalog(void)
+{
+    if (!SHGetSpecialFolderPathW(NULL, catalog_path, CSIDL_LOCAL_APPDATA, TRUE))
+    {
+        catalog_path[0] = UNICODE_NULL;
+        return;
+    }
+    PathAppendW(catalog_path, L"EmuType");
+    CreateDirectoryW(catalog_path, NULL);
+    PathAppendW(catalog_path, L"FontCatalog.dat");
+
+    catalog_dirty = !map_font_catalog();
+}
+
+// Save the catalog after scanning if anything changed
+static void end_font_catalog(void)
+{
+    // A file that was in the catalog but is gone now also needs a rewrite
+    DWORD num_files = 0;
+    for (auto& file : font_table.files)
+    {
+        if (is_cataloged_file(file))
+            ++num_files;
+    }
+    if (catalog_header && catalog_header->num_files != num_files)
+        catalog_dirty = true;
+
+    unmap_font_catalog();
+
+    if (catalog_dirty && catalog_path[0])
+        write_font_catalog();
+    catalog_dirty = false;
+}
+
+// ---------------------------------------------------------------------------
+// Font scanning
+// Registering a file takes its records from the catalog when possible.
+// Otherwise its faces are read with FreeType, which can be spread over a pool
+// of worker threads. Each worker owns its own FT_Library. Results are merged
+// into font_table in job order, so the outcome is the same as a serial scan.
+// ---------------------------------------------------------------------------
+
+int scan_threads = 0; // 0: one worker per processor, 1: serial
+
+// A font file to register
+struct FontScanJob {
+    std::wstring path;
+    ULONGLONG file_size;
+    ULONGLONG write_time;
+    bool cataloged; // The fonts came from the catalog
+    bool scanned;
+    bool loaded;    // The file could be read; a file that could not is not registered
+    std::vector<FontRecord> fonts;
+};
+
+struct FontScanPool {
+    std::vector<FontScanJob*> jobs;
+    LONG next;
+};
+
+static void add_font_scan_job(std::vector<FontScanJob>& jobs, PCWSTR path,
+                              ULONGLONG file_size, ULONGLONG write_time)
+{
+    jobs.push_back(FontScanJob());
+    FontScanJob& job = jobs.back();
+    job.path = path;
+    job.file_size = file_size;
+    job.write_time = write_time;
+    job.cataloged = job.scanned = job.loaded = false;
+}
+
+static DWORD WINAPI font_scan_worker(LPVOID arg)
+{
+    FontScanPool* pool = (FontScanPool*)arg;
+
+    // An FT_Library must not be shared between threads
+    FT_Library lib;
+    if (FT_Init_FreeType(&lib) != 0)
+        return 1;
+
+    for (;;)
+    {
+        LONG i = InterlockedIncrement(&pool->next) - 1;
+        if (i >= (LONG)pool->jobs.size())
+            break;
+        FontScanJob* job = pool->jobs[i];
+        job->loaded = load_font_ex(lib, job->path.c_str(), -1, job->fonts);
+        job->scanned = true;
+    }
+
+    FT_Done_FreeType(lib);
+    return 0;
+}
+
+static int get_scan_thread_count(void)
+{
+    if (scan_threads > 0)
+        return scan_threads;
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? (int)info.dwNumberOfProcessors : 1;
+}
+
+// Read the faces of every job with FreeType, using up to num_threads workers
+static void run_font_scan_jobs(std::vector<FontScanJob*>& jobs, int num_threads)
+{
+    if (num_threads > (int)jobs.size())
+        num_threads = (int)jobs.size();
+
+    if (num_threads > 1)
+    {
+        FontScanPool pool;
+        pool.jobs = jobs;
+        pool.next = 0;
+
+        std::vector<HANDLE> threads;
+        for (int i = 0; i < num_threads; ++i)
+        {
+            HANDLE hThread = CreateThread(NULL, 0, font_scan_worker, &pool, 0, NULL);
+            if (hThread)
+                threads.push_back(hThread);
+        }
+        for (size_t i = 0; i < threads.size(); ++i)
+        {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+
+    // Serial mode, and whatever the workers could not take
+    for (auto* job : jobs)
+    {
+        if (!job->scanned)
+        {
+            job->loaded = load_font_ex(library, job->path.c_str(), -1, job->fonts);
+            job->scanned = true;
+        }
+    }
+}
+
+// Register the fonts of every job, in job order
+static void scan_font_files(std::vector<FontScanJob>& jobs)
+{
+    std::vector<FontScanJob*> pending;
+    for (auto& job : jobs)
+    {
+        job.cataloged = load_from_catalog(job.path.c_str(), job.file_size, job.write_time, job.fonts);
+        job.loaded = job.cataloged;
+        if (!job.cataloged)
+            pending.push_back(&job);
+    }
+
+    run_font_scan_jobs(pending, get_scan_thread_count());
+
+    for (auto& job : jobs)
+    {
+        // Like load_font, a file that failed is left unregistered and out of
+        // the catalog, to be tried again by the next scan; or registered twice
+        if (!job.loaded || find_font_file(job.path.c_str()) != INVALID_FONT_FILE)
+        {
+            job.fonts.clear();
+            continue;
+        }
+
+        DWORD file = add_font_file(job.path.c_str());
+        font_table.files[file].file_size = job.file_size;
+        font_table.files[file].write_time = job.write_time;
+
+        for (auto& record : job.fonts)
+            add_font(file, record);
+        job.fonts.clear();
+
+        if (!job.cataloged)
+            catalog_dirty = true;
+    }
+}
+
+void read_fonts_from_registry(HKEY hKey)
+{
+    DWORD index = 0;
+    WCHAR value_name[512];
+    WCHAR value_data[MAX_PATH];
+    DWORD name_size, data_size, type;
+    std::vector<FontScanJob> jobs;
+
+    for (;;)
+    {
+        name_size = sizeof(value_name);
+        data_size = sizeof(value_data);
+        LSTATUS status = RegEnumValueW(hKey, index++, value_name, &name_size,
+                                       NULL, &type,
+                                       reinterpret_cast<PBYTE>(value_data),
+                                       &data_size);
+        if (status == ERROR_NO_MORE_ITEMS)
+            break;
+        if (status != ERROR_SUCCESS || type != REG_SZ)
+            continue;
+
+        // Convert to full path
+        WCHAR full_path[MAX_PATH];
+        if (PathIsRelativeW(value_data))
+        {
+            lstrcpynW(full_path, fonts_dir, _countof(full_path));
+            PathAppendW(full_path, value_data);
+        }
+        else
+        {
+            lstrcpynW(full_path, value_data, _countof(full_path));
+        }
+
+        // Skip if the file does not exist
+        WIN32_FILE_ATTRIBUTE_DATA attrs;
+        if (!GetFileAttributesExW(full_path, GetFileExInfoStandard, &attrs))
+            continue;
+
+        // Load all faces (same logic as load_font with -1)
+        add_font_scan_job(jobs, full_path,
+                          make_ulonglong(attrs.nFileSizeLow, attrs.nFileSizeHigh),
+                          make_ulonglong(attrs.ftLastWriteTime.dwLowDateTime,
+                                         attrs.ftLastWriteTime.dwHighDateTime));
+    }
+
+    scan_font_files(jobs);
+}
+
+void load_from_fonts_folder()
+{
+    WCHAR path[MAX_PATH];
+    lstrcpynW(path, fonts_dir, MAX_PATH);
+    PathAppendW(path, L"*.*");
+
+    std::vector<FontScanJob> jobs;
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = FindFirstFileW(path, &find);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (lstrcmpW(find.cFileName, L".") == 0 || lstrcmpW(find.cFileName, L"..") == 0)
+                continue;
+
+            if (is_supported_font(find.cFileName)) {
+                lstrcpynW(path, fonts_dir, _countof(path));
+                PathAppendW(path, find.cFileName);
+                add_font_scan_job(jobs, path,
+                                  make_ulonglong(find.nFileSizeLow, find.nFileSizeHigh),
+                                  make_ulonglong(find.ftLastWriteTime.dwLowDateTime,
+                                                 find.ftLastWriteTime.dwHighDateTime));
+            }
+        } while (FindNextFileW(hFind, &find));
+        FindClose(hFind);
+    }
+
+    scan_font_files(jobs);
+}
+
+static void update_font_enum_index(void);
+
+BOOL InitFontSupport(VOID)
+{
+    SHGetSpecialFolderPathW(NULL, fonts_dir, CSIDL_FONTS, FALSE);
+
+    FT_Error error = FT_Init_FreeType(&library);
+    if (error) {
+        wprintf(L"FT_Init_FreeType: %d\n", error);
+        return FALSE;
+    }
+
+    FT_Int major, minor, patch;
+    FT_Library_Version(library, &major, &minor, &patch);
+    wprintf(L"FreeType %d.%d.%d\n", major, minor, patch);
+
+    FT_Library_SetLcdFilter(library, FT_LCD_FILTER_DEFAULT);
+
+    load_font_substitutes();
+    load_font_links();
+
+    begin_font_catalog();
+
+    HKEY hKey;
+    error = RegCreateKeyExW(HKEY_CURRENT_USER, reg_key, 0, NULL, 0,
+                            KEY_ALL_ACCESS, NULL, &hKey, NULL);
+    if (!error) {
+        error = RegEnumValueW(hKey, 0, NULL, NULL, NULL, NULL, NULL, NULL);
+        if (error) {
+            load_from_fonts_folder();
+            //write_fonts_to_registry(hKey);
+        } else {
+            read_fonts_from_registry(hKey);
+        }
+        RegCloseKey(hKey);
+    }
+
+    end_font_catalog();
+    update_font_enum_index();
+
+    return TRUE;
+}
+
+static void FreeRasterCharMaps(void);
+static void FreeRealizedFonts(void);
+static void free_font_link_chains(void);
+static void free_font_enum_index(void);
+static void FreeCompositeBuffer(void);
+
+VOID FreeFontSupport(VOID)
+{
+    FreeRealizedFonts();
+    free_font_link_chains();
+    free_font_enum_index();
+    free_font_substitutes_and_links();
+    free_fonts();
+    FreeRasterCharMaps();
+    FreeGlyphCache();
+    FreeFaceCache();
+    FT_Done_FreeType(library);
+    FreeCompositeBuffer();
+}
+
+// ---------------------------------------------------------------------------
+// Font matcher
+// Chooses the font of a LOGFONT by the penalties of ReactOS GetFontPenalty.
+// The terms that depend on one byte of a font (charset, pitch and family,
+// italic/underline/strikeout) are looked up in tables made per LOGFONT, and
+// the terms that depend on the font only are precomputed in base_penalty, so
+// scoring the whole font table is a flat loop over its columns.
+// ---------------------------------------------------------------------------
+
+#define FACE_NAME_PENALTY 10000
+#define FONT_MATCH_BLOCK  256
+
+struct FontMatch {
+    UINT charset_penalty[256];  // By charset
+    UINT pitch_penalty[256];    // By pitch_and_family
+    UINT flags_penalty[8];      // By font_flags
+    LONG weight;                // lfWeight, FW_DONTCARE as FW_NORMAL
+    LONG height;                // Wanted cell height of a raster font; 0 for any
+    LONG char_height;           // Wanted character height of a raster font; 0 for any
+    LONG width;                 // lfWidth; 0 for any
+    UINT name_penalty;          // For a font whose name is not lfFaceName
+};
+
+struct FontMatchStats {
+    ULONGLONG lookups;
+    ULONGLONG full_scans; // Lookups whose name candidates could not decide
+};
+
+static FontMatchStats font_match_stats;
+
+// The charset of the user's ANSI code page
+static BYTE get_user_charset(void)
+{
+    static int user_charset = -1;
+    if (user_charset == -1)
+    {
+        UINT codepage = GetACP();
+        user_charset = ANSI_CHARSET;
+        for (int i = 0; i < MAXTCIINDEX; ++i)
+        {
+            if (g_FontTci[i].ciACP == codepage)
+            {
+                user_charset = g_FontTci[i].ciCharset;
+                break;
+            }
+        }
+    }
+    return (BYTE)user_charset;
+}
+
+static void prepare_font_match(const LOGFONTW* plf, FontMatch* match)
+{
+    BYTE user_charset = get_user_charset();
+    for (UINT cs = 0; cs < 256; ++cs)
+    {
+        UINT penalty = 0;
+        if (cs != plf->lfCharSet)
+        {
+            if (plf->lfCharSet != DEFAULT_CHARSET && plf->lfCharSet != ANSI_CHARSET)
+                penalty += 65000; // CharSet
+            else if (cs != user_charset)
+                penalty += (cs != ANSI_CHARSET) ? 200 : 100; // Not the user's, nor ANSI
+        }
+        match->charset_penalty[cs] = penalty;
+    }
+
+    BYTE pitch = plf->lfPitchAndFamily & 0x0F;
+    BYTE family = plf->lfPitchAndFamily & 0xF0;
+    for (UINT pf = 0; pf < 256; ++pf)
+    {
+        UINT penalty = 0;
+        bool is_vector = (pf & (TMPF_VECTOR | TMPF_TRUETYPE)) != 0;
+
+        // OutputPrecision. ReactOS penalizes vector fonts for every other
+        // precision, which makes OUT_TT_PRECIS prefer raster fonts; the
+        // precisions are taken by their documented meaning instead.
+        switch (plf->lfOutPrecision)
+        {
+        case OUT_STROKE_PRECIS:
+            if (!is_vector)
+                penalty += 19000;
+            break;
+        case OUT_RASTER_PRECIS:
+            if (is_vector)
+                penalty += 19000;
+            break;
+        case OUT_TT_ONLY_PRECIS:
+            if (!(pf & TMPF_TRUETYPE))
+                penalty += 19000;
+            break;
+        case OUT_TT_PRECIS:
+            if (!(pf & TMPF_TRUETYPE))
+                penalty += 4; // NotTrueType
+            break;
+        }
+
+        if (pitch == FIXED_PITCH && (pf & _TMPF_VARIABLE_PITCH))
+            penalty += 15000; // FixedPitch
+        if ((pitch == VARIABLE_PITCH || pitch == DEFAULT_PITCH) && !(pf & _TMPF_VARIABLE_PITCH))
+            penalty += 350; // PitchVariable
+        if (pitch == DEFAULT_PITCH && !(pf & _TMPF_VARIABLE_PITCH))
+            penalty += 1; // DefaultPitchFixed
+
+        BYTE font_family = pf & 0xF0;
+        if (family != FF_DONTCARE && family != font_family)
+            penalty += 9000; // Family
+
+        // FamilyUnlikely
+        bool plain = (family == FF_ROMAN || family == FF_MODERN || family == FF_SWISS);
+        bool fancy = (family == FF_DECORATIVE || family == FF_SCRIPT);
+        bool font_plain = (font_family == FF_ROMAN || font_family == FF_MODERN || font_family == FF_SWISS);
+        bool font_fancy = (font_family == FF_DECORATIVE || font_family == FF_SCRIPT);
+        if ((plain && font_fancy) || (fancy && font_plain))
+            penalty += 50;
+
+        match->pitch_penalty[pf] = penalty;
+    }
+
+    for (UINT flags = 0; flags < 8; ++flags)
+    {
+        UINT penalty = 0;
+        if (!plf->lfItalic && (flags & FONT_FLAG_ITALIC))
+            penalty += 40; // Italic
+        else if (plf->lfItalic && !(flags & FONT_FLAG_ITALIC))
+            penalty += 1; // ItalicSim
+        if (!plf->lfUnderline && (flags & FONT_FLAG_UNDERLINE))
+            penalty += 3; // Underline
+        if (!plf->lfStrikeOut && (flags & FONT_FLAG_STRIKEOUT))
+            penalty += 3; // StrikeOut
+        match->flags_penalty[flags] = penalty;
+    }
+
+    // Clamp the sizes so that no penalty overflows
+    match->weight = (plf->lfWeight == FW_DONTCARE) ? FW_NORMAL : clamp_long(plf->lfWeight, 0, 1000);
+    match->height = match->char_height = 0;
+    if (plf->lfHeight > 0)
+        match->height = clamp_long(plf->lfHeight, 0, 0x7FFF);
+    else if (plf->lfHeight < 0)
+        match->char_height = clamp_long(-plf->lfHeight, 0, 0x7FFF);
+    match->width = clamp_long(labs(plf->lfWidth), 0, 0x7FFF);
+    match->name_penalty = plf->lfFaceName[0] ? FACE_NAME_PENALTY : 0;
+}
+
+// The penalties of a raster font for the size. A vector font is scaled to
+// the requested size and has none.
+static inline UINT get_raster_size_penalty(const FontMatch* match, LONG cell_height,
+                                           LONG internal_leading, LONG avg_width)
+{
+    UINT penalty = 0;
+    bool need_scaling = false;
+
+    // Deviation from ReactOS: a negative lfHeight is a character height and
+    // is compared as such, not taken as a cell height
+    LONG height = match->height;
+    if (match->char_height)
+        height = match->char_height + internal_leading;
+    if (height)
+    {
+        if (height < cell_height)
+            penalty += 600 + 150 * (cell_height - height) + 1 * (cell_height - height); // HeightBigger
+        else if (cell_height < height)
+            penalty += 150 * (height - cell_height) + 2 * (height - cell_height); // HeightSmaller
+        need_scaling = (height != cell_height);
+    }
+
+    if (match->width && match->width != avg_width)
+    {
+        penalty += 50 * labs(match->width - avg_width); // Width
+        need_scaling = true;
+    }
+
+    if (need_scaling)
+        penalty += 50; // SizeSynth
+
+    return penalty;
+}
+
+// The penalty of a font, but for the face name
+static inline UINT get_font_penalty(const FontMatch* match, FontId id)
+{
+    BYTE pf = font_table.pitch_and_family[id];
+    UINT penalty = font_table.base_penalty[id];
+    penalty += match->charset_penalty[font_table.charset[id]];
+    penalty += match->pitch_penalty[pf];
+    penalty += match->flags_penalty[font_table.font_flags[id]];
+    penalty += 3 * (labs(match->weight - font_table.weight[id]) / 10); // Weight
+    // Deviation from ReactOS: the size penalties, Width included, are for
+    // raster fonts only, as a vector font is scaled to any height and width
+    if (!(pf & (TMPF_VECTOR | TMPF_TRUETYPE)))
+    {
+        penalty += get_raster_size_penalty(match, font_table.cell_height[id],
+                                           font_table.raster_internal_leading[id],
+                                           font_table.avg_width[id]);
+    }
+    return penalty;
+}
+
+// Score the fonts of a face name and return the first one of the least penalty
+static FontId find_best_candidate(const FontMatch* match, const FontCandidates& candidates,
+                                  UINT* best_penalty)
+{
+    FontId best = INVALID_FONT_ID;
+    *best_penalty = UINT_MAX;
+    for (FontId id : candidates)
+    {
+        UINT penalty = get_font_penalty(match, id);
+        if (penalty < *best_penalty || (penalty == *best_penalty && id < best))
+        {
+            *best_penalty = penalty;
+            best = id;
+        }
+    }
+    return best;
+}
+
+// Score every font and return the first one of the least penalty.
+// The penalties are computed a block at a time, then the block is searched
+// for its minimum, so that the scoring loop has no dependency between fonts.
+static FontId find_best_font(const FontMatch* match, UINT* best_penalty)
+{
+    UINT penalties[FONT_MATCH_BLOCK];
+    FontId best = INVALID_FONT_ID;
+    *best_penalty = UINT_MAX;
+
+    DWORD count = font_table.size();
+    for (FontId first = 0; first < count; first += FONT_MATCH_BLOCK)
+    {
+        DWORD n = (count - first < FONT_MATCH_BLOCK) ? count - first : FONT_MATCH_BLOCK;
+        for (DWORD i = 0; i < n; ++i)
+            penalties[i] = get_font_penalty(match, first + i);
+
+        for (DWORD i = 0; i < n; ++i)
+        {
+            if (penalties[i] < *best_penalty)
+            {
+                *best_penalty = penalties[i];
+                best = first + i;
+            }
+        }
+    }
+
+    if (*best_penalty != UINT_MAX)
+        *best_penalty += match->name_penalty;
+    return best;
+}
+
+// Find the font that GDI would choose for a LOGFONT, after FontSubstitutes.
+// The fonts named lfFaceName are scored first. Any other font costs at least
+// FACE_NAME_PENALTY plus the least base penalty, so the whole table is scored
+// only when no named font is cheaper than that.
+static FontId find_font_by_logfont_ex(const LOGFONTW* plf, bool full_scan)
+{
+    LOGFONTW lf = *plf;
+    substitute_font(&lf);
+
+    FontMatch match;
+    prepare_font_match(&lf, &match);
+    ++font_match_stats.lookups;
+
+    FontId best = INVALID_FONT_ID;
+    UINT best_penalty = UINT_MAX;
+    const FontCandidates* candidates = lf.lfFaceName[0] ? find_font_candidates(lf.lfFaceName) : NULL;
+    if (candidates)
+    {
+        best = find_best_candidate(&match, *candidates, &best_penalty);
+        if (!full_scan && best_penalty < match.name_penalty + 2)
+            return best;
+    }
+
+    ++font_match_stats.full_scans;
+    UINT other_penalty;
+    FontId other = find_best_font(&match, &other_penalty);
+    if (other_penalty < best_penalty || (other_penalty == best_penalty && other < best))
+        best = other;
+
+    if (best != INVALID_FONT_ID && font_table.base_penalty[best] >= FONT_PENALTY_REMOVED)
+        return INVALID_FONT_ID;
+    return best;
+}
+
+FontId find_font_by_logfont(const LOGFONTW *plf)
+{
+    return find_font_by_logfont_ex(plf, false);
+}
+
+// ---------------------------------------------------------------------------
+// Font link chains
+// The fonts linked to a base font are resolved from its SystemLink entries
+// once per base font and style, and cached until the font set changes.
+// Linked fonts are matched by their face name with the weight, italic and
+// charset of the request; raster fonts and the base face itself are left out.
+// ---------------------------------------------------------------------------
+
+static std::unordered_map<ULONGLONG, std::vector<FontId> > font_link_chains;
+static DWORD font_link_chains_serial = 0; // font_set_serial of the cached chains
+
+static bool is_same_face(FontId id1, FontId id2)
+{
+    return font_table.file[id1] == font_table.file[id2] &&
+           font_table.face_index[id1] == font_table.face_index[id2];
+}
+
+// Find the registered font of a SystemLink entry, by its face name or else
+// by its file name
+static FontId find_link_font(const FontLinkEntry& entry, const LOGFONTW* plf)
+{
+    if (!entry.face_name.empty())
+    {
+        const FontCandidates* candidates = find_font_candidates(entry.face_name.c_str());
+        if (candidates)
+        {
+            LOGFONTW lf = *plf;
+            lstrcpynW(lf.lfFaceName, entry.face_name.c_str(), LF_FACESIZE);
+            FontMatch match;
+            prepare_font_match(&lf, &match);
+            UINT penalty;
+            return find_best_candidate(&match, *candidates, &penalty);
+        }
+    }
+
+    for (auto& file : font_table.files)
+    {
+        if (!file.removed && file.num_fonts &&
+            lstrcmpiW(PathFindFileNameW(font_string(file.path)), entry.file.c_str()) == 0)
+        {
+            return file.first_font;
+        }
+    }
+
+    return INVALID_FONT_ID;
+}
+
+// Get the fonts linked to a base font, in fallback order
+static const std::vector<FontId>* get_font_link_chain(FontId base, const LOGFONTW* plf)
+{
+    if (font_link_chains_serial != font_set_serial)
+    {
+        font_link_chains.clear();
+        font_link_chains_serial = font_set_serial;
+    }
+
+    // The chain depends on these only
+    LOGFONTW lf = {};
+    lf.lfWeight = clamp_long(plf->lfWeight, 0, 1000);
+    lf.lfItalic = plf->lfItalic ? TRUE : FALSE;
+    lf.lfCharSet = plf->lfCharSet;
+
+    ULONGLONG key = base | ((ULONGLONG)lf.lfWeight << 32) |
+                    ((ULONGLONG)lf.lfItalic << 48) | ((ULONGLONG)lf.lfCharSet << 56);
+    auto found = font_link_chains.find(key);
+    if (found != font_link_chains.end())
+        return &found->second;
+
+    std::vector<FontId>& chain = font_link_chains[key];
+
+    auto links = font_links.find(fold_font_name(font_string(font_table.family_name[base])));
+    if (links == font_links.end())
+        links = font_links.find(fold_font_name(font_string(font_table.english_name[base])));
+    if (links == font_links.end())
+        return &chain;
+
+    for (auto& entry : links->second)
+    {
+        FontId id = find_link_font(entry, &lf);
+        if (id == INVALID_FONT_ID || get_font_file(id)->is_raster || is_same_face(id, base))
+            continue;
+
+        bool known = false;
+        for (FontId other : chain)
+            known = known || is_same_face(id, other);
+        if (!known)
+            chain.push_back(id);
+    }
+
+    return &chain;
+}
+
+static void free_font_link_chains(void)
+{
+    font_link_chains.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Font enumeration
+// EnumFontFamiliesExW from the font table, without opening any font file.
+// The ENUMLOGFONTEXW/NEWTEXTMETRICEXW of every font is built once from its
+// precomputed metrics and cached. family_heads lists the first font of each
+// family and charset, sorted by family name, for the enumeration of all
+// families. The index is rebuilt when the font set changes.
+// ---------------------------------------------------------------------------
+
+struct FontEnumRecord {
+    ENUMLOGFONTEXW elf;
+    NEWTEXTMETRICEXW ntm;
+    DWORD font_type;
+};
+
+struct FontEnumIndex {
+    bool built;
+    DWORD serial; // font_set_serial it was built for
+    std::vector<FontEnumRecord> records; // By FontId
+    std::vector<FontId> family_heads;
+};
+
+static FontEnumIndex font_enum_index;
+
+static PCWSTR get_script_name(BYTE charset)
+{
+    switch (charset)
+    {
+    case ANSI_CHARSET:        return L"Western";
+    case EASTEUROPE_CHARSET:  return L"Central European";
+    case RUSSIAN_CHARSET:     return L"Cyrillic";
+    case GREEK_CHARSET:       return L"Greek";
+    case TURKISH_CHARSET:     return L"Turkish";
+    case HEBREW_CHARSET:      return L"Hebrew";
+    case ARABIC_CHARSET:      return L"Arabic";
+    case BALTIC_CHARSET:      return L"Baltic";
+    case VIETNAMESE_CHARSET:  return L"Vietnamese";
+    case THAI_CHARSET:        return L"Thai";
+    case SHIFTJIS_CHARSET:    return L"Japanese";
+    case GB2312_CHARSET:      return L"CHINESE_GB2312";
+    case HANGEUL_CHARSET:     return L"Hangul";
+    case CHINESEBIG5_CHARSET: return L"CHINESE_BIG5";
+    case JOHAB_CHARSET:       return L"Hangul(Johab)";
+    case SYMBOL_CHARSET:      return L"Symbol";
+    case OEM_CHARSET:         return L"OEM/DOS";
+    case MAC_CHARSET:         return L"Mac";
+    default:                  return L"";
+    }
+}
+
+static void build_font_enum_record(FontId id, FontEnumRecord* record)
+{
+    const FontEnumMetrics& metrics = font_table.enum_metrics[id];
+    BYTE pf = font_table.pitch_and_family[id];
+    BYTE flags = font_table.font_flags[id];
+    bool is_vector = (pf & (TMPF_VECTOR | TMPF_TRUETYPE)) != 0;
+
+    ZeroMemory(record, sizeof(*record));
+
+    NEWTEXTMETRICW& tm = record->ntm.ntmTm;
+    tm.tmAscent = metrics.ascent;
+    tm.tmDescent = metrics.descent;
+    tm.tmHeight = metrics.ascent + metrics.descent;
+    tm.tmInternalLeading = metrics.internal_leading;
+    tm.tmExternalLeading = metrics.external_leading;
+    tm.tmAveCharWidth = metrics.avg_width;
+    tm.tmMaxCharWidth = metrics.max_width;
+    tm.tmWeight = font_table.weight[id];
+    tm.tmDigitizedAspectX = tm.tmDigitizedAspectY = 96;
+    tm.tmFirstChar = metrics.first_char;
+    tm.tmLastChar = metrics.last_char;
+    tm.tmDefaultChar = metrics.default_char;
+    tm.tmBreakChar = metrics.break_char;
+    tm.tmItalic = (flags & FONT_FLAG_ITALIC) ? 255 : 0;
+    tm.tmUnderlined = (flags & FONT_FLAG_UNDERLINE) ? 255 : 0;
+    tm.tmStruckOut = (flags & FONT_FLAG_STRIKEOUT) ? 255 : 0;
+    tm.tmPitchAndFamily = pf;
+    tm.tmCharSet = font_table.charset[id];
+    tm.ntmFlags = metrics.ntm_flags;
+    tm.ntmSizeEM = is_vector ? metrics.size_em : tm.tmHeight - tm.tmInternalLeading;
+    tm.ntmCellHeight = tm.tmHeight;
+    tm.ntmAvgWidth = tm.tmAveCharWidth;
+    record->ntm.ntmFontSig = metrics.signature;
+
+    LOGFONTW& lf = record->elf.elfLogFont;
+    lf.lfHeight = tm.tmHeight;
+    lf.lfWidth = tm.tmAveCharWidth;
+    lf.lfWeight = tm.tmWeight;
+    lf.lfItalic = tm.tmItalic;
+    lf.lfUnderline = tm.tmUnderlined;
+    lf.lfStrikeOut = tm.tmStruckOut;
+    lf.lfCharSet = tm.tmCharSet;
+    lf.lfOutPrecision = is_vector ? OUT_STROKE_PRECIS : OUT_STRING_PRECIS;
+    lf.lfClipPrecision = CLIP_STROKE_PRECIS;
+    lf.lfQuality = DRAFT_QUALITY;
+    lf.lfPitchAndFamily = (pf & 0xF0) | ((pf & _TMPF_VARIABLE_PITCH) ? VARIABLE_PITCH : FIXED_PITCH);
+    lstrcpynW(lf.lfFaceName, font_string(font_table.family_name[id]), LF_FACESIZE);
+
+    PCWSTR full_name = font_string(font_table.full_name[id]);
+    lstrcpynW(record->elf.elfFullName, *full_name ? full_name : lf.lfFaceName, LF_FULLFACESIZE);
+    lstrcpynW(record->elf.elfStyle, font_string(font_table.style_name[id]), LF_FACESIZE);
+    lstrcpynW(record->elf.elfScript, get_script_name(tm.tmCharSet), LF_FACESIZE);
+
+    if (pf & TMPF_TRUETYPE)
+        record->font_type = TRUETYPE_FONTTYPE;
+    else if (!is_vector)
+        record->font_type = RASTER_FONTTYPE;
+}
+
+static void update_font_enum_index(void)
+{
+    FontEnumIndex& index = font_enum_index;
+    if (index.built && index.serial == font_set_serial)
+        return;
+
+    DWORD count = font_table.size();
+    index.records.resize(count);
+    for (FontId id = 0; id < count; ++id)
+        build_font_enum_record(id, &index.records[id]);
+
+    // Sort the live fonts by family name, charset and FontId
+    std::unordered_map<FontStringId, std::wstring> folded;
+    std::vector<std::pair<const std::wstring*, FontId> > order;
+    for (FontId id = 0; id < count; ++id)
+    {
+        if (get_font_file(id)->removed)
+            continue;
+        FontStringId name = font_table.family_name[id];
+        auto it = folded.find(name);
+        if (it == folded.end())
+            it = folded.insert(std::make_pair(name, fold_font_name(font_string(name)))).first;
+        order.push_back(std::make_pair(&it->second, id));
+    }
+    std::sort(order.begin(), order.end(),
+        [](const std::pair<const std::wstring*, FontId>& a, const std::pair<const std::wstring*, FontId>& b) {
+            int cmp = a.first->compare(*b.first);
+            if (cmp != 0)
+                return cmp < 0;
+            BYTE cs1 = font_table.charset[a.second], cs2 = font_table.charset[b.second];
+            if (cs1 != cs2)
+                return cs1 < cs2;
+            return a.second < b.second;
+        });
+
+    index.family_heads.clear();
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        if (i == 0 || *order[i].first != *order[i - 1].first ||
+            font_table.charset[order[i].second] != font_table.charset[order[i - 1].second])
+        {
+            index.family_heads.push_back(order[i].second);
+        }
+    }
+
+    index.built = true;
+    index.serial = font_set_serial;
+}
+
+static void free_font_enum_index(void)
+{
+    font_enum_index = FontEnumIndex();
+}
+
+// Emulate EnumFontFamiliesExW. With lfFaceName empty, every family is
+// enumerated once per charset; otherwise every font of the named family.
+// lfCharSet limits the charset unless it is DEFAULT_CHARSET.
+// Returns the last value returned by the callback.
+int EmulatedEnumFontFamiliesExW(HDC hdc, const LOGFONTW* plf, FONTENUMPROCW proc,
+                                LPARAM lParam, DWORD dwFlags)
+{
+    update_font_enum_index();
+    const std::vector<FontEnumRecord>& records = font_enum_index.records;
+    BYTE charset = plf->lfCharSet;
+    int ret = 1;
+
+    const std::vector<FontId>* fonts = &font_enum_index.family_heads;
+    if (plf->lfFaceName[0])
+    {
+        fonts = find_font_candidates(plf->lfFaceName);
+        if (!fonts)
+            return ret;
+    }
+
+    for (FontId id : *fonts)
+    {
+        if (charset != DEFAULT_CHARSET && font_table.charset[id] != charset)
+            continue;
+
+        const FontEnumRecord& record = records[id];
+        ret = proc(&record.elf.elfLogFont, (const TEXTMETRICW*)&record.ntm, record.font_type, lParam);
+        if (!ret)
+            break;
+    }
+
+    return ret;
+}
+
+// ---------------------------------------------------------------------------
+// Glyph compositing
+// Glyphs are blended on the CPU by textrender into a 32bpp top-down surface
+// of 0x00RRGGBB pixels. EmulatedExtTextOutW reads the destination under a
+// whole string into a DIB section once, draws every glyph there and writes it
+// back once, so a string costs a constant number of GDI calls.
+// ---------------------------------------------------------------------------
+
+// The DIB section strings are composited in. It only grows.
+struct CompositeBuffer {
+    HDC hdc;
+    HBITMAP hbm;
+    HGDIOBJ hbmOld;
+    DWORD* bits;
+    int width;
+    int height;
+};
+
+static CompositeBuffer composite_buffer;
+
+// The gamma and contrast text is blended with, as GetBlendGamma takes them
+static int text_gamma_level = BLEND_GAMMA_LINEAR;
+static int text_contrast_level = 0;
+
+void SetTextGamma(int gamma_level, int contrast_level)
+{
+    text_gamma_level = gamma_level;
+    text_contrast_level = contrast_level;
+}
+
+// Blend text as GDI does with the ClearType settings of the system: its
+// gamma is the font smoothing contrast, and it has no enhanced contrast
+void SetTextGammaFromSystem(void)
+{
+    UINT type = 0, contrast = 0;
+    if (SystemParametersInfoW(SPI_GETFONTSMOOTHINGTYPE, 0, &type, 0) &&
+        type == FE_FONTSMOOTHINGCLEARTYPE &&
+        SystemParametersInfoW(SPI_GETFONTSMOOTHINGCONTRAST, 0, &contrast, 0))
+    {
+        SetTextGamma((int)contrast, 0);
+    }
+    else
+    {
+        SetTextGamma(BLEND_GAMMA_LINEAR, 0);
+    }
+}
+
+static inline DWORD dib_pixel_from_color(COLORREF color)
+{
+    return ((DWORD)GetRValue(color) << 16) | ((DWORD)GetGValue(color) << 8) | GetBValue(color);
+}
+
+// Make the composite buffer at least width x height
+static bool PrepareCompositeBuffer(int width, int height)
+{
+    CompositeBuffer& buffer = composite_buffer;
+    if (buffer.hbm && width <= buffer.width && height <= buffer.height)
+        return true;
+
+    if (buffer.width > width)
+        width = buffer.width;
+    if (buffer.height > height)
+        height = buffer.height;
+
+    BITMAPINFO bmi = { 0 };
+    bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth       = width;
+    bmi.bmiHeader.biHeight      = -height; // top-down
+    bmi.bmiHeader.biPlanes      = 1;
+    bmi.bmiHeader.biBitCount    = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    void* bits;
+    HBITMAP hbm = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!hbm)
+        return false;
+
+    if (!buffer.hdc)
+    {
+        buffer.hdc = CreateCompatibleDC(NULL);
+        buffer.hbmOld = SelectObject(buffer.hdc, hbm);
+    }
+    else
+    {
+        SelectObject(buffer.hdc, hbm);
+        DeleteObject(buffer.hbm);
+    }
+
+    buffer.hbm = hbm;
+    buffer.bits = (DWORD*)bits;
+    buffer.width = width;
+    buffer.height = height;
+    return true;
+}
+
+static void FreeCompositeBuffer(void)
+{
+    CompositeBuffer& buffer = composite_buffer;
+    if (buffer.hdc)
+    {
+        SelectObject(buffer.hdc, buffer.hbmOld);
+        DeleteObject(buffer.hbm);
+        DeleteDC(buffer.hdc);
+    }
+    buffer = CompositeBuffer();
+}
+
+static FT_Int32 get_render_load_flags(bool is_raster)
+{
+    // Raster fonts always retrieve a monochrome bitmap.
+    if (is_raster)
+        return FT_LOAD_RENDER | FT_LOAD_TARGET_MONO | FT_LOAD_NO_HINTING;
+    return FT_LOAD_RENDER | FT_LOAD_TARGET_LCD;
+}
+
+// ---------------------------------------------------------------------------
+// Raster (.fon) character maps
+// A 65536-entry table per (codepage, FNT header) maps a UTF-16 code unit
+// straight to the FNT glyph index, replacing a WideCharToMultiByte call and
+// a range check per character.
+// ---------------------------------------------------------------------------
+
+#define RASTER_GLYPH_NONE 0xFFFF // The character has no single-byte form
+
+struct RasterCharMap {
+    UINT codepage;
+    FT_UShort first_char;
+    FT_UShort last_char;
+    FT_UShort default_char;
+    std::vector<WORD> glyphs;
+};
+
+static std::list<RasterCharMap> raster_char_maps;
+
+static const WORD* GetRasterCharMap(UINT codepage, const FT_WinFNT_HeaderRec* WinFNT)
+{
+    for (auto& map : raster_char_maps)
+    {
+        if (map.codepage == codepage && map.first_char == WinFNT->first_char &&
+            map.last_char == WinFNT->last_char && map.default_char == WinFNT->default_char)
+        {
+            return map.glyphs.data();
+        }
+    }
+
+    raster_char_maps.push_back(RasterCharMap());
+    RasterCharMap& map = raster_char_maps.back();
+    map.codepage = codepage;
+    map.first_char = WinFNT->first_char;
+    map.last_char = WinFNT->last_char;
+    map.default_char = WinFNT->default_char;
+    map.glyphs.resize(0x10000);
+
+    for (UINT code = 0; code < 0x10000; ++code)
+    {
+        // Convert Unicode codepoint to the FON codepage
+        WCHAR wc = (WCHAR)code;
+        char mb[4] = {};
+        int mblen = WideCharToMultiByte(codepage, 0, &wc, 1, mb, sizeof(mb), NULL, NULL);
+        if (mblen != 1)
+        {
+            map.glyphs[code] = RASTER_GLYPH_NONE;
+            continue;
+        }
+
+        unsigned char byte_val = (unsigned char)mb[0];
+        if (byte_val < WinFNT->first_char || byte_val > WinFNT->last_char)
+        {
+            // Out of range: use default_char
+            map.glyphs[code] = (WORD)(WinFNT->default_char - WinFNT->first_char);
+        }
+        else
+        {
+            map.glyphs[code] = (WORD)(byte_val - WinFNT->first_char + 1);
+        }
+    }
+
+    return map.glyphs.data();
+}
+
+static void FreeRasterCharMaps(void)
+{
+    raster_char_maps.clear();
+}
+
+// ---------------------------------------------------------------------------
+// Realized font cache
+// Mirrors Wine's find_cached_gdi_font()/hash_font() and unused_gdi_font_list:
+// a LOGFONT plus the world transform (quantized to 16.16 fixed point) maps to
+// a font that is ready to draw. Fonts that are no longer in use are kept on a
+// bounded unused list.
+// ---------------------------------------------------------------------------
+
+#define UNUSED_REALIZED_FONTS 16
+#define GLYPH_METRICS_PAGE_SIZE 256
+
+// Untransformed metrics of a glyph at the size of a realized font
+struct GlyphMetrics {
+    BYTE state;          // GLYPH_METRICS_*
+    FT_Vector advance;   // 26.6, as loaded
+    FT_Int bitmap_left;
+    FT_Int bitmap_top;
+    UINT black_box_x;
+    UINT black_box_y;
+    ABC abc;
+};
+
+#define GLYPH_METRICS_UNKNOWN 0
+#define GLYPH_METRICS_VALID   1
+#define GLYPH_METRICS_ERROR   2
+
+struct RealizedFont {
+    LOGFONTW lf;
+    FT_Matrix matrix;
+    size_t hash;
+    LONG ref_count;
+    std::list<RealizedFont*>::iterator unused_it;
+
+    FontId font_id;
+    FT_Face face;
+    bool is_raster;
+    FT_UInt ppem;          // 0 for bitmap strikes
+    FT_Int strike_index;   // -1 for scalable fonts
+    FT_WinFNT_HeaderRec WinFNT;
+    bool has_fnt_header;
+    int pixel_ascent;
+    int pixel_descent;
+    UINT codepage;
+    const WORD* raster_map; // Raster fonts only; see GetRasterCharMap
+    FT_Int32 load_flags;
+    std::vector<GlyphMetrics*> metrics_pages; // Indexed by glyph_index / GLYPH_METRICS_PAGE_SIZE
+
+    // Font linking; see GetFontForChar
+    bool links_resolved;
+    std::vector<FontId> link_ids;     // INVALID_FONT_ID once a link failed to open
+    std::vector<RealizedFont*> links; // Realized on first use; owned by this font
+};
+
+static std::unordered_multimap<size_t, RealizedFont*> realized_fonts;
+static std::list<RealizedFont*> unused_realized_fonts; // The front is the most recently used
+static size_t realized_font_count = 0; // Linked fonts included
+
+// Open the face of font->font_id and compute the pixel metrics for font->lf
+static bool OpenFaceForDraw(RealizedFont* font)
+{
+    FontId font_id = font->font_id;
+    LONG lfHeight = font->lf.lfHeight;
+
+    font->is_raster      = get_font_file(font_id)->is_raster;
+    font->face           = AcquireFace(font_id);
+    font->has_fnt_header = false;
+    font->ppem           = 0;
+    font->strike_index   = -1;
+    font->codepage       = get_codepage_from_charset(font_table.charset[font_id]);
+    font->load_flags     = get_render_load_flags(font->is_raster);
+    if (!font->face)
+        return false;
+
+    FT_Face face = font->face;
+    if (font->is_raster)
+    {
+        if (face->num_fixed_sizes > 0) {
+            int target_cell;
+            if (lfHeight < 0)
+                target_cell = labs(lfHeight) + font_table.raster_internal_leading[font_id];
+            else
+                target_cell = abs(lfHeight);
+
+            int best_idx = 0;
+            int best_diff = abs(face->available_sizes[0].height - target_cell);
+            for (int si = 1; si < face->num_fixed_sizes; ++si) {
+                int diff = abs(face->available_sizes[si].height - target_cell);
+                if (diff < best_diff) { best_diff = diff; best_idx = si; }
+            }
+            font->strike_index = best_idx;
+            ActivateFaceSize(face, 0, best_idx, NULL);
+        }
+
+        font->has_fnt_header = (FT_Get_WinFNT_Header(face, &font->WinFNT) == 0);
+        trace_printf(L"first_char=0x%02X, last_char=0x%02X, default_char=0x%02X\n",
+            font->WinFNT.first_char, font->WinFNT.last_char, font->WinFNT.default_char);
+
+        font->pixel_ascent = font->has_fnt_header
+            ? font->WinFNT.ascent
+            : (face->size->metrics.ascender + 32) >> 6;
+        // descent = cell height - ascent
+        int cell_height = font->has_fnt_header
+            ? (int)font->WinFNT.pixel_height
+            : ((face->size->metrics.height + 32) >> 6);
+        font->pixel_descent = cell_height - font->pixel_ascent;
+
+        // Built from the zeroed header if the font has none
+        font->raster_map = GetRasterCharMap(font->codepage, &font->WinFNT);
+    }
+    else
+    {
+        VdmxEntry vdmx = {};
+        bool have_vdmx = lookup_VDMX(GetFaceVdmx(face), lfHeight, &vdmx);
+
+        int ppem;
+        if (have_vdmx)
+            ppem = vdmx.ppem;
+        else
+            ppem = CalcPpemForHeight(face, lfHeight);
 
-    for (;;)
-    {
-        name_size = sizeof(value_name);
-        data_size = sizeof(value_data);
-        LSTATUS status = RegEnumValueW(hKey, index++, value_name, &name_size,
-                                       NULL, &type,
-                                       reinterpret_cast<PBYTE>(value_data),
-                                       &data_size);
-        if (status == ERROR_NO_MORE_ITEMS)
-            break;
-        if (status != ERROR_SUCCESS || type != REG_SZ)
-            continue;
+        if (ActivateFaceSize(face, ppem, -1, NULL) != 0)
+        {
+            ReleaseFace(face);
+            font->face = NULL;
+            return false;
+        }
+        font->ppem = ppem;
 
-        // Convert to full path
-        WCHAR full_path[MAX_PATH];
-        if (PathIsRelativeW(value_data))
+        if (have_vdmx)
         {
-            lstrcpynW(full_path, fonts_dir, _countof(full_path));
-            PathAppendW(full_path, value_data);
+            font->pixel_ascent  = vdmx.yMax;
+            font->pixel_descent = -vdmx.yMin;
         }
         else
         {
-            lstrcpynW(full_path, value_data, _countof(full_path));
+            GetOutlineExtents(face, ppem, &font->pixel_ascent, &font->pixel_descent);
         }
+    }
 
-        // Skip if the file does not exist
-        if (!PathFileExistsW(full_path))
-            continue;
+    return true;
+}
 
-        // Load all faces with FreeType (same logic as load_font with -1)
-        load_font(full_path, -1);
-    }
+static size_t hash_realized_font(const LOGFONTW* plf, const FT_Matrix* matrix)
+{
+    // FNV-1a over the fixed part of the LOGFONT, the face name and the matrix
+    size_t hash = 2166136261U;
+    const BYTE* pb = (const BYTE*)plf;
+    for (size_t i = 0; i < offsetof(LOGFONTW, lfFaceName); ++i)
+        hash = (hash ^ pb[i]) * 16777619U;
+    for (INT i = 0; i < LF_FACESIZE && plf->lfFaceName[i]; ++i)
+        hash = (hash ^ (size_t)plf->lfFaceName[i]) * 16777619U;
+    pb = (const BYTE*)matrix;
+    for (size_t i = 0; i < sizeof(*matrix); ++i)
+        hash = (hash ^ pb[i]) * 16777619U;
+    return hash;
 }
 
-void load_from_fonts_folder()
+static bool equal_logfont(const LOGFONTW* plf1, const LOGFONTW* plf2)
 {
-    WCHAR path[MAX_PATH];
-    lstrcpynW(path, fonts_dir, MAX_PATH);
-    PathAppendW(path, L"*.*");
+    if (memcmp(plf1, plf2, offsetof(LOGFONTW, lfFaceName)) != 0)
+        return false;
+    return wcsncmp(plf1->lfFaceName, plf2->lfFaceName, LF_FACESIZE) == 0;
+}
 
-    WIN32_FIND_DATAW find;
-    HANDLE hFind = FindFirstFileW(path, &find);
-    if (hFind != INVALID_HANDLE_VALUE)
+static void free_glyph_metrics(RealizedFont* font)
+{
+    for (auto* page : font->metrics_pages)
+        delete[] page;
+    font->metrics_pages.clear();
+}
+
+static void free_realized_font(RealizedFont* font)
+{
+    auto range = realized_fonts.equal_range(font->hash);
+    for (auto it = range.first; it != range.second; ++it)
     {
-        do
+        if (it->second == font)
         {
-            if (lstrcmpW(find.cFileName, L".") == 0 || lstrcmpW(find.cFileName, L"..") == 0)
-                continue;
-
-            if (is_supported_font(find.cFileName)) {
-                lstrcpynW(path, fonts_dir, _countof(path));
-                PathAppendW(path, find.cFileName);
-                load_font(path, -1);
-            }
-        } while (FindNextFileW(hFind, &find));
-        FindClose(hFind);
+            realized_fonts.erase(it);
+            break;
+        }
+    }
+    for (auto* link : font->links)
+    {
+        if (link)
+            free_realized_font(link);
     }
+    ReleaseFace(font->face);
+    free_glyph_metrics(font);
+    delete font;
+    --realized_font_count;
 }
 
-BOOL InitFontSupport(VOID)
+// Find or create the realized font for a LOGFONT and world transform.
+// Call ReleaseRealizedFont when done with it.
+static RealizedFont* AcquireRealizedFont(const LOGFONTW* plf, const FT_Matrix* matrix)
 {
-    SHGetSpecialFolderPathW(NULL, fonts_dir, CSIDL_FONTS, FALSE);
+    size_t hash = hash_realized_font(plf, matrix);
 
-    FT_Error error = FT_Init_FreeType(&library);
-    if (error) {
-        wprintf(L"FT_Init_FreeType: %d\n", error);
-        return FALSE;
+    auto range = realized_fonts.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        RealizedFont* font = it->second;
+        if (equal_matrix(font->matrix, *matrix) && equal_logfont(&font->lf, plf))
+        {
+            if (font->ref_count++ == 0)
+                unused_realized_fonts.erase(font->unused_it);
+            return font;
+        }
     }
 
-    FT_Int major, minor, patch;
-    FT_Library_Version(library, &major, &minor, &patch);
-    wprintf(L"FreeType %d.%d.%d\n", major, minor, patch);
-
-    FT_Library_SetLcdFilter(library, FT_LCD_FILTER_DEFAULT);
+    FontId font_id = find_font_by_logfont(plf);
+    if (font_id == INVALID_FONT_ID)
+        return NULL;
 
-    HKEY hKey;
-    error = RegCreateKeyExW(HKEY_CURRENT_USER, reg_key, 0, NULL, 0,
-                            KEY_ALL_ACCESS, NULL, &hKey, NULL);
-    if (!error) {
-        error = RegEnumValueW(hKey, 0, NULL, NULL, NULL, NULL, NULL, NULL);
-        if (error) {
-            load_from_fonts_folder();
-            //write_fonts_to_registry(hKey);
-        } else {
-            read_fonts_from_registry(hKey);
-        }
-        RegCloseKey(hKey);
+    RealizedFont* font = new RealizedFont();
+    font->lf = *plf;
+    font->matrix = *matrix;
+    font->hash = hash;
+    font->ref_count = 1;
+    font->font_id = font_id;
+    if (!OpenFaceForDraw(font))
+    {
+        delete font;
+        return NULL;
     }
 
-    return TRUE;
+    realized_fonts.insert(std::make_pair(hash, font));
+    ++realized_font_count;
+    return font;
 }
 
-VOID FreeFontSupport(VOID)
+// Realize a linked font at the size of its base font. It has no links itself.
+static RealizedFont* RealizeLinkedFont(const RealizedFont* base, FontId font_id)
 {
-    free_fonts();
-    FT_Done_FreeType(library);
-    DeleteObject(hbmMask_cache);
+    RealizedFont* font = new RealizedFont();
+    font->lf = base->lf;
+    font->matrix = base->matrix;
+    font->hash = 0;
+    font->ref_count = 1;
+    font->font_id = font_id;
+    font->links_resolved = true;
+    if (!OpenFaceForDraw(font))
+    {
+        delete font;
+        return NULL;
+    }
+    ++realized_font_count;
+    return font;
 }
 
-FontInfo* find_font_by_logfont(const LOGFONTW *plf)
+// Get the font that draws a codepoint and its glyph index. A character the
+// font lacks is drawn by the first linked font whose coverage has it, or as
+// the .notdef glyph of the font if none has.
+static RealizedFont* GetFontForChar(RealizedFont* font, FT_ULong codepoint, FT_UInt* glyph_index)
 {
-    PCWSTR font_name = plf->lfFaceName;
-    FT_Byte preferred_charset = plf->lfCharSet;
-    int preferred_height = plf->lfHeight;
-
-    FT_Long style_flags = 0;
-    if (plf->lfWeight >= FW_BOLD)
-        style_flags |= FT_STYLE_FLAG_BOLD;
-    if (plf->lfItalic)
-        style_flags |= FT_STYLE_FLAG_ITALIC;
+    *glyph_index = GetGlyphIndex(font->face, codepoint);
+    if (*glyph_index != 0 || font->is_raster)
+        return font;
 
-    FontInfo* best = NULL;
-    int total_penalty,best_penalty = INT_MAX;
+    if (!font->links_resolved)
+    {
+        font->link_ids = *get_font_link_chain(font->font_id, &font->lf);
+        font->links.assign(font->link_ids.size(), NULL);
+        font->links_resolved = true;
+    }
 
-    for (auto* font_info : registered_fonts)
+    for (size_t i = 0; i < font->link_ids.size(); ++i)
     {
-        if (lstrcmpiW(font_info->family_name.c_str(), font_name) != 0 &&
-            lstrcmpiW(font_info->english_name.c_str(), font_name) != 0)
-        {
+        if (font->link_ids[i] == INVALID_FONT_ID)
             continue;
-        }
 
-        if (!is_raster_font(font_info->wide_path))
+        RealizedFont* link = font->links[i];
+        if (!link)
         {
-            if (font_info->style_flags == style_flags)
-                return font_info;
-            continue;
+            link = RealizeLinkedFont(font, font->link_ids[i]);
+            if (!link)
+            {
+                font->link_ids[i] = INVALID_FONT_ID;
+                continue;
+            }
+            font->links[i] = link;
         }
 
-        int charset_penalty = 0, size_penalty = 0;
-        if (preferred_charset != DEFAULT_CHARSET && font_info->charset != preferred_charset)
-            charset_penalty += 10000;
-
-        if (is_raster_font(font_info->wide_path))
+        if (FaceHasChar(link->face, codepoint))
         {
-            int size;
-            if (preferred_height < 0)
-                size = labs(preferred_height) + font_info->raster_internal_leading;
-            else if (preferred_height > 0)
-                size = preferred_height;
-            else
-                size = 12;
-            size_penalty = abs(font_info->raster_height - size);
+            *glyph_index = GetGlyphIndex(link->face, codepoint);
+            return link;
         }
+    }
 
-        total_penalty = charset_penalty + size_penalty;
+    return font;
+}
 
-        if (total_penalty < best_penalty)
-        {
-            best_penalty = total_penalty;
-            best = font_info;
-        }
-    }
+static void ReleaseRealizedFont(RealizedFont* font)
+{
+    if (--font->ref_count > 0)
+        return;
 
-    if (best)
-        return best;
+    unused_realized_fonts.push_front(font);
+    font->unused_it = unused_realized_fonts.begin();
 
-    // If style_flags do not match, search again by name only
-    for (std::vector<FontInfo*>::iterator it = registered_fonts.begin();
-         it != registered_fonts.end(); ++it)
+    if (unused_realized_fonts.size() > UNUSED_REALIZED_FONTS)
     {
-        FontInfo* font_info = *it;
-        if (lstrcmpiW(font_info->family_name.c_str(), font_name) == 0)
-            return font_info;
+        RealizedFont* oldest = unused_realized_fonts.back();
+        unused_realized_fonts.pop_back();
+        free_realized_font(oldest);
     }
-
-    return NULL;
 }
 
-void draw_glyph(HDC hdc, FT_Bitmap* bitmap, int left, int top,
-                COLORREF fg_color, COLORREF bg_color)
+// Activate the size of the realized font on its face with the given transform
+static void SelectRealizedFont(RealizedFont* font, const FT_Matrix* matrix)
 {
-    int w = (int)bitmap->width;
-    int h = (int)bitmap->rows;
-    if (w <= 0 || h <= 0)
-        return;
-
-    int bkMode = GetBkMode(hdc);
+    if (font->strike_index >= 0 || font->ppem != 0)
+        ActivateFaceSize(font->face, font->ppem, font->strike_index, matrix);
+    else
+        FT_Set_Transform(font->face, const_cast<FT_Matrix*>(matrix), NULL);
+}
 
-    // Create a working DC and bitmap
-    HDC hdcSrc = CreateCompatibleDC(hdc);
-    HBITMAP hbmSrc = CreateCompatibleBitmap(hdc, w, h);
-    HGDIOBJ hbmSrcOld = SelectObject(hdcSrc, hbmSrc);
+// Get the metrics of a glyph without rendering it.
+// The font must be selected untransformed (SelectRealizedFont(font, NULL)).
+static const GlyphMetrics* GetGlyphMetrics(RealizedFont* font, FT_UInt glyph_index)
+{
+    size_t page_index = glyph_index / GLYPH_METRICS_PAGE_SIZE;
+    if (page_index >= font->metrics_pages.size())
+        font->metrics_pages.resize(page_index + 1, NULL);
+
+    GlyphMetrics*& page = font->metrics_pages[page_index];
+    if (!page)
+        page = new GlyphMetrics[GLYPH_METRICS_PAGE_SIZE]();
+
+    GlyphMetrics* metrics = &page[glyph_index % GLYPH_METRICS_PAGE_SIZE];
+    if (metrics->state == GLYPH_METRICS_VALID)
+        return metrics;
+    if (metrics->state == GLYPH_METRICS_ERROR)
+        return NULL;
 
-    if (bkMode == OPAQUE) {
-        HBRUSH hbrBg = CreateSolidBrush(bg_color);
-        RECT rc = { left, top, left + w, top + h };
-        FillRect(hdc, &rc, hbrBg);
-        DeleteObject(hbrBg);
+    FT_Face face = font->face;
+    if (FT_Load_Glyph(face, glyph_index, font->load_flags & ~FT_LOAD_RENDER) != 0)
+    {
+        metrics->state = GLYPH_METRICS_ERROR;
+        return NULL;
     }
 
-    if (bitmap->pixel_mode == FT_PIXEL_MODE_MONO)
+    FT_GlyphSlot slot = face->glyph;
+    metrics->advance = slot->advance;
+    if (slot->format == FT_GLYPH_FORMAT_OUTLINE)
     {
-        // --- Monochrome (1bpp) processing ---
-
-        HBRUSH hbrFg = CreateSolidBrush(fg_color);
-        RECT rcSrc = { 0, 0, w, h };
-        FillRect(hdcSrc, &rcSrc, hbrFg);
-        DeleteObject(hbrFg);
+        // The black box of the outline, grid-fitted the same way as rendering does
+        FT_BBox cbox;
+        FT_Outline_Get_CBox(&slot->outline, &cbox);
+        cbox.xMin &= ~63;
+        cbox.yMin &= ~63;
+        cbox.xMax = (cbox.xMax + 63) & ~63;
+        cbox.yMax = (cbox.yMax + 63) & ~63;
+        metrics->bitmap_left = (FT_Int)(cbox.xMin >> 6);
+        metrics->bitmap_top  = (FT_Int)(cbox.yMax >> 6);
+        metrics->black_box_x = (UINT)((cbox.xMax - cbox.xMin) >> 6);
+        metrics->black_box_y = (UINT)((cbox.yMax - cbox.yMin) >> 6);
+    }
+    else
+    {
+        metrics->bitmap_left = slot->bitmap_left;
+        metrics->bitmap_top  = slot->bitmap_top;
+        metrics->black_box_x = slot->bitmap.width;
+        metrics->black_box_y = slot->bitmap.rows;
+    }
 
-        if (w > hbmMask_cache_w || h > hbmMask_cache_h)
-        {
-            if (hbmMask_cache) { DeleteObject(hbmMask_cache); hbmMask_cache = NULL; }
-            hbmMask_cache = CreateBitmap(w, h, 1, 1, NULL);
-            hbmMask_cache_w = w;
-            hbmMask_cache_h = h;
-        }
+    INT advance_px = (INT)(((slot->advance.x + 63) & ~63) >> 6);
+    metrics->abc.abcA = metrics->bitmap_left;
+    metrics->abc.abcB = metrics->black_box_x;
+    metrics->abc.abcC = advance_px - metrics->abc.abcA - (INT)metrics->abc.abcB;
 
-        int src_pitch = (bitmap->pitch < 0) ? -bitmap->pitch : bitmap->pitch;
-        int row_bytes = (w + 7) / 8;
-        int dib_stride = (row_bytes + 3) & ~3; // DWORD align
+    metrics->state = GLYPH_METRICS_VALID;
+    return metrics;
+}
 
-        std::vector<BYTE> packed(dib_stride * h, 0);
-        for (int r = 0; r < h; ++r)
-            memcpy(&packed[r * dib_stride],
-                   bitmap->buffer + r * src_pitch,
-                   row_bytes);
+// Free the realized fonts that are not in use, after the font set changed
+static void FlushUnusedRealizedFonts(void)
+{
+    while (!unused_realized_fonts.empty())
+    {
+        RealizedFont* font = unused_realized_fonts.back();
+        unused_realized_fonts.pop_back();
+        free_realized_font(font);
+    }
+}
 
-        // Pass as top-down DIB by setting biHeight negative
-        struct { BITMAPINFOHEADER bih; RGBQUAD colors[2]; } bmiMono2 = {};
-        bmiMono2.bih.biSize        = sizeof(BITMAPINFOHEADER);
-        bmiMono2.bih.biWidth       = w;
-        bmiMono2.bih.biHeight      = -h; // top-down
-        bmiMono2.bih.biPlanes      = 1;
-        bmiMono2.bih.biBitCount    = 1;
-        bmiMono2.bih.biCompression = BI_RGB;
-        bmiMono2.colors[0] = { 0,   0,   0,   0 }; // index 0 = black
-        bmiMono2.colors[1] = { 255, 255, 255, 0 }; // index 1 = white
+// Free every realized font, with the linked fonts it owns
+static void FreeRealizedFonts(void)
+{
+    std::vector<RealizedFont*> fonts;
+    fonts.reserve(realized_fonts.size());
+    for (auto& pair : realized_fonts)
+        fonts.push_back(pair.second);
+    for (auto* font : fonts)
+        free_realized_font(font);
+    realized_fonts.clear();
+    unused_realized_fonts.clear();
+}
 
-        SetDIBits(NULL, hbmMask_cache, 0, h, packed.data(),
-                  reinterpret_cast<BITMAPINFO*>(&bmiMono2), DIB_RGB_COLORS);
+// The number of realized fonts alive, to check for leaks
+size_t GetRealizedFontCount(void)
+{
+    return realized_font_count;
+}
 
-        MaskBlt(hdc, left, top, w, h,
-                hdcSrc, 0, 0,
-                hbmMask_cache, 0, 0,
-                MAKEROP4(SRCCOPY, 0x00AA0029 /* DST */));
+// ---------------------------------------------------------------------------
+// Font set updates
+// Applies the changes reported by a FontWatcher to the font table, the name
+// index, the face and realized font caches, and the catalog. The work done
+// depends on the number of changed files, not on the size of the font set.
+// ---------------------------------------------------------------------------
 
-        // Do not DeleteObject hbmMask_cache as it is reused
-    }
-    else if (bitmap->pixel_mode == FT_PIXEL_MODE_LCD)
-    {
-        int logical_w = w / 3;
+static void remove_font_file(DWORD index)
+{
+    FontFile* file = &font_table.files[index];
+    remove_file_from_font_name_index(file);
+    font_table.file_ids.erase(file->path);
+    file->removed = true;
+    ++font_set_serial;
+    for (DWORD i = 0; i < file->num_fonts; ++i)
+        font_table.base_penalty[file->first_font + i] = FONT_PENALTY_REMOVED;
+
+    // The realized fonts may hold its faces
+    FlushUnusedRealizedFonts();
+    RetireFaces(font_string(file->path));
+
+    catalog_dirty = true;
+}
 
-        HDC hdcWork = CreateCompatibleDC(hdc);
-        HBITMAP hbmWork = CreateCompatibleBitmap(hdc, logical_w, h);
-        HGDIOBJ hbmWorkOld = SelectObject(hdcWork, hbmWork);
+// Is path a file right inside dir?
+static bool is_file_in_directory(PCWSTR path, PCWSTR dir)
+{
+    PCWSTR name = PathFindFileNameW(path);
+    size_t cch = lstrlenW(dir);
+    if (cch > 0 && dir[cch - 1] == L'\\')
+        --cch;
+    return (size_t)(name - path) == cch + 1 && StrCmpNIW(path, dir, (int)cch) == 0;
+}
 
-        BitBlt(hdcWork, 0, 0, logical_w, h, hdc, left, top, SRCCOPY);
+// Bring the fonts of a directory in line with its contents
+static void rescan_font_directory(PCWSTR dir)
+{
+    std::unordered_map<DWORD, bool> seen;
+    std::vector<FontScanJob> jobs;
 
-        std::vector<DWORD> pixels(logical_w * h);
-        BITMAPINFO bmi = { 0 };
-        bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
-        bmi.bmiHeader.biWidth       = logical_w;
-        bmi.bmiHeader.biHeight      = -h; // top-down
-        bmi.bmiHeader.biPlanes      = 1;
-        bmi.bmiHeader.biBitCount    = 32;
-        bmi.bmiHeader.biCompression = BI_RGB;
+    WCHAR path[MAX_PATH];
+    lstrcpynW(path, dir, _countof(path));
+    PathAppendW(path, L"*.*");
 
-        GetDIBits(hdcWork, hbmWork, 0, h, pixels.data(), &bmi, DIB_RGB_COLORS);
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = FindFirstFileW(path, &find);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!is_supported_font(find.cFileName))
+                continue;
 
-        int src_pitch = (bitmap->pitch < 0) ? -bitmap->pitch : bitmap->pitch;
+            lstrcpynW(path, dir, _countof(path));
+            PathAppendW(path, find.cFileName);
+            ULONGLONG file_size = make_ulonglong(find.nFileSizeLow, find.nFileSizeHigh);
+            ULONGLONG write_time = make_ulonglong(find.ftLastWriteTime.dwLowDateTime,
+                                                  find.ftLastWriteTime.dwHighDateTime);
 
-        for (int row = 0; row < h; ++row)
-        {
-            for (int col = 0; col < logical_w; ++col)
+            DWORD index = find_font_file(path);
+            if (index != INVALID_FONT_FILE)
             {
-                // FreeType FT_PIXEL_MODE_LCD buffer stores subpixels in R,G,B order.
-                unsigned char R_sub = bitmap->buffer[row * src_pitch + col * 3 + 0];
-                unsigned char G_sub = bitmap->buffer[row * src_pitch + col * 3 + 1];
-                unsigned char B_sub = bitmap->buffer[row * src_pitch + col * 3 + 2];
-
-                if (R_sub == 0 && G_sub == 0 && B_sub == 0) continue;
-
-                COLORREF target_bg;
-                if (bkMode == TRANSPARENT) {
-                    DWORD pixel = pixels[row * logical_w + col];
-                    target_bg = RGB(GetBValue(pixel), GetGValue(pixel), GetRValue(pixel));
-                } else {
-                    target_bg = bg_color;
+                const FontFile& file = font_table.files[index];
+                if (file.file_size == file_size && file.write_time == write_time)
+                {
+                    seen[index] = true;
+                    continue;
                 }
-
-                int r = (GetRValue(fg_color) * R_sub + GetRValue(target_bg) * (255 - R_sub)) / 255;
-                int g = (GetGValue(fg_color) * G_sub + GetGValue(target_bg) * (255 - G_sub)) / 255;
-                int b = (GetBValue(fg_color) * B_sub + GetBValue(target_bg) * (255 - B_sub)) / 255;
-
-                // DIB (BI_RGB 32bpp) pixel layout is 0x00RRGGBB, so R goes to bits 16-23.
-                pixels[row * logical_w + col] = ((DWORD)r << 16) | ((DWORD)g << 8) | (DWORD)b;
+                remove_font_file(index);
             }
-        }
-
-        SetDIBits(hdcWork, hbmWork, 0, h, pixels.data(), &bmi, DIB_RGB_COLORS);
-        BitBlt(hdc, left, top, logical_w, h, hdcWork, 0, 0, SRCCOPY);
-
-        SelectObject(hdcWork, hbmWorkOld);
-        DeleteObject(hbmWork);
-        DeleteDC(hdcWork);
+            add_font_scan_job(jobs, path, file_size, write_time);
+        } while (FindNextFileW(hFind, &find));
+        FindClose(hFind);
     }
-    else
-    {
-        // --- Grayscale (8bpp) processing ---
-
-        BitBlt(hdcSrc, 0, 0, w, h, hdc, left, top, SRCCOPY);
 
-        std::vector<DWORD> pixels(w * h);
-        BITMAPINFO bmi = { 0 };
-        bmi.bmiHeader.biSize        = sizeof(BITMAPINFOHEADER);
-        bmi.bmiHeader.biWidth       = w;
-        bmi.bmiHeader.biHeight      = -h; // top-down
-        bmi.bmiHeader.biPlanes      = 1;
-        bmi.bmiHeader.biBitCount    = 32;
-        bmi.bmiHeader.biCompression = BI_RGB;
-
-        GetDIBits(hdcSrc, hbmSrc, 0, h, pixels.data(), &bmi, DIB_RGB_COLORS);
-
-        int src_pitch = (bitmap->pitch < 0) ? -bitmap->pitch : bitmap->pitch;
-
-        for (int row = 0; row < h; ++row)
+    for (DWORD index = 0; index < font_table.files.size(); ++index)
+    {
+        const FontFile& file = font_table.files[index];
+        if (!file.removed && !seen.count(index) &&
+            is_file_in_directory(font_string(file.path), dir))
         {
-            for (int col = 0; col < w; ++col)
-            {
-                unsigned char alpha = bitmap->buffer[row * src_pitch + col];
-                if (alpha == 0) continue;
-
-                COLORREF target_bg;
-                if (bkMode == TRANSPARENT) {
-                    DWORD pixel = pixels[row * w + col];
-                    target_bg = RGB(GetBValue(pixel), GetGValue(pixel), GetRValue(pixel));
-                } else {
-                    target_bg = bg_color;
-                }
-
-                int r = (GetRValue(fg_color) * alpha + GetRValue(target_bg) * (255 - alpha)) / 255;
-                int g = (GetGValue(fg_color) * alpha + GetGValue(target_bg) * (255 - alpha)) / 255;
-                int b = (GetBValue(fg_color) * alpha + GetBValue(target_bg) * (255 - alpha)) / 255;
-                // DIB (BI_RGB 32bpp) pixel layout is 0x00RRGGBB, so R goes to bits 16-23.
-                pixels[row * w + col] = ((DWORD)r << 16) | ((DWORD)g << 8) | (DWORD)b;
-            }
+            remove_font_file(index);
         }
-
-        SetDIBits(hdcSrc, hbmSrc, 0, h, pixels.data(), &bmi, DIB_RGB_COLORS);
-        BitBlt(hdc, left, top, w, h, hdcSrc, 0, 0, SRCCOPY);
     }
 
-    SelectObject(hdcSrc, hbmSrcOld);
-    DeleteObject(hbmSrc);
-    DeleteDC(hdcSrc);
+    scan_font_files(jobs);
 }
 
-static bool OpenFaceForDraw(
-    FontInfo*            font_info,
-    LONG                 lfHeight,
-    INT                  Y,
-    FT_Face*             out_face,
-    FT_WinFNT_HeaderRec* out_WinFNT,
-    bool*                out_has_fnt_header,
-    int*                 out_pixel_ascent,
-    int*                 out_pixel_descent,
-    int*                 out_baseline_y)
+// Apply a batch of changes read from a FontWatcher
+static void apply_font_changes(const std::vector<FontWatchEvent>& events)
 {
-    bool is_raster = is_raster_font(font_info->wide_path);
-    *out_face            = NULL;
-    *out_has_fnt_header  = false;
+    std::vector<FontScanJob> jobs;
+    bool changed = false;
 
-    if (is_raster)
+    for (auto& event : events)
     {
-        if (FT_New_Face(library, font_info->ansi_path, font_info->face_index, out_face) != 0)
-            return false;
-
-        if ((*out_face)->num_fixed_sizes > 0) {
-            int target_cell;
-            if (lfHeight < 0)
-                target_cell = labs(lfHeight) + font_info->raster_internal_leading;
-            else
-                target_cell = abs(lfHeight);
+        PCWSTR path = event.path.c_str();
+        if (event.action == FONT_WATCH_RESCAN)
+        {
+            rescan_font_directory(path);
+            changed = true;
+            continue;
+        }
+        if (!is_supported_font(path))
+            continue;
 
-            int best_idx = 0;
-            int best_diff = abs((*out_face)->available_sizes[0].height - target_cell);
-            for (int si = 1; si < (*out_face)->num_fixed_sizes; ++si) {
-                int diff = abs((*out_face)->available_sizes[si].height - target_cell);
-                if (diff < best_diff) { best_diff = diff; best_idx = si; }
-            }
-            FT_Select_Size(*out_face, best_idx);
+        // A modified file is registered again from scratch
+        DWORD index = find_font_file(path);
+        if (index != INVALID_FONT_FILE)
+        {
+            remove_font_file(index);
+            changed = true;
         }
+        if (event.action == FONT_WATCH_REMOVED)
+            continue;
 
-        *out_has_fnt_header = (FT_Get_WinFNT_Header(*out_face, out_WinFNT) == 0);
-        wprintf(L"first_char=0x%02X, last_char=0x%02X, default_char=0x%02X\n",
-            out_WinFNT->first_char, out_WinFNT->last_char, out_WinFNT->default_char);
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExW(path, GetFileExInfoStandard, &data))
+            continue;
+        add_font_scan_job(jobs, path,
+                          make_ulonglong(data.nFileSizeLow, data.nFileSizeHigh),
+                          make_ulonglong(data.ftLastWriteTime.dwLowDateTime,
+                                         data.ftLastWriteTime.dwHighDateTime));
+    }
 
-        *out_pixel_ascent = (*out_has_fnt_header)
-            ? out_WinFNT->ascent
-            : ((*out_face)->size->metrics.ascender + 32) >> 6;
-        // descent = cell height - ascent
-        int cell_height = (*out_has_fnt_header)
-            ? (int)out_WinFNT->pixel_height
-            : (((*out_face)->size->metrics.height + 32) >> 6);
-        *out_pixel_descent = cell_height - *out_pixel_ascent;
-        *out_baseline_y = Y + *out_pixel_ascent;
+    if (!jobs.empty())
+    {
+        scan_font_files(jobs);
+        changed = true;
     }
-    else
+
+    if (changed)
     {
-        FT_Face tmp_face = NULL;
-        if (FT_New_Face(library, font_info->ansi_path, font_info->face_index, &tmp_face) != 0)
-            return false;
+        // A new font may be a better match for a cached LOGFONT
+        FlushUnusedRealizedFonts();
 
-        VdmxEntry vdmx = {};
-        bool have_vdmx = load_VDMX(tmp_face, lfHeight, &vdmx);
+        if (catalog_dirty && catalog_path[0])
+            write_font_catalog();
+        catalog_dirty = false;
+    }
+}
 
-        int ppem;
-        if (have_vdmx)
-            ppem = vdmx.ppem;
-        else
-            ppem = calc_ppem_for_height(tmp_face, lfHeight);
+// Keep the font set in sync with a directory until the watcher fails
+void WatchFontDirectory(PCWSTR dir)
+{
+    FontWatcher* watcher = OpenFontWatcher(dir);
+    if (!watcher)
+    {
+        wprintf(L"%ls: cannot watch\n", dir);
+        return;
+    }
 
-        FT_Done_Face(tmp_face);
+    LARGE_INTEGER freq, t0, t1;
+    QueryPerformanceFrequency(&freq);
 
-        if (FT_New_Face(library, font_info->ansi_path, font_info->face_index, out_face) != 0)
-            return false;
-        FT_Set_Pixel_Sizes(*out_face, 0, ppem);
+    rescan_font_directory(dir);
+    wprintf(L"Watching %ls (%u files)\n", dir, (UINT)font_table.files.size());
 
-        if (have_vdmx)
-        {
-            *out_pixel_ascent  = vdmx.yMax;
-            *out_pixel_descent = -vdmx.yMin;
-        }
-        else
+    std::vector<FontWatchEvent> events;
+    for (;;)
+    {
+        events.clear();
+        if (!ReadFontWatcher(watcher, -1, events))
+            break;
+
+        QueryPerformanceCounter(&t0);
+        apply_font_changes(events);
+        QueryPerformanceCounter(&t1);
+
+        for (auto& event : events)
         {
-            TT_OS2* os2 = (TT_OS2*)FT_Get_Sfnt_Table(*out_face, FT_SFNT_OS2);
-            if (os2 && (os2->usWinAscent != 0 || os2->usWinDescent != 0))
-            {
-                FT_Fixed em_scale = FT_MulDiv(
-                    (FT_Long)ppem, 1 << 16,
-                    (FT_Long)(*out_face)->units_per_EM);
-                *out_pixel_ascent  = (int)FT_MulFix((FT_Long)os2->usWinAscent,  em_scale);
-                *out_pixel_descent = (int)FT_MulFix((FT_Long)os2->usWinDescent, em_scale);
-            }
-            else
-            {
-                *out_pixel_ascent  = ((*out_face)->size->metrics.ascender  + 32) >> 6;
-                *out_pixel_descent = (-(*out_face)->size->metrics.descender + 32) >> 6;
-            }
+            static const WCHAR* actions[] = { L"added", L"removed", L"modified", L"rescan" };
+            wprintf(L"%ls: %ls\n", event.path.c_str(), actions[event.action]);
         }
-
-        *out_baseline_y = Y + *out_pixel_ascent;
+        wprintf(L"%u changes applied in %.3f ms\n", (UINT)events.size(),
+                (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart);
     }
 
-    return true;
+    CloseFontWatcher(watcher);
 }
 
 static void get_text_disposition(
     int* width,
     int* height,
-    FontInfo*    font_info,
-    FT_Face      face,
-    bool         is_raster,
+    RealizedFont* font,
     const WCHAR* lpString,
     INT          Count,
     CONST INT*   lpDx)
@@ -1303,14 +4047,14 @@ static void get_text_disposition(
     if (!lpString || Count <= 0)
         return;
 
-    UINT codepage = get_codepage_from_charset(font_info->charset);
-    FT_Int32 load_flags = is_raster
-        ? (FT_LOAD_DEFAULT | FT_LOAD_TARGET_MONO | FT_LOAD_NO_HINTING)
-        : (FT_LOAD_DEFAULT | FT_LOAD_TARGET_LCD);
+    FT_Face face = font->face;
+    bool is_raster = font->is_raster;
+    UINT codepage = font->codepage;
 
     FT_Pos total_x = 0, total_y = 0;
     FT_UInt previous_glyph = 0;
     bool use_kerning = (FT_HAS_KERNING(face) != 0);
+    RealizedFont* current_font = font;
 
     for (INT i = 0; i < Count; ++i)
     {
@@ -1331,32 +4075,32 @@ static void get_text_disposition(
         }
 
         FT_UInt glyph_index;
-        if (is_raster)
+        if (is_raster && font->has_fnt_header)
+        {
+            WORD glyph = font->raster_map[(WCHAR)codepoint];
+            if (glyph == RASTER_GLYPH_NONE) continue;
+            glyph_index = glyph;
+        }
+        else if (is_raster)
         {
             WCHAR wc = static_cast<WCHAR>(codepoint);
             char mb[4] = {};
             int mblen = WideCharToMultiByte(codepage, 0, &wc, 1, mb, sizeof(mb), NULL, NULL);
             if (mblen != 1) continue;
-            unsigned char byte_val = (unsigned char)mb[0];
-            FT_WinFNT_HeaderRec WinFNT;
-            if (FT_Get_WinFNT_Header(face, &WinFNT) == 0)
-            {
-                if (byte_val < WinFNT.first_char || byte_val > WinFNT.last_char)
-                    glyph_index = WinFNT.default_char - WinFNT.first_char;
-                else
-                    glyph_index = byte_val - WinFNT.first_char + 1;
-            }
-            else
-            {
-                glyph_index = FT_Get_Char_Index(face, codepoint);
-            }
+            glyph_index = GetGlyphIndex(face, codepoint);
         }
         else
         {
-            glyph_index = FT_Get_Char_Index(face, codepoint);
+            RealizedFont* glyph_font = GetFontForChar(font, codepoint, &glyph_index);
+            if (glyph_font != current_font)
+            {
+                SelectRealizedFont(glyph_font, NULL);
+                current_font = glyph_font;
+                previous_glyph = 0; // No kerning across fonts
+            }
         }
 
-        if (use_kerning && previous_glyph != 0 && glyph_index != 0)
+        if (use_kerning && current_font == font && previous_glyph != 0 && glyph_index != 0)
         {
             FT_Vector delta;
             FT_Get_Kerning(face, previous_glyph, glyph_index, FT_KERNING_DEFAULT, &delta);
@@ -1364,11 +4108,13 @@ static void get_text_disposition(
             total_y += delta.y;
         }
 
-        if (FT_Load_Glyph(face, glyph_index, load_flags) != 0)
+        // Measure from the metrics cache; nothing is rendered here
+        const GlyphMetrics* metrics = GetGlyphMetrics(current_font, glyph_index);
+        if (!metrics)
             continue;
 
-        total_x += (face->glyph->advance.x + 63) & ~63;
-        total_y += (face->glyph->advance.y + 63) & ~63;
+        total_x += (metrics->advance.x + 63) & ~63;
+        total_y += (metrics->advance.y + 63) & ~63;
         previous_glyph = glyph_index;
     }
 
@@ -1376,6 +4122,75 @@ static void get_text_disposition(
     *height = (total_y >> 6);
 }
 
+// Supplies the glyphs of EmulatedExtTextOutW to LayoutText from a realized
+// font and its linked fonts. The glyph cache must be held.
+struct RealizedGlyphContext {
+    RealizedFont* font;
+    RealizedFont* glyph_font; // The font or the linked font selected last
+    const FT_Matrix* matrix;
+};
+
+static bool get_realized_glyph(void* context, unsigned long codepoint, TextGlyph* glyph)
+{
+    RealizedGlyphContext* glyph_context = (RealizedGlyphContext*)context;
+    RealizedFont* font = glyph_context->font;
+
+    FT_UInt glyph_index;
+    if (font->is_raster)
+    {
+        // Unicode codepoint to FNT glyph through the FON codepage
+        WORD raster_glyph = font->raster_map[(WCHAR)codepoint];
+        if (raster_glyph == RASTER_GLYPH_NONE)
+            return false;
+        glyph_index = raster_glyph;
+
+        trace_printf(L"glyph_index=%u, codepoint=U+%04lX, first_char=0x%02X\n",
+            glyph_index, codepoint, font->WinFNT.first_char);
+    }
+    else
+    {
+        RealizedFont* char_font = GetFontForChar(font, codepoint, &glyph_index);
+        if (char_font != glyph_context->glyph_font)
+        {
+            SelectRealizedFont(char_font, glyph_context->matrix);
+            glyph_context->glyph_font = char_font;
+        }
+    }
+
+    RealizedFont* glyph_font = glyph_context->glyph_font;
+    FT_Face glyph_face = glyph_font->face;
+    const CachedGlyph* cached = GetCachedGlyph(glyph_face, glyph_index, glyph_font->load_flags);
+    if (!cached)
+        return false;
+
+    // Verify cmap
+    trace_printf(L"num_charmaps=%d\n", glyph_face->num_charmaps);
+    for (int ci = 0; ci < glyph_face->num_charmaps; ++ci)
+    {
+        trace_printf(L"  charmap[%d]: platform=%d, encoding=%d, encoding_id=%d\n",
+            ci,
+            glyph_face->charmaps[ci]->platform_id,
+            glyph_face->charmaps[ci]->encoding,
+            glyph_face->charmaps[ci]->encoding_id);
+    }
+    trace_printf(L"active charmap: platform=%d, encoding=%d\n",
+        glyph_face->charmap ? glyph_face->charmap->platform_id : -1,
+        glyph_face->charmap ? glyph_face->charmap->encoding    : -1);
+
+    trace_printf(L"glyph U+%04lX: bitmap=%dx%d, advance.x=%ld (>>6=%ld), advance.y=%ld (>>6=%ld), bitmap_left=%d, bitmap_top=%d\n",
+        codepoint,
+        cached->bitmap.width, cached->bitmap.rows,
+        cached->advance.x, cached->advance.x >> 6,
+        cached->advance.y, cached->advance.y >> 6,
+        cached->bitmap_left, cached->bitmap_top);
+
+    glyph->bitmap = &cached->bitmap;
+    glyph->bitmap_left = cached->bitmap_left;
+    glyph->bitmap_top = cached->bitmap_top;
+    glyph->advance = cached->advance;
+    return true;
+}
+
 BOOL EmulatedExtTextOutW(
     HDC hdc,
     INT X,
@@ -1396,17 +4211,34 @@ BOOL EmulatedExtTextOutW(
 
     LOGFONTW lf;
     GetObjectW(hFont, sizeof(lf), &lf);
-    FontInfo* font_info = find_font_by_logfont(&lf);
-    if (!font_info) {
-        wprintf(L"'%S': not found\n", lf.lfFaceName);
+
+    XFORM xform;
+    GetWorldTransform(hdc, &xform);
+
+    // XFORMをFT_Matrixに変換する。
+    // XFORMの行列要素はfloatだが、FT_Matrixは16.16固定小数点数 (FT_Fixed = FT_Long) を使う。
+    // XFORM の定義:
+    //   | eM11  eM12 |     | xx  xy |
+    //   | eM21  eM22 |  =  | yx  yy |
+    // FT_Matrix の定義:
+    //   | xx  xy |
+    //   | yx  yy |
+    // ただしGDIのY軸は下向き、FreeTypeのY軸は上向きのため、
+    // せん断成分 (eM12, eM21) の符号を反転させる必要がある。
+    FT_Matrix ft_matrix;
+    ft_matrix.xx = (FT_Fixed)(xform.eM11 * 65536.0f);   // X方向スケール
+    ft_matrix.xy = (FT_Fixed)(-xform.eM21 * 65536.0f);  // X方向せん断 (Y軸反転)
+    ft_matrix.yx = (FT_Fixed)(-xform.eM12 * 65536.0f);  // Y方向せん断 (Y軸反転)
+    ft_matrix.yy = (FT_Fixed)(xform.eM22 * 65536.0f);   // Y方向スケール
+
+    RealizedFont* font = AcquireRealizedFont(&lf, &ft_matrix);
+    if (!font) {
+        trace_printf(L"'%ls': not found\n", lf.lfFaceName);
         return FALSE;
     }
-    LONG lfHeight = lf.lfHeight;
-
-    wprintf(L"Using font: %S, %ld\n", font_info->wide_path, lfHeight);
+    trace_printf(L"Using font: %ls, %ld\n", get_font_path(font->font_id), lf.lfHeight);
 
-    POINT Start, CurPos;
-    LONGLONG RealXStart64, RealYStart64;
+    POINT Start;
 
     if (lprc && !(fuOptions & (ETO_CLIPPED|ETO_OPAQUE)))
     {
@@ -1419,6 +4251,7 @@ BOOL EmulatedExtTextOutW(
 
     if (Count > 0xFFFF || (Count > 0 && lpString == NULL))
     {
+        ReleaseRealizedFont(font);
         SetLastError(ERROR_INVALID_PARAMETER);
         return FALSE;
     }
@@ -1444,25 +4277,6 @@ BOOL EmulatedExtTextOutW(
         }
     }
 
-    XFORM xform;
-    GetWorldTransform(hdc, &xform);
-
-    // XFORMをFT_Matrixに変換する。
-    // XFORMの行列要素はfloatだが、FT_Matrixは16.16固定小数点数 (FT_Fixed = FT_Long) を使う。
-    // XFORM の定義:
-    //   | eM11  eM12 |     | xx  xy |
-    //   | eM21  eM22 |  =  | yx  yy |
-    // FT_Matrix の定義:
-    //   | xx  xy |
-    //   | yx  yy |
-    // ただしGDIのY軸は下向き、FreeTypeのY軸は上向きのため、
-    // せん断成分 (eM12, eM21) の符号を反転させる必要がある。
-    FT_Matrix ft_matrix;
-    ft_matrix.xx = (FT_Fixed)(xform.eM11 * 65536.0f);   // X方向スケール
-    ft_matrix.xy = (FT_Fixed)(-xform.eM21 * 65536.0f);  // X方向せん断 (Y軸反転)
-    ft_matrix.yx = (FT_Fixed)(-xform.eM12 * 65536.0f);  // Y方向せん断 (Y軸反転)
-    ft_matrix.yy = (FT_Fixed)(xform.eM22 * 65536.0f);   // Y方向スケール
-
     std::vector<INT> scaledDX(Count);
     if (lpDx) {
         for (UINT i = 0; i < Count; ++i) {
@@ -1471,65 +4285,27 @@ BOOL EmulatedExtTextOutW(
         lpDx = &scaledDX[0];
     }
 
-    bool is_raster = is_raster_font(font_info->wide_path);
-    FT_Face face = NULL;
-    FT_WinFNT_HeaderRec WinFNT;
-    bool has_fnt_header = false;
-    int pixel_ascent, pixel_descent, baseline_y;
+    bool is_raster = font->is_raster;
+    FT_Face face = font->face;
 
-    if (!OpenFaceForDraw(font_info, lfHeight, Start.y, &face,
-                         &WinFNT, &has_fnt_header,
-                         &pixel_ascent, &pixel_descent, &baseline_y))
-        return FALSE;
+    // The face may be shared with other realized fonts; measure untransformed
+    SelectRealizedFont(font, NULL);
 
     ModifyWorldTransform(hdc, NULL, MWT_IDENTITY);
+    LPtoDP(hdc, &Start, 1);
 
     UINT textAlign = GetTextAlign(hdc);
-    UINT hAlign = textAlign & (TA_LEFT | TA_CENTER | TA_RIGHT);
-    UINT vAlign = textAlign & (TA_TOP | TA_BASELINE | TA_BOTTOM);
-    if (hAlign || vAlign || (fuOptions & ETO_OPAQUE))
+    int strWidth = 0, strHeight = 0;
+    if ((textAlign & (TA_CENTER | TA_BASELINE)) || (fuOptions & ETO_OPAQUE))
     {
-        int strWidth, strHeight;
-        get_text_disposition(&strWidth, &strHeight, font_info, face, is_raster, lpString, Count, lpDx);
-
-        if (hAlign == TA_CENTER || hAlign == TA_RIGHT)
-        {
-            if (hAlign == TA_CENTER)
-            {
-                X -= strWidth / 2;
-                Y -= strHeight / 2;
-            }
-            else // TA_RIGHT
-            {
-                X -= strWidth;
-                Y -= strHeight;
-            }
-
-            Start.x = X;
-            Start.y = Y;
-            LPtoDP(hdc, &Start, 1);
-        }
-
-        if (vAlign == TA_BASELINE)
-        {
-            baseline_y = Start.y - pixel_descent;;
-        }
-        else if (vAlign == TA_BOTTOM)
-        {
-            baseline_y = Start.y;
-        }
-
-        wprintf(L"baseline_y: %d, strWidth: %d, strHeight: %d\n", baseline_y, strWidth, strHeight);
+        get_text_disposition(&strWidth, &strHeight, font, lpString, Count, lpDx);
     }
 
-    LPtoDP(hdc, &Start, 1);
-
-    RealXStart64 = ((LONGLONG)Start.x) << 6;
-    RealYStart64 = ((LONGLONG)Start.y) << 6;
-
-    RECT MaskRect;
-    MaskRect.left = 0;
-    MaskRect.top = 0;
+    int pen_x, baseline_y;
+    GetTextOrigin(textAlign, Start.x, Start.y, strWidth, strHeight,
+                  font->pixel_ascent, font->pixel_descent, &pen_x, &baseline_y);
+    trace_printf(L"baseline_y: %d, strWidth: %d, strHeight: %d\n", baseline_y, strWidth, strHeight);
+    Start.x = pen_x;
 
     if (lprc && (fuOptions & (ETO_CLIPPED | ETO_OPAQUE)))
     {
@@ -1541,137 +4317,58 @@ BOOL EmulatedExtTextOutW(
     // FT_Set_Transform は FT_Load_Glyph (FT_LOAD_RENDER 含む) 時に適用され、
     // bitmap_left / bitmap_top / advance.x / advance.y が変換後の値になる。
     {
-        FT_Vector delta = { 0, 0 };
         if (!is_raster)
-            FT_Set_Transform(face, &ft_matrix, &delta);
+            SetFaceTransform(face, &ft_matrix);
         else
-            FT_Set_Transform(face, NULL, NULL); // ラスターフォントは変換なし
-    }
-
-    FT_Int32 load_flags;
-    if (is_raster)
-    {
-        // Raster fonts always retrieve a monochrome bitmap.
-        // FT_LOAD_NO_SCALE instructs FreeType to use the fixed size as-is.
-        load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_MONO | FT_LOAD_NO_HINTING;
+            SetFaceTransform(face, NULL); // ラスターフォントは変換なし
     }
-    else
-    {
-        load_flags = FT_LOAD_RENDER | FT_LOAD_TARGET_LCD;
-    }
-
-    // ペン座標はデバイス空間（LPtoDPで変換済みのStart）で管理する。
-    // current_pen_yはベースライン位置をデバイス座標で保持する。
-    FT_Pos current_pen_x = (FT_Pos)Start.x << 6;
-    FT_Pos current_pen_y = (FT_Pos)baseline_y << 6;
-    int lpDx_accumulated = 0;
-    FT_UInt previous_glyph = 0; // Holds the previous glyph index
-    bool use_kerning = false;
 
-    UINT codepage = get_codepage_from_charset(font_info->charset);
-
-    const WCHAR* pch = lpString;
-    for (INT i = 0; i < Count; ++i)
+    // ペン座標はデバイス空間で管理する。
+    // FT_Set_Transform適用済みのため、bitmap_left/bitmap_topおよびadvance.x/yは
+    // すでに変換後の値になっている。
+    // lpDxはX方向の間隔なので、変換行列を掛けてデバイス空間に変換する。
+    RealizedGlyphContext context = { font, font, &ft_matrix };
+    FT_Vector dx_direction;
+    dx_direction.x = (FT_Fixed)(xform.eM11 * 65536.0f);
+    dx_direction.y = (FT_Fixed)(xform.eM12 * 65536.0f);
+    std::vector<PlacedGlyph> glyphs;
+    glyphs.reserve(Count);
+    HoldGlyphCache();
+    TextRect layout_box = LayoutText(glyphs, get_realized_glyph, &context,
+                                     (const uint16_t*)lpString, Count, pen_x, baseline_y,
+                                     lpDx, dx_direction);
+
+    // Read the destination under the string once, blend every glyph into it
+    // and write it back once
+    RECT text_box = { layout_box.left, layout_box.top, layout_box.right, layout_box.bottom };
+    RECT clip_box;
+    if (GetClipBox(hdc, &clip_box) != ERROR)
+        IntersectRect(&text_box, &text_box, &clip_box);
+    if (lprc && (fuOptions & ETO_CLIPPED))
+        IntersectRect(&text_box, &text_box, lprc);
+    if (!IsRectEmpty(&text_box) &&
+        PrepareCompositeBuffer(text_box.right - text_box.left, text_box.bottom - text_box.top))
     {
-        unsigned long codepoint = 0;
-        WCHAR w1 = pch[i];
-        if (IS_HIGH_SURROGATE(w1) && i + 1 < Count) {
-            WCHAR w2 = pch[i + 1];
-            if (IS_LOW_SURROGATE(w2)) {
-                codepoint = MAKE_SURROGATE_PAIR(w1, w2);
-                ++i;
-            }
-        } else {
-            codepoint = w1;
-        }
-
-        FT_UInt glyph_index;
-        if (is_raster)
-        {
-            // Convert Unicode codepoint to the FON codepage
-            WCHAR wc = static_cast<WCHAR>(codepoint);
-            char mb[4] = {};
-
-            int mblen = WideCharToMultiByte(codepage, 0, &wc, 1, mb, sizeof(mb), NULL, NULL);
-            if (mblen != 1)
-                continue;
-
-            unsigned char byte_val = (unsigned char)mb[0];
-            if (byte_val < WinFNT.first_char || byte_val > WinFNT.last_char)
-            {
-                // Out of range: use default_char
-                glyph_index = WinFNT.default_char - WinFNT.first_char;
-            }
-            else
-            {
-                glyph_index = byte_val - WinFNT.first_char + 1;
-            }
-
-            wprintf(L"glyph_index=%u, byte_val=0x%02X, first_char=0x%02X, calc=%u\n",
-                glyph_index, byte_val, WinFNT.first_char,
-                byte_val - WinFNT.first_char);
-        }
-        else
-        {
-            glyph_index = FT_Get_Char_Index(face, codepoint);
-        }
-
-        if (use_kerning && previous_glyph != 0 && glyph_index != 0) {
-            FT_Vector delta;
-            FT_Get_Kerning(face, previous_glyph, glyph_index, FT_KERNING_DEFAULT, &delta);
-            current_pen_x += delta.x;
-        }
-
-        if (FT_Load_Glyph(face, glyph_index, load_flags) != 0)
-            continue;
-
-        // Verify cmap
-        wprintf(L"num_charmaps=%d\n", face->num_charmaps);
-        for (int ci = 0; ci < face->num_charmaps; ++ci)
-        {
-            wprintf(L"  charmap[%d]: platform=%d, encoding=%d, encoding_id=%d\n",
-                ci,
-                face->charmaps[ci]->platform_id,
-                face->charmaps[ci]->encoding,
-                face->charmaps[ci]->encoding_id);
-        }
-        wprintf(L"active charmap: platform=%d, encoding=%d\n",
-            face->charmap ? face->charmap->platform_id : -1,
-            face->charmap ? face->charmap->encoding    : -1);
-
-        FT_GlyphSlot slot = face->glyph;
-
-        // FT_Set_Transform適用済みの場合、bitmap_left/bitmap_topおよびadvance.x/yは
-        // すでに変換後の値になっている。
-        // current_pen_x/yはデバイス座標（変換後）で管理する。
-        int draw_x = (current_pen_x >> 6) + slot->bitmap_left;
-        int draw_y = (current_pen_y >> 6) - slot->bitmap_top;
-
-        draw_glyph(hdc, &slot->bitmap, draw_x, draw_y,
-                   fg_color, bg_color);
-
-        wprintf(L"glyph U+%04lX: bitmap=%dx%d, advance.x=%ld (>>6=%ld), advance.y=%ld (>>6=%ld), bitmap_left=%d, bitmap_top=%d\n",
-            codepoint,
-            slot->bitmap.width, slot->bitmap.rows,
-            slot->advance.x, slot->advance.x >> 6,
-            slot->advance.y, slot->advance.y >> 6,
-            slot->bitmap_left, slot->bitmap_top);
-
-        if (lpDx) {
-            lpDx_accumulated += lpDx[i];
-            // lpDxはX方向の間隔なので、変換行列を掛けてデバイス空間に変換する
-            FT_Pos dx26 = (FT_Pos)lpDx_accumulated << 6;
-            current_pen_x = ((FT_Pos)Start.x << 6) + (FT_Pos)(dx26 * xform.eM11);
-            current_pen_y = ((FT_Pos)Start.y << 6) + (FT_Pos)(dx26 * xform.eM12);
-        } else {
-            current_pen_x += slot->advance.x;
-            current_pen_y -= slot->advance.y; // FreeTypeY軸(上向き)→GDI Y軸(下向き)
-        }
-        previous_glyph = glyph_index;
+        int width = text_box.right - text_box.left, height = text_box.bottom - text_box.top;
+        BitBlt(composite_buffer.hdc, 0, 0, width, height, hdc, text_box.left, text_box.top, SRCCOPY);
+        GdiFlush();
+
+        TextSurface surface = { (uint32_t*)composite_buffer.bits, composite_buffer.width,
+                                width, height, { 0, 0, width, height } };
+        TextState state;
+        state.text_pixel = dib_pixel_from_color(fg_color);
+        state.bk_pixel = dib_pixel_from_color(bg_color);
+        state.opaque = (GetBkMode(hdc) == OPAQUE);
+        state.align = textAlign;
+        state.gamma_level = text_gamma_level;
+        state.contrast_level = text_contrast_level;
+        DrawPlacedGlyphs(&surface, &glyphs[0], glyphs.size(), text_box.left, text_box.top, &state);
+
+        BitBlt(hdc, text_box.left, text_box.top, width, height, composite_buffer.hdc, 0, 0, SRCCOPY);
     }
 
-    if (face)
-        FT_Done_Face(face);
+    ReleaseGlyphCache();
+    ReleaseRealizedFont(font);
 
     SetWorldTransform(hdc, &xform);
 
@@ -1725,7 +4422,7 @@ HBITMAP Test_Gdi_ExtTextOutW(PCWSTR font_name, int font_size, XFORM& xform, HFON
 
 bool TestEntry_ExtTextOutW(PCWSTR font_name, int font_size, XFORM& xform)
 {
-    wprintf(L"Testing: %ls %d %f %f %f %f\n", font_name, font_size, xform.eM11, xform.eM12, xform.eM21, xform.eM22);
+    trace_printf(L"Testing: %ls %d %f %f %f %f\n", font_name, font_size, xform.eM11, xform.eM12, xform.eM21, xform.eM22);
 
     LOGFONTW lf;
     memset(&lf, 0, sizeof(lf));
@@ -1761,6 +4458,415 @@ bool TestEntry_ExtTextOutW(PCWSTR font_name, int font_size, XFORM& xform)
     return ret;
 }
 
+// Time run_font_scan_jobs against the number of threads, over a corpus made
+// of `copies` copies of the fonts in fixtures_dir
+void Benchmark_FontScan(PCWSTR fixtures_dir, int copies)
+{
+    WCHAR corpus_dir[MAX_PATH], path[MAX_PATH];
+    GetTempPathW(_countof(corpus_dir), corpus_dir);
+    PathAppendW(corpus_dir, L"EmuTypeScanBench");
+    CreateDirectoryW(corpus_dir, NULL);
+
+    // Build the corpus
+    std::vector<FontScanJob> corpus;
+    lstrcpynW(path, fixtures_dir, _countof(path));
+    PathAppendW(path, L"*.*");
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = FindFirstFileW(path, &find);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        wprintf(L"%ls: no fonts\n", fixtures_dir);
+        return;
+    }
+    do
+    {
+        if (!is_supported_font(find.cFileName))
+            continue;
+
+        WCHAR src[MAX_PATH];
+        lstrcpynW(src, fixtures_dir, _countof(src));
+        PathAppendW(src, find.cFileName);
+        for (int i = 0; i < copies; ++i)
+        {
+            WCHAR name[MAX_PATH];
+            StringCchPrintfW(name, _countof(name), L"%04d_%ls", i, find.cFileName);
+            lstrcpynW(path, corpus_dir, _countof(path));
+            PathAppendW(path, name);
+            if (CopyFileW(src, path, FALSE))
+                add_font_scan_job(corpus, path, 0, 0);
+        }
+    } while (FindNextFileW(hFind, &find));
+    FindClose(hFind);
+
+    int max_threads = get_scan_thread_count();
+    wprintf(L"Scanning %d files, up to %d threads\n", (int)corpus.size(), max_threads);
+
+    std::vector<std::wstring> serial_names;
+    double serial_ms = 0;
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    for (int num_threads = 1; ; num_threads *= 2)
+    {
+        if (num_threads > max_threads)
+            num_threads = max_threads;
+
+        std::vector<FontScanJob> jobs = corpus;
+        std::vector<FontScanJob*> pending;
+        for (auto& job : jobs)
+            pending.push_back(&job);
+
+        LARGE_INTEGER t0, t1;
+        QueryPerformanceCounter(&t0);
+        run_font_scan_jobs(pending, num_threads);
+        QueryPerformanceCounter(&t1);
+        double ms = (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+
+        // The merged order must not depend on the thread count
+        std::vector<std::wstring> names;
+        size_t num_fonts = 0;
+        for (auto& job : jobs)
+        {
+            for (auto& info : job.fonts)
+                names.push_back(info.family_name);
+            num_fonts += job.fonts.size();
+        }
+        if (num_threads == 1)
+        {
+            serial_names = names;
+            serial_ms = ms;
+        }
+
+        wprintf(L"threads=%2d: %9.2f ms, %d fonts, x%.2f%ls\n",
+                num_threads, ms, (int)num_fonts, serial_ms / ms,
+                (names == serial_names) ? L"" : L" (ORDER MISMATCH)");
+
+        if (num_threads == max_threads)
+            break;
+    }
+
+    for (auto& job : corpus)
+        DeleteFileW(job.path.c_str());
+    RemoveDirectoryW(corpus_dir);
+}
+
+// Register the registered fonts again under made-up paths, so that there are
+// `copies` copies of each
+static void duplicate_fonts(int copies)
+{
+    DWORD num_files = (DWORD)font_table.files.size();
+    for (int i = 1; i < copies; ++i)
+    {
+        for (DWORD index = 0; index < num_files; ++index)
+        {
+            FontFile source = font_table.files[index];
+            if (source.removed)
+                continue;
+
+            WCHAR path[MAX_PATH];
+            StringCchPrintfW(path, _countof(path), L"%ls#%d", font_string(source.path), i);
+            DWORD file = add_font_file(path);
+            font_table.files[file].is_raster = source.is_raster;
+            for (DWORD j = 0; j < source.num_fonts; ++j)
+            {
+                FontRecord record;
+                get_font_record(source.first_font + j, &record);
+                add_font(file, record);
+            }
+        }
+    }
+}
+
+// Time find_font_by_logfont over `count` random LOGFONTs. The registered
+// fonts are registered `copies` times to make a large font table.
+void Benchmark_FontMatch(int count, int copies)
+{
+    duplicate_fonts(copies);
+
+    DWORD num_fonts = font_table.size();
+    if (num_fonts == 0)
+    {
+        wprintf(L"No fonts\n");
+        return;
+    }
+
+    static const BYTE charsets[] = {
+        DEFAULT_CHARSET, ANSI_CHARSET, SHIFTJIS_CHARSET, SYMBOL_CHARSET,
+        OEM_CHARSET, GB2312_CHARSET, RUSSIAN_CHARSET, EASTEUROPE_CHARSET
+    };
+    static const BYTE precisions[] = {
+        OUT_DEFAULT_PRECIS, OUT_DEFAULT_PRECIS, OUT_TT_PRECIS, OUT_STROKE_PRECIS, OUT_RASTER_PRECIS
+    };
+
+    // Make the requests. One in four asks for a name that is not registered.
+    srand(1);
+    std::vector<LOGFONTW> requests(count);
+    for (auto& lf : requests)
+    {
+        ZeroMemory(&lf, sizeof(lf));
+        FontId id = (FontId)(((DWORD)rand() * (RAND_MAX + 1u) + rand()) % num_fonts);
+        if (rand() % 4)
+            lstrcpynW(lf.lfFaceName, font_string(font_table.family_name[id]), LF_FACESIZE);
+        else
+            StringCchPrintfW(lf.lfFaceName, LF_FACESIZE, L"No Such Font %d", rand() % 100);
+        lf.lfHeight = rand() % 81 - 40;
+        lf.lfWidth = (rand() % 4) ? 0 : rand() % 30 + 1;
+        lf.lfWeight = (rand() % 10) * 100;
+        lf.lfItalic = (rand() % 4) == 0;
+        lf.lfUnderline = (rand() % 16) == 0;
+        lf.lfCharSet = charsets[rand() % _countof(charsets)];
+        lf.lfOutPrecision = precisions[rand() % _countof(precisions)];
+        lf.lfPitchAndFamily = (BYTE)((rand() % 3) | ((rand() % 6) << 4));
+    }
+
+    update_font_name_index();
+    font_match_stats = FontMatchStats();
+
+    LARGE_INTEGER freq, t0, t1;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t0);
+    for (auto& lf : requests)
+        find_font_by_logfont(&lf);
+    QueryPerformanceCounter(&t1);
+    double ms = (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+    FontMatchStats stats = font_match_stats;
+
+    // The shortcut by name must choose what scoring every font chooses
+    int mismatches = 0;
+    for (size_t i = 0; i < requests.size() && i < 1000; ++i)
+    {
+        if (find_font_by_logfont(&requests[i]) != find_font_by_logfont_ex(&requests[i], true))
+            ++mismatches;
+    }
+
+    wprintf(L"Matched %d LOGFONTs against %u fonts: %.2f ms, %.1f ns/match, %.1f%% by name\n",
+            count, num_fonts, ms, count ? ms * 1e6 / count : 0.0,
+            stats.lookups ? 100.0 * (stats.lookups - stats.full_scans) / stats.lookups : 0.0);
+    if (mismatches)
+        wprintf(L"%d MISMATCHES against the full scan\n", mismatches);
+}
+
+static int CALLBACK count_enum_proc(const LOGFONTW* plf, const TEXTMETRICW* ptm, DWORD type, LPARAM lParam)
+{
+    ++*(int*)lParam;
+    return 1;
+}
+
+// Time the enumeration of all families and of the fonts of each family,
+// against EnumFontFamiliesExW. The registered fonts are registered `copies`
+// times first.
+void Benchmark_FontEnum(int rounds, int copies)
+{
+    duplicate_fonts(copies);
+
+    HDC hdc = GetDC(NULL);
+    LARGE_INTEGER freq, t0, t1;
+    QueryPerformanceFrequency(&freq);
+
+    LOGFONTW lf;
+    ZeroMemory(&lf, sizeof(lf));
+    lf.lfCharSet = DEFAULT_CHARSET;
+
+    // Warm up; this builds the index of the fonts added above
+    size_t mapped = GetMappedFontFileCount();
+    int families = 0;
+    EmulatedEnumFontFamiliesExW(hdc, &lf, count_enum_proc, (LPARAM)&families, 0);
+
+    int count = 0;
+    QueryPerformanceCounter(&t0);
+    for (int i = 0; i < rounds; ++i)
+        EmulatedEnumFontFamiliesExW(hdc, &lf, count_enum_proc, (LPARAM)&count, 0);
+    QueryPerformanceCounter(&t1);
+    double ms = (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart / rounds;
+    wprintf(L"All families: %d records, %.3f ms\n", families, ms);
+
+    // Every font of every family
+    std::vector<FontId> heads = font_enum_index.family_heads;
+    count = 0;
+    QueryPerformanceCounter(&t0);
+    for (FontId id : heads)
+    {
+        lstrcpynW(lf.lfFaceName, font_string(font_table.family_name[id]), LF_FACESIZE);
+        lf.lfCharSet = font_table.charset[id];
+        EmulatedEnumFontFamiliesExW(hdc, &lf, count_enum_proc, (LPARAM)&count, 0);
+    }
+    QueryPerformanceCounter(&t1);
+    ms = (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+    wprintf(L"Each family: %d records of %u fonts, %.3f ms\n", count, font_table.size(), ms);
+
+    if (GetMappedFontFileCount() != mapped)
+        wprintf(L"FONT FILES WERE MAPPED\n");
+
+    ZeroMemory(&lf, sizeof(lf));
+    lf.lfCharSet = DEFAULT_CHARSET;
+    count = 0;
+    QueryPerformanceCounter(&t0);
+    EnumFontFamiliesExW(hdc, &lf, count_enum_proc, (LPARAM)&count, 0);
+    QueryPerformanceCounter(&t1);
+    ms = (t1.QuadPart - t0.QuadPart) * 1000.0 / freq.QuadPart;
+    wprintf(L"GDI all families: %d records, %.3f ms\n", count, ms);
+
+    ReleaseDC(NULL, hdc);
+}
+
+// Draw the printable ASCII characters at several sizes with EmulatedExtTextOutW
+// under a glyph cache budget of budget_kb KiB (0: the default), and report the
+// time per string and the counters of the glyph cache
+void Benchmark_GlyphCache(PCWSTR font_name, int budget_kb, int rounds)
+{
+    SetGlyphCacheBudget(budget_kb > 0 ? (size_t)budget_kb * 1024 : DEFAULT_GLYPH_CACHE_BUDGET);
+    if (rounds < 1)
+        rounds = 1;
+
+    WCHAR ascii[0x7F - 0x20 + 1];
+    for (int ch = 0x20; ch < 0x7F; ++ch)
+        ascii[ch - 0x20] = (WCHAR)ch;
+    ascii[0x7F - 0x20] = 0;
+
+    static const int heights[] = { -12, -16, -20, -24, -32, -48 };
+    HFONT fonts[_countof(heights)];
+    for (int i = 0; i < _countof(heights); ++i)
+    {
+        LOGFONTW lf;
+        ZeroMemory(&lf, sizeof(lf));
+        lf.lfHeight = heights[i];
+        lf.lfCharSet = DEFAULT_CHARSET;
+        lstrcpynW(lf.lfFaceName, font_name, LF_FACESIZE);
+        fonts[i] = CreateFontIndirectW(&lf);
+    }
+
+    HDC hdc = CreateCompatibleDC(NULL);
+    HBITMAP hbm = CreateCompatibleBitmap(hdc, 1600, 64);
+    HGDIOBJ hbmOld = SelectObject(hdc, hbm);
+    HGDIOBJ hFontOld = GetCurrentObject(hdc, OBJ_FONT);
+    SetBkMode(hdc, TRANSPARENT);
+
+    LARGE_INTEGER freq, t0, t1;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t0);
+    for (int round = 0; round < rounds; ++round)
+    {
+        for (int i = 0; i < _countof(fonts); ++i)
+        {
+            SelectObject(hdc, fonts[i]);
+            EmulatedExtTextOutW(hdc, 0, 0, 0, NULL, ascii, lstrlenW(ascii), NULL);
+        }
+    }
+    QueryPerformanceCounter(&t1);
+    SelectObject(hdc, hFontOld);
+
+    double us = (t1.QuadPart - t0.QuadPart) * 1e6 / freq.QuadPart / ((double)rounds * _countof(fonts));
+    GlyphCacheStats stats;
+    GetGlyphCacheStats(&stats);
+    wprintf(L"%ls, budget %u KiB: %.2f us per string of %d characters\n",
+            font_name, (UINT)(glyph_cache_budget / 1024), us, lstrlenW(ascii));
+    wprintf(L"Glyph cache: %u hits, %u misses, %u evictions, %u glyphs in %u KiB\n",
+            (UINT)stats.hits, (UINT)stats.misses, (UINT)stats.evictions,
+            (UINT)stats.count, (UINT)(stats.bytes / 1024));
+
+    SelectObject(hdc, hbmOld);
+    DeleteObject(hbm);
+    DeleteDC(hdc);
+    for (HFONT hFont : fonts)
+        DeleteObject(hFont);
+}
+
+static void benchmark_print(const char* name, int size, int rounds,
+                            const LARGE_INTEGER& t0, const LARGE_INTEGER& t1)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    double seconds = (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+    double megapixels = (double)size * size * rounds / 1e6;
+    wprintf(L"%S %dx%d: %.1f MP/s\n", name, size, size, megapixels / seconds);
+}
+
+// Blend a glyph-sized square of coverage, size x size pixels, rounds times
+static void benchmark_blend_rows(const char* name, BlendRowProc proc, int size, int rounds,
+                                 const std::vector<BYTE>& coverage, int bytes_per_pixel)
+{
+    std::vector<uint32_t> pixels(size * size, 0xFFFFFF);
+    LARGE_INTEGER t0, t1;
+    QueryPerformanceCounter(&t0);
+    for (int i = 0; i < rounds; ++i)
+    {
+        for (int y = 0; y < size; ++y)
+            proc(&pixels[y * size], &coverage[y * size * bytes_per_pixel], size, 0x000000, 0xFFFFFF);
+    }
+    QueryPerformanceCounter(&t1);
+    benchmark_print(name, size, rounds, t0, t1);
+}
+
+// The same for 1bpp coverage of pitch bytes per row
+static void benchmark_mono_rows(const char* name, BlendMonoRowProc proc, int size, int rounds,
+                                const std::vector<BYTE>& bits, int pitch)
+{
+    std::vector<uint32_t> pixels(size * size, 0xFFFFFF);
+    LARGE_INTEGER t0, t1;
+    QueryPerformanceCounter(&t0);
+    for (int i = 0; i < rounds; ++i)
+    {
+        for (int y = 0; y < size; ++y)
+            proc(&pixels[y * size], &bits[y * pitch], 0, size, 0x000000, 0xFFFFFF);
+    }
+    QueryPerformanceCounter(&t1);
+    benchmark_print(name, size, rounds, t0, t1);
+}
+
+// Blend with every supported kernel at the size, or at 8 to 64 pixels if 0
+void Benchmark_Blend(int size, int rounds)
+{
+    static const int sizes[] = { 8, 16, 32, 64 };
+    int count = size ? 1 : _countof(sizes);
+    for (int k = 0; k < count; ++k)
+    {
+        int n = size ? size : sizes[k];
+
+        // A ring, so that rows have runs of no, partial and full coverage.
+        // The LCD subpixels sample it a third of a pixel apart.
+        int pitch = (n + 7) / 8;
+        std::vector<BYTE> gray(n * n), lcd(n * n * 3), mono(pitch * n);
+        for (int y = 0; y < n; ++y)
+        {
+            for (int x = 0; x < n * 3; ++x)
+            {
+                int dx = 2 * x - n * 3, dy = 6 * y - n * 3;
+                int d = (int)sqrt((double)(dx * dx + dy * dy)) * 255 / (n * 3);
+                BYTE value = (BYTE)((d > 255) ? 0 : (d < 128) ? 255 - 2 * d : 2 * (255 - d));
+                lcd[y * n * 3 + x] = value;
+                if (x % 3 == 1)
+                {
+                    gray[y * n + x / 3] = value;
+                    if (value >= 128)
+                        mono[y * pitch + x / 24] |= 0x80 >> (x / 3 % 8);
+                }
+            }
+        }
+
+        int scaled_rounds = rounds * 32 / n * 32 / n; // About the same pixels per size
+        for (int type = 0; type < BLEND_KERNEL_COUNT; ++type)
+        {
+            const BlendKernels* kernels = GetBlendKernels((BlendKernelType)type);
+            if (!kernels)
+                continue;
+
+            std::string name = kernels->name;
+            benchmark_blend_rows((name + " gray transparent").c_str(), kernels->gray_transparent,
+                                 n, scaled_rounds, gray, 1);
+            benchmark_blend_rows((name + " gray opaque").c_str(), kernels->gray_opaque,
+                                 n, scaled_rounds, gray, 1);
+            benchmark_blend_rows((name + " LCD transparent").c_str(), kernels->lcd_transparent,
+                                 n, scaled_rounds, lcd, 3);
+            benchmark_blend_rows((name + " LCD opaque").c_str(), kernels->lcd_opaque,
+                                 n, scaled_rounds, lcd, 3);
+            benchmark_mono_rows((name + " 1bpp transparent").c_str(), kernels->mono_transparent,
+                                n, scaled_rounds, mono, pitch);
+            benchmark_mono_rows((name + " 1bpp opaque").c_str(), kernels->mono_opaque,
+                                n, scaled_rounds, mono, pitch);
+        }
+    }
+}
+
 #include <io.h>
 #include <fcntl.h>
 #include <locale.h>
@@ -1771,6 +4877,69 @@ int wmain(int argc, wchar_t** wargv)
     _setmode(_fileno(stdout), _O_U16TEXT);
     setlocale(LC_ALL, "");
 
+    // emutype --bench-scan [fixtures_dir] [copies]
+    if (argc >= 2 && lstrcmpW(wargv[1], L"--bench-scan") == 0)
+    {
+        if (FT_Init_FreeType(&library) != 0)
+            return -1;
+        Benchmark_FontScan((argc >= 3) ? wargv[2] : L"tests",
+                           (argc >= 4) ? _wtoi(wargv[3]) : 100);
+        FT_Done_FreeType(library);
+        return 0;
+    }
+
+    // emutype --bench-match [count] [copies]
+    if (argc >= 2 && lstrcmpW(wargv[1], L"--bench-match") == 0)
+    {
+        if (!InitFontSupport())
+            return -1;
+        Benchmark_FontMatch((argc >= 3) ? _wtoi(wargv[2]) : 100000,
+                            (argc >= 4) ? _wtoi(wargv[3]) : 10);
+        FreeFontSupport();
+        return 0;
+    }
+
+    // emutype --bench-blend [size (0: 8 to 64)] [rounds]
+    if (argc >= 2 && lstrcmpW(wargv[1], L"--bench-blend") == 0)
+    {
+        Benchmark_Blend((argc >= 3) ? _wtoi(wargv[2]) : 0,
+                        (argc >= 4) ? _wtoi(wargv[3]) : 100000);
+        return 0;
+    }
+
+    // emutype --bench-glyphs [budget KiB (0: default)] [rounds] [font name]
+    if (argc >= 2 && lstrcmpW(wargv[1], L"--bench-glyphs") == 0)
+    {
+        if (!InitFontSupport())
+            return -1;
+        Benchmark_GlyphCache((argc >= 5) ? wargv[4] : FONT_NAME,
+                             (argc >= 3) ? _wtoi(wargv[2]) : 0,
+                             (argc >= 4) ? _wtoi(wargv[3]) : 1000);
+        FreeFontSupport();
+        return 0;
+    }
+
+    // emutype --bench-enum [rounds] [copies]
+    if (argc >= 2 && lstrcmpW(wargv[1], L"--bench-enum") == 0)
+    {
+        if (!InitFontSupport())
+            return -1;
+        Benchmark_FontEnum((argc >= 3) ? _wtoi(wargv[2]) : 1000,
+                           (argc >= 4) ? _wtoi(wargv[3]) : 1);
+        FreeFontSupport();
+        return 0;
+    }
+
+    // emutype --watch [dir]
+    if (argc >= 2 && lstrcmpW(wargv[1], L"--watch") == 0)
+    {
+        if (!InitFontSupport())
+            return -1;
+        WatchFontDirectory((argc >= 3) ? wargv[2] : fonts_dir);
+        FreeFontSupport();
+        return 0;
+    }
+
     PCWSTR font_name = FONT_NAME;
     int font_size = FONT_SIZE;
 
@@ -1794,9 +4963,17 @@ int wmain(int argc, wchar_t** wargv)
         return -1;
     }
 
+    SetTextGammaFromSystem();
     bool ret = TestEntry_ExtTextOutW(font_name, font_size, xform);
 
+    // Everything, the linked fonts of font fallback included, must be freed
     FreeFontSupport();
+    if (GetRealizedFontCount() != 0 || GetMappedFontFileCount() != 0)
+    {
+        wprintf(L"LEAKED: %u realized fonts, %u font files mapped\n",
+                (UINT)GetRealizedFontCount(), (UINT)GetMappedFontFileCount());
+        ret = false;
+    }
     return ret ? 0 : 1;
 }
 
@@ -0,0 +1,256 @@
+// fontmap.cpp --- Shared memory mappings of font files
+// Author: katahiromz
+// License: MIT
+//
+// Each font file is mapped once, no matter how many faces are created from
+// it, like map_font_file() of Wine and SharedMem_Create() of ReactOS.
+// Mappings are looked up by path and checked against the file size, last
+// write time and, where the system has one, file identity. A file changed on
+// disk gets a new mapping, while faces still using the old one keep it, with
+// the old contents, until they release it:
+// - On Windows the file stays open without write sharing while it is mapped,
+//   so it cannot be changed under the view. It can still be deleted or
+//   replaced by renaming, which leaves the view as it was.
+// - Elsewhere a file can be rewritten or truncated under a mapping, which
+//   then shows the new bytes or kills the reader with SIGBUS. So the file is
+//   read into memory of its own instead.
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <errno.h>
+    #include <stdlib.h>
+    #include <pthread.h>
+    #include "utf8.h"
+#endif
+#include <string>
+#include <unordered_map>
+#include "fontmap.h"
+
+// What tells a changed file from the one that was mapped
+struct FileStamp {
+    unsigned long long size;
+    unsigned long long time; // Of the last write, at the finest resolution of the system
+    unsigned long long id;   // The inode; 0 on Windows
+
+    bool operator==(const FileStamp& other) const
+    {
+        return size == other.size && time == other.time && id == other.id;
+    }
+};
+
+struct MappedFontFile : FontFileMapping {
+    std::wstring path;
+    FileStamp stamp;
+    void* handle; // The open file on Windows
+    long ref_count;
+    bool in_table; // false once a newer mapping of the path replaced it
+};
+
+static std::unordered_map<std::wstring, MappedFontFile*> mapped_files;
+static size_t mapped_file_count = 0;
+
+// The workers of the font scan map files concurrently
+#ifdef _WIN32
+static SRWLOCK mapped_files_lock = SRWLOCK_INIT;
+static void lock_mapped_files(void)   { AcquireSRWLockExclusive(&mapped_files_lock); }
+static void unlock_mapped_files(void) { ReleaseSRWLockExclusive(&mapped_files_lock); }
+#else
+static pthread_mutex_t mapped_files_lock = PTHREAD_MUTEX_INITIALIZER;
+static void lock_mapped_files(void)   { pthread_mutex_lock(&mapped_files_lock); }
+static void unlock_mapped_files(void) { pthread_mutex_unlock(&mapped_files_lock); }
+#endif
+
+#ifdef _WIN32
+
+static bool get_file_stamp(const std::wstring& path, FileStamp* stamp)
+{
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &data))
+        return false;
+    stamp->size = ((unsigned long long)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    stamp->time = ((unsigned long long)data.ftLastWriteTime.dwHighDateTime << 32) |
+                  data.ftLastWriteTime.dwLowDateTime; // In 100 ns
+    stamp->id = 0;
+    return true;
+}
+
+static const unsigned char* map_whole_file(const std::wstring& path, size_t size, void** handle)
+{
+    // No FILE_SHARE_WRITE: nobody may write the file while it is mapped
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    const unsigned char* data = NULL;
+    HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (hMapping)
+    {
+        // The view keeps the mapping alive
+        data = (const unsigned char*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, size);
+        CloseHandle(hMapping);
+    }
+
+    if (!data)
+    {
+        CloseHandle(hFile);
+        return NULL;
+    }
+    *handle = hFile;
+    return data;
+}
+
+static void unmap_whole_file(const unsigned char* data, size_t /*size*/, void* handle)
+{
+    UnmapViewOfFile(data);
+    CloseHandle((HANDLE)handle);
+}
+
+#else
+
+static bool get_file_stamp(const std::wstring& path, FileStamp* stamp)
+{
+    struct stat st;
+    if (stat(utf8_from_wide(path).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    // st_mtime has a resolution of a second, too coarse for a file rewritten
+    // with the same size right after it was mapped
+#ifdef __APPLE__
+    const struct timespec& mtime = st.st_mtimespec;
+#else
+    const struct timespec& mtime = st.st_mtim;
+#endif
+    stamp->size = (unsigned long long)st.st_size;
+    stamp->time = (unsigned long long)mtime.tv_sec * 1000000000 + (unsigned long long)mtime.tv_nsec;
+    stamp->id = (unsigned long long)st.st_ino;
+    return true;
+}
+
+// Read the file, which MapFontFile checks for changes made while reading
+static const unsigned char* map_whole_file(const std::wstring& path, size_t size, void** handle)
+{
+    int fd = open(utf8_from_wide(path).c_str(), O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    unsigned char* data = (unsigned char*)malloc(size);
+    size_t done = 0;
+    while (data && done < size)
+    {
+        ssize_t got = read(fd, data + done, size - done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        done += (size_t)got;
+    }
+    close(fd);
+
+    if (done != size)
+    {
+        free(data);
+        return NULL;
+    }
+    *handle = NULL;
+    return data;
+}
+
+static void unmap_whole_file(const unsigned char* data, size_t /*size*/, void* /*handle*/)
+{
+    free((void*)data);
+}
+
+#endif
+
+static void free_mapped_file(MappedFontFile* file)
+{
+    unmap_whole_file(file->data, file->size, file->handle);
+    --mapped_file_count;
+    delete file;
+}
+
+const FontFileMapping* MapFontFile(const wchar_t* path)
+{
+    std::wstring key = path;
+    FileStamp stamp;
+    if (!get_file_stamp(key, &stamp) || stamp.size == 0 || stamp.size > 0x7FFFFFFF)
+    {
+        return NULL;
+    }
+
+    lock_mapped_files();
+
+    auto it = mapped_files.find(key);
+    if (it != mapped_files.end())
+    {
+        MappedFontFile* file = it->second;
+        if (file->stamp == stamp)
+        {
+            ++file->ref_count;
+            unlock_mapped_files();
+            return file;
+        }
+
+        // Stale; let the current users keep it
+        mapped_files.erase(it);
+        file->in_table = false;
+    }
+
+    // A file changed between the stamp and the mapping is left for the next try
+    void* handle = NULL;
+    FileStamp mapped_stamp;
+    const unsigned char* data = map_whole_file(key, (size_t)stamp.size, &handle);
+    if (data && (!get_file_stamp(key, &mapped_stamp) || !(mapped_stamp == stamp)))
+    {
+        unmap_whole_file(data, (size_t)stamp.size, handle);
+        data = NULL;
+    }
+    if (!data)
+    {
+        unlock_mapped_files();
+        return NULL;
+    }
+
+    MappedFontFile* file = new MappedFontFile();
+    file->data = data;
+    file->size = (size_t)stamp.size;
+    file->path = key;
+    file->stamp = stamp;
+    file->handle = handle;
+    file->ref_count = 1;
+    file->in_table = true;
+    mapped_files[key] = file;
+    ++mapped_file_count;
+
+    unlock_mapped_files();
+    return file;
+}
+
+void UnmapFontFile(const FontFileMapping* mapping)
+{
+    if (!mapping)
+        return;
+
+    MappedFontFile* file = static_cast<MappedFontFile*>(const_cast<FontFileMapping*>(mapping));
+
+    lock_mapped_files();
+    if (--file->ref_count == 0)
+    {
+        if (file->in_table)
+            mapped_files.erase(file->path);
+        free_mapped_file(file);
+    }
+    unlock_mapped_files();
+}
+
+size_t GetMappedFontFileCount(void)
+{
+    lock_mapped_files();
+    size_t count = mapped_file_count;
+    unlock_mapped_files();
+    return count;
+}
@@ -0,0 +1,24 @@
+// fontmap.h --- Shared memory mappings of font files
+// Author: katahiromz
+// License: MIT
+#pragma once
+
+#include <stddef.h>
+
+// A read-only view of a whole font file, shared by every face created from it
+struct FontFileMapping {
+    const unsigned char* data;
+    size_t size;
+};
+
+// Map a font file, or add a reference to its existing mapping if the file
+// did not change since. Returns NULL on failure.
+// Pass data and size to FT_New_Memory_Face and call UnmapFontFile after
+// FT_Done_Face.
+const FontFileMapping* MapFontFile(const wchar_t* path);
+
+// Release a reference. The file is unmapped with the last one.
+void UnmapFontFile(const FontFileMapping* mapping);
+
+// The number of files currently mapped
+size_t GetMappedFontFileCount(void);
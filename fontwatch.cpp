@@ -0,0 +1,346 @@
+// fontwatch.cpp --- Watching a font directory for changes
+// Author: katahiromz
+// License: MIT
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/inotify.h>
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <errno.h>
+    #include "utf8.h"
+#endif
+#include <unordered_map>
+#include <unordered_set>
+#include "fontwatch.h"
+
+// Merge a change into the pending events, keeping one event per path
+static void add_watch_event(std::vector<FontWatchEvent>& events,
+                            std::unordered_map<std::wstring, size_t>& pending,
+                            FontWatchAction action, const std::wstring& path)
+{
+    auto it = pending.find(path);
+    if (it == pending.end())
+    {
+        FontWatchEvent event;
+        event.action = action;
+        event.path = path;
+        pending[path] = events.size();
+        events.push_back(event);
+        return;
+    }
+
+    FontWatchAction& prev = events[it->second].action;
+    if (action == FONT_WATCH_REMOVED)
+        prev = FONT_WATCH_REMOVED;
+    else if (prev == FONT_WATCH_REMOVED)
+        prev = FONT_WATCH_MODIFIED; // Deleted and created again
+    // ADDED + MODIFIED stays ADDED, MODIFIED + ADDED stays MODIFIED
+}
+
+static void add_rescan_event(std::vector<FontWatchEvent>& events, const std::wstring& dir)
+{
+    FontWatchEvent event;
+    event.action = FONT_WATCH_RESCAN;
+    event.path = dir;
+    events.push_back(event);
+}
+
+#ifdef _WIN32
+
+#define WATCH_BUFFER_SIZE (64 * 1024)
+#define WATCH_UNREADY_POLL_MS 100
+
+struct FontWatcher {
+    std::wstring dir;
+    HANDLE hDir;
+    OVERLAPPED overlapped;
+    bool reading;
+    std::unordered_set<std::wstring> unready; // Created, but still being written
+    DWORD buffer[WATCH_BUFFER_SIZE / sizeof(DWORD)]; // DWORD-aligned as required
+};
+
+// FILE_ACTION_ADDED comes as soon as a file is created, before a copy has
+// written anything. A writer that still has the file open denies this.
+static bool is_file_ready(const std::wstring& path)
+{
+    HANDLE hFile = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE)
+        return false;
+    CloseHandle(hFile);
+    return true;
+}
+
+// Report the created files whose writers have finished
+static void add_ready_files(FontWatcher* watcher, std::vector<FontWatchEvent>& events,
+                            std::unordered_map<std::wstring, size_t>& pending)
+{
+    for (auto it = watcher->unready.begin(); it != watcher->unready.end(); )
+    {
+        if (is_file_ready(*it))
+        {
+            add_watch_event(events, pending, FONT_WATCH_ADDED, *it);
+            it = watcher->unready.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+static bool issue_watch_read(FontWatcher* watcher)
+{
+    ResetEvent(watcher->overlapped.hEvent);
+    watcher->reading =
+        !!ReadDirectoryChangesW(watcher->hDir, watcher->buffer, sizeof(watcher->buffer), FALSE,
+                                FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE |
+                                FILE_NOTIFY_CHANGE_SIZE,
+                                NULL, &watcher->overlapped, NULL);
+    return watcher->reading;
+}
+
+FontWatcher* OpenFontWatcher(const wchar_t* dir)
+{
+    HANDLE hDir = CreateFileW(dir, FILE_LIST_DIRECTORY,
+                              FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (hDir == INVALID_HANDLE_VALUE)
+        return NULL;
+
+    FontWatcher* watcher = new FontWatcher();
+    watcher->dir = dir;
+    watcher->hDir = hDir;
+    watcher->overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!watcher->overlapped.hEvent || !issue_watch_read(watcher))
+    {
+        CloseFontWatcher(watcher);
+        return NULL;
+    }
+    return watcher;
+}
+
+// Parse one completed read into events
+static void parse_watch_buffer(FontWatcher* watcher, DWORD cbRead,
+                               std::vector<FontWatchEvent>& events,
+                               std::unordered_map<std::wstring, size_t>& pending)
+{
+    if (cbRead == 0)
+    {
+        // The buffer overflowed and the changes are lost
+        add_rescan_event(events, watcher->dir);
+        return;
+    }
+
+    const BYTE* pb = (const BYTE*)watcher->buffer;
+    for (;;)
+    {
+        const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)pb;
+        std::wstring path = watcher->dir;
+        if (!path.empty() && path[path.size() - 1] != L'\\')
+            path += L'\\';
+        path.append(info->FileName, info->FileNameLength / sizeof(WCHAR));
+
+        switch (info->Action)
+        {
+        case FILE_ACTION_ADDED:
+            if (is_file_ready(path))
+                add_watch_event(events, pending, FONT_WATCH_ADDED, path);
+            else
+                watcher->unready.insert(path); // Reported once it is written
+            break;
+        case FILE_ACTION_RENAMED_NEW_NAME:
+            add_watch_event(events, pending, FONT_WATCH_ADDED, path);
+            break;
+        case FILE_ACTION_REMOVED:
+        case FILE_ACTION_RENAMED_OLD_NAME:
+            // A file removed before it was ready was never reported
+            if (!watcher->unready.erase(path))
+                add_watch_event(events, pending, FONT_WATCH_REMOVED, path);
+            break;
+        case FILE_ACTION_MODIFIED:
+            if (!watcher->unready.count(path))
+                add_watch_event(events, pending, FONT_WATCH_MODIFIED, path);
+            break;
+        }
+
+        if (!info->NextEntryOffset)
+            break;
+        pb += info->NextEntryOffset;
+    }
+}
+
+bool ReadFontWatcher(FontWatcher* watcher, int timeout_ms, std::vector<FontWatchEvent>& events)
+{
+    std::unordered_map<std::wstring, size_t> pending;
+    size_t first = events.size();
+    DWORD dwTimeout = (timeout_ms < 0) ? INFINITE : (DWORD)timeout_ms;
+    for (;;)
+    {
+        if (!watcher->reading && !issue_watch_read(watcher))
+            return false;
+
+        // Files being written may finish without another notification, so
+        // they are checked every so often
+        DWORD dwWait = dwTimeout;
+        if (!watcher->unready.empty() && dwWait > WATCH_UNREADY_POLL_MS)
+            dwWait = WATCH_UNREADY_POLL_MS;
+
+        if (WaitForSingleObject(watcher->overlapped.hEvent, dwWait) != WAIT_OBJECT_0)
+        {
+            add_ready_files(watcher, events, pending);
+            if (dwWait == dwTimeout || events.size() != first)
+                return true; // Nothing more
+            if (dwTimeout != INFINITE)
+                dwTimeout -= dwWait;
+            continue;
+        }
+
+        DWORD cbRead;
+        watcher->reading = false;
+        if (!GetOverlappedResult(watcher->hDir, &watcher->overlapped, &cbRead, FALSE))
+            return false;
+        parse_watch_buffer(watcher, cbRead, events, pending);
+
+        // Take whatever else is already queued, without waiting
+        dwTimeout = 0;
+    }
+}
+
+void CloseFontWatcher(FontWatcher* watcher)
+{
+    if (!watcher)
+        return;
+    if (watcher->reading)
+    {
+        CancelIo(watcher->hDir);
+        DWORD cbRead;
+        GetOverlappedResult(watcher->hDir, &watcher->overlapped, &cbRead, TRUE);
+    }
+    if (watcher->overlapped.hEvent)
+        CloseHandle(watcher->overlapped.hEvent);
+    CloseHandle(watcher->hDir);
+    delete watcher;
+}
+
+#else
+
+struct FontWatcher {
+    std::wstring dir;
+    int fd;
+    int wd; // -1 once the directory is gone
+    std::unordered_set<std::wstring> unready; // Created, but not closed yet
+};
+
+FontWatcher* OpenFontWatcher(const wchar_t* dir)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    // IN_CLOSE_WRITE rather than IN_MODIFY, so a file is read once it is complete.
+    // A created file is reported at its IN_CLOSE_WRITE too.
+    int wd = inotify_add_watch(fd, utf8_from_wide(dir).c_str(),
+                               IN_CREATE | IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM |
+                               IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+    if (wd == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    FontWatcher* watcher = new FontWatcher();
+    watcher->dir = dir;
+    watcher->fd = fd;
+    watcher->wd = wd;
+    return watcher;
+}
+
+bool ReadFontWatcher(FontWatcher* watcher, int timeout_ms, std::vector<FontWatchEvent>& events)
+{
+    if (watcher->wd == -1)
+        return false;
+
+    struct pollfd pfd;
+    pfd.fd = watcher->fd;
+    pfd.events = POLLIN;
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0)
+        return errno == EINTR;
+    if (ret == 0)
+        return true; // Timed out
+
+    std::unordered_map<std::wstring, size_t> pending;
+    std::wstring dir = watcher->dir;
+    if (!dir.empty() && dir[dir.size() - 1] != L'/')
+        dir += L'/';
+
+    // Drain the queue
+    alignas(struct inotify_event) char buffer[16 * 1024];
+    for (;;)
+    {
+        ssize_t len = read(watcher->fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            return len == 0 || errno == EAGAIN || errno == EWOULDBLOCK;
+
+        for (char* p = buffer; p < buffer + len; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                add_rescan_event(events, watcher->dir);
+                continue;
+            }
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_UNMOUNT | IN_IGNORED))
+            {
+                // The directory was deleted, moved away or unmounted. Its
+                // files are gone from the path, and no more events will come.
+                if (watcher->wd != -1)
+                {
+                    inotify_rm_watch(watcher->fd, watcher->wd); // Still there after a move
+                    watcher->wd = -1;
+                    add_rescan_event(events, watcher->dir);
+                }
+                continue;
+            }
+            if (!event->len || (event->mask & IN_ISDIR))
+                continue;
+
+            std::wstring path = dir + wide_from_utf8(event->name);
+            if (event->mask & IN_CREATE)
+            {
+                watcher->unready.insert(path); // Reported once it is closed
+            }
+            else if (event->mask & IN_MOVED_TO)
+            {
+                add_watch_event(events, pending, FONT_WATCH_ADDED, path);
+            }
+            else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                // A file removed before it was closed was never reported
+                if (!watcher->unready.erase(path))
+                    add_watch_event(events, pending, FONT_WATCH_REMOVED, path);
+            }
+            else if (event->mask & IN_CLOSE_WRITE)
+            {
+                FontWatchAction action = watcher->unready.erase(path) ? FONT_WATCH_ADDED
+                                                                      : FONT_WATCH_MODIFIED;
+                add_watch_event(events, pending, action, path);
+            }
+        }
+    }
+}
+
+void CloseFontWatcher(FontWatcher* watcher)
+{
+    if (!watcher)
+        return;
+    close(watcher->fd);
+    delete watcher;
+}
+
+#endif
@@ -0,0 +1,35 @@
+// fontwatch.h --- Watching a font directory for changes
+// Author: katahiromz
+// License: MIT
+#pragma once
+
+#include <string>
+#include <vector>
+
+enum FontWatchAction {
+    FONT_WATCH_ADDED,    // A file appeared (created or moved in)
+    FONT_WATCH_REMOVED,  // A file disappeared (deleted or moved out)
+    FONT_WATCH_MODIFIED, // A file was rewritten
+    FONT_WATCH_RESCAN,   // Changes were lost; the whole directory must be rescanned
+};
+
+struct FontWatchEvent {
+    FontWatchAction action;
+    std::wstring path; // Full path; the directory itself for FONT_WATCH_RESCAN
+};
+
+struct FontWatcher;
+
+// Start watching a directory (not its subdirectories). Returns NULL on failure.
+// Uses ReadDirectoryChangesW on Windows and inotify on Linux.
+FontWatcher* OpenFontWatcher(const wchar_t* dir);
+
+// Wait up to timeout_ms milliseconds (-1: forever) for changes, then append
+// every pending change to events. Changes to the same file are merged into one
+// event carrying the net effect, in order of first appearance. A new file is
+// reported once its writer has closed it.
+// Returns false on error, or once the directory itself is gone; its removal
+// is reported as FONT_WATCH_RESCAN first.
+bool ReadFontWatcher(FontWatcher* watcher, int timeout_ms, std::vector<FontWatchEvent>& events);
+
+void CloseFontWatcher(FontWatcher* watcher);
@@ -0,0 +1,281 @@
+/*
+ * PROJECT:     EmuType tests
+ * LICENSE:     MIT
+ * PURPOSE:     Test for the coverage blending kernels
+ *
+ * Every kernel the CPU supports must match the scalar kernels bit for bit.
+ */
+
+#include "emutest.h"
+#include "../blend.h"
+#include <string.h>
+#include <vector>
+
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void)
+{
+    random_state = random_state * 1664525 + 1013904223;
+    return random_state >> 8;
+}
+
+// Coverage like a glyph row: runs of none, full and partial coverage
+static void fill_coverage(std::vector<uint8_t>& coverage)
+{
+    for (size_t i = 0; i < coverage.size(); )
+    {
+        size_t run = 1 + next_random() % 20;
+        int kind = next_random() % 3;
+        for (; run > 0 && i < coverage.size(); --run, ++i)
+            coverage[i] = (kind == 0) ? 0 : (kind == 1) ? 255 : (uint8_t)next_random();
+    }
+}
+
+static uint32_t expected_pixel(uint32_t fg, uint32_t bg, int a)
+{
+    uint32_t pixel = bg & 0xFF000000;
+    for (int shift = 0; shift < 24; shift += 8)
+    {
+        uint32_t x = (fg >> shift) & 0xFF, y = (bg >> shift) & 0xFF;
+        pixel |= ((x * a + y * (255 - a)) / 255) << shift;
+    }
+    return pixel;
+}
+
+static void test_scalar(void)
+{
+    const BlendKernels* scalar = GetBlendKernels(BLEND_KERNEL_SCALAR);
+    ok(scalar != NULL, "no scalar kernels\n");
+    if (!scalar)
+        return;
+
+    // Every coverage against a few color pairs
+    static const uint32_t colors[] = { 0x000000, 0xFFFFFF, 0x123456, 0xFEDCBA, 0x80FF01 };
+    uint8_t coverage[256];
+    for (int a = 0; a < 256; ++a)
+        coverage[a] = (uint8_t)a;
+
+    int wrong = 0;
+    for (uint32_t fg : colors)
+    {
+        for (uint32_t bg : colors)
+        {
+            uint32_t dst[256];
+            for (int a = 0; a < 256; ++a)
+                dst[a] = 0xAA000000 | bg;
+            scalar->gray_transparent(dst, coverage, 256, fg, 0);
+            for (int a = 0; a < 256; ++a)
+                wrong += (dst[a] != expected_pixel(fg, 0xAA000000 | bg, a));
+
+            scalar->gray_opaque(dst, coverage, 256, fg, bg);
+            for (int a = 0; a < 256; ++a)
+                wrong += (dst[a] != expected_pixel(fg, bg, a));
+        }
+    }
+    ok_int(wrong, 0);
+}
+
+static void test_lcd_scalar(void)
+{
+    const BlendKernels* scalar = GetBlendKernels(BLEND_KERNEL_SCALAR);
+    if (!scalar)
+        return;
+
+    // Each channel takes its own subpixel coverage
+    uint8_t coverage[256 * 3];
+    for (int a = 0; a < 256; ++a)
+    {
+        coverage[a * 3 + 0] = (uint8_t)a;
+        coverage[a * 3 + 1] = (uint8_t)(255 - a);
+        coverage[a * 3 + 2] = (uint8_t)(a * 7);
+    }
+
+    uint32_t fg = 0x123456, bg = 0xAAFEDCBA;
+    uint32_t transparent[256], opaque[256];
+    for (int a = 0; a < 256; ++a)
+        transparent[a] = bg;
+    scalar->lcd_transparent(transparent, coverage, 256, fg, 0);
+    scalar->lcd_opaque(opaque, coverage, 256, fg, bg);
+
+    int wrong = 0;
+    for (int a = 0; a < 256; ++a)
+    {
+        uint32_t expected = (expected_pixel(fg, bg, coverage[a * 3 + 0]) & 0xFFFF0000) |
+                            (expected_pixel(fg, bg, coverage[a * 3 + 1]) & 0x0000FF00) |
+                            (expected_pixel(fg, bg, coverage[a * 3 + 2]) & 0x000000FF);
+        wrong += (transparent[a] != expected) + (opaque[a] != expected);
+    }
+    ok_int(wrong, 0);
+}
+
+// Compare a row kernel with the scalar one. LCD rows have 3 bytes per pixel.
+static int compare_rows(BlendRowProc scalar, BlendRowProc proc, int bytes_per_pixel)
+{
+    std::vector<uint8_t> coverage(200 * 3);
+    std::vector<uint32_t> dst(200), expected, actual;
+    int wrong = 0;
+    for (int round = 0; round < 2000; ++round)
+    {
+        fill_coverage(coverage);
+        for (size_t i = 0; i < dst.size(); ++i)
+            dst[i] = next_random() ^ (next_random() << 8);
+
+        // Every length up to several vectors, at unaligned offsets
+        int offset = next_random() % 16;
+        int count = next_random() % (int)(dst.size() - offset);
+        uint32_t fg = next_random() & 0xFFFFFF, bg = next_random() ^ (next_random() << 8);
+
+        expected = actual = dst;
+        const uint8_t* row = &coverage[offset * bytes_per_pixel];
+        scalar(&expected[offset], row, count, fg, bg);
+        proc(&actual[offset], row, count, fg, bg);
+        wrong += (expected != actual);
+    }
+    return wrong;
+}
+
+static void test_mono_scalar(void)
+{
+    const BlendKernels* scalar = GetBlendKernels(BLEND_KERNEL_SCALAR);
+    if (!scalar)
+        return;
+
+    // Starting at bit 3 of 0x5A 0xC3: 1 1 0 1 0 1 1 0 0 0 0 1 1
+    static const uint8_t bits[] = { 0x5A, 0xC3 };
+    static const int set[] = { 1, 1, 0, 1, 0, 1, 1, 0, 0, 0, 0, 1, 1 };
+    uint32_t transparent[13], opaque[13];
+    for (int i = 0; i < 13; ++i)
+        transparent[i] = 0x555555;
+    scalar->mono_transparent(transparent, bits, 3, 13, 0x112233, 0xAABBCC);
+    scalar->mono_opaque(opaque, bits, 3, 13, 0x112233, 0xAABBCC);
+
+    int wrong = 0;
+    for (int i = 0; i < 13; ++i)
+    {
+        wrong += (transparent[i] != (set[i] ? 0x112233u : 0x555555u));
+        wrong += (opaque[i] != (set[i] ? 0x112233u : 0xAABBCCu));
+    }
+    ok_int(wrong, 0);
+}
+
+// Compare a 1bpp row kernel with the scalar one at every bit offset
+static int compare_mono_rows(BlendMonoRowProc scalar, BlendMonoRowProc proc)
+{
+    std::vector<uint8_t> bits(32);
+    std::vector<uint32_t> dst(200), expected, actual;
+    int wrong = 0;
+    for (int round = 0; round < 2000; ++round)
+    {
+        // Whole bytes of 0 and 0xFF as well as mixed bytes
+        for (size_t i = 0; i < bits.size(); ++i)
+        {
+            int kind = next_random() % 3;
+            bits[i] = (kind == 0) ? 0 : (kind == 1) ? 0xFF : (uint8_t)next_random();
+        }
+        for (size_t i = 0; i < dst.size(); ++i)
+            dst[i] = next_random() ^ (next_random() << 8);
+
+        int x = next_random() % 16;
+        int count = next_random() % (int)dst.size();
+        uint32_t fg = next_random() & 0xFFFFFF, bg = next_random() & 0xFFFFFF;
+
+        expected = actual = dst;
+        scalar(&expected[0], &bits[0], x, count, fg, bg);
+        proc(&actual[0], &bits[0], x, count, fg, bg);
+        wrong += (expected != actual);
+    }
+    return wrong;
+}
+
+static void test_kernels(BlendKernelType type)
+{
+    const BlendKernels* scalar = GetBlendKernels(BLEND_KERNEL_SCALAR);
+    const BlendKernels* kernels = GetBlendKernels(type);
+    if (!kernels)
+    {
+        skip("kernel type %d is not supported here\n", (int)type);
+        return;
+    }
+
+    int wrong = compare_rows(scalar->gray_transparent, kernels->gray_transparent, 1);
+    ok(wrong == 0, "%s: %d gray rows differ in transparent mode\n", kernels->name, wrong);
+    wrong = compare_rows(scalar->gray_opaque, kernels->gray_opaque, 1);
+    ok(wrong == 0, "%s: %d gray rows differ in opaque mode\n", kernels->name, wrong);
+    wrong = compare_rows(scalar->lcd_transparent, kernels->lcd_transparent, 3);
+    ok(wrong == 0, "%s: %d LCD rows differ in transparent mode\n", kernels->name, wrong);
+    wrong = compare_rows(scalar->lcd_opaque, kernels->lcd_opaque, 3);
+    ok(wrong == 0, "%s: %d LCD rows differ in opaque mode\n", kernels->name, wrong);
+    wrong = compare_mono_rows(scalar->mono_transparent, kernels->mono_transparent);
+    ok(wrong == 0, "%s: %d 1bpp rows differ in transparent mode\n", kernels->name, wrong);
+    wrong = compare_mono_rows(scalar->mono_opaque, kernels->mono_opaque);
+    ok(wrong == 0, "%s: %d 1bpp rows differ in opaque mode\n", kernels->name, wrong);
+}
+
+static bool is_monotonic_table(const uint8_t* table)
+{
+    if (table[0] != 0 || table[255] != 255)
+        return false;
+    for (int i = 1; i < 256; ++i)
+    {
+        if (table[i] < table[i - 1])
+            return false;
+    }
+    return true;
+}
+
+static void test_gamma(void)
+{
+    // Gamma 1.0 without contrast needs no tables
+    ok(GetBlendGamma(0x000000, BLEND_GAMMA_LINEAR, 0) == NULL, "tables for linear blending\n");
+    ok(GetBlendGamma(0xFFFFFF, 0, 0) == NULL, "tables for gamma level 0\n");
+
+    // Light text gets thicker and dark text thinner
+    const BlendGamma* light = GetBlendGamma(0xFFFFFF, 2200, 0);
+    const BlendGamma* dark = GetBlendGamma(0x000000, 2200, 0);
+    ok(light && dark, "no tables\n");
+    if (!light || !dark)
+        return;
+    ok(light->gray[128] > 128, "light gray[128]: %d\n", light->gray[128]);
+    ok(dark->gray[128] < 128, "dark gray[128]: %d\n", dark->gray[128]);
+    ok(is_monotonic_table(light->gray) && is_monotonic_table(dark->gray), "bad tables\n");
+
+    // The contrast thickens dark text
+    const BlendGamma* contrast = GetBlendGamma(0x000000, 2200, 100);
+    ok(contrast && contrast->gray[128] > dark->gray[128], "contrast does not thicken\n");
+
+    // The tables are cached and survive a cache full of other colors
+    ok(GetBlendGamma(0xFFFFFF, 2200, 0) == light, "tables not cached\n");
+    uint8_t saved[256];
+    memcpy(saved, light->red, sizeof(saved));
+    for (int i = 0; i < BLEND_GAMMA_CACHE_SIZE * 2; ++i)
+        GetBlendGamma(0x010203 * i, 1800, 50);
+    light = GetBlendGamma(0xFFFFFF, 2200, 0);
+    ok(light && memcmp(light->red, saved, sizeof(saved)) == 0, "tables rebuilt differently\n");
+
+    // Every channel of LCD coverage has the table of its channel value
+    const BlendGamma* color = GetBlendGamma(0x00FF80, 1800, 0);
+    ok(color != NULL, "no tables\n");
+    if (!color)
+        return;
+    ok(is_monotonic_table(color->red) && is_monotonic_table(color->green) &&
+       is_monotonic_table(color->blue), "bad tables\n");
+    uint8_t coverage[6] = { 0, 100, 200, 255, 50, 150 }, out[6];
+    CorrectLcdCoverage(out, coverage, 2, color);
+    ok(out[0] == color->red[0] && out[1] == color->green[100] && out[2] == color->blue[200] &&
+       out[3] == color->red[255] && out[4] == color->green[50] && out[5] == color->blue[150],
+       "wrong LCD correction\n");
+    CorrectGrayCoverage(out, coverage, 6, color);
+    ok(out[1] == color->gray[100] && out[5] == color->gray[150], "wrong gray correction\n");
+}
+
+START_TEST(Blend)
+{
+    test_scalar();
+    test_lcd_scalar();
+    test_mono_scalar();
+    for (int type = 0; type < BLEND_KERNEL_COUNT; ++type)
+        test_kernels((BlendKernelType)type);
+    test_gamma();
+
+    ok(GetBestBlendKernels() != NULL, "no kernels chosen\n");
+}
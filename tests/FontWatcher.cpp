@@ -0,0 +1,331 @@
+/*
+ * PROJECT:     EmuType tests
+ * LICENSE:     MIT
+ * PURPOSE:     Test for the font directory watcher
+ *
+ * Usage: FontWatcher <directory of the test fonts>
+ * The fonts are copied into a temporary directory that is being watched.
+ */
+
+#include "emutest.h"
+#include "../fontwatch.h"
+#include "../fontmap.h"
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <string>
+#include <vector>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <stdlib.h>
+    #include <unistd.h>
+    #include "../utf8.h"
+#endif
+
+static const char* test_fonts[] =
+{
+    "ExampleFont.ttf",
+    "PanosePitchTest.ttf",
+    "ReactOSTestTahoma.ttf",
+    "Shadows_Into_Light.ttf",
+    "TTCTestV.ttc",
+};
+
+#ifdef _WIN32
+#define PATH_SEP "\\"
+static std::wstring wide_from_path(const std::string& path)
+{
+    WCHAR buf[MAX_PATH];
+    MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, buf, MAX_PATH);
+    return buf;
+}
+#else
+#define PATH_SEP "/"
+static std::wstring wide_from_path(const std::string& path)
+{
+    return wide_from_utf8(path);
+}
+#endif
+
+static std::string make_temp_dir(void)
+{
+#ifdef _WIN32
+    CHAR temp[MAX_PATH], dir[MAX_PATH];
+    GetTempPathA(MAX_PATH, temp);
+    GetTempFileNameA(temp, "emw", 0, dir);
+    DeleteFileA(dir);
+    return CreateDirectoryA(dir, NULL) ? dir : "";
+#else
+    const char* tmp = getenv("TMPDIR");
+    std::string pattern = std::string(tmp ? tmp : "/tmp") + "/EmuTypeWatchXXXXXX";
+    std::vector<char> buf(pattern.begin(), pattern.end());
+    buf.push_back(0);
+    return mkdtemp(buf.data()) ? buf.data() : "";
+#endif
+}
+
+static void remove_dir(const std::string& dir)
+{
+#ifdef _WIN32
+    RemoveDirectoryA(dir.c_str());
+#else
+    rmdir(dir.c_str());
+#endif
+}
+
+static bool copy_file(const std::string& from, const std::string& to)
+{
+    FILE* in = fopen(from.c_str(), "rb");
+    if (!in)
+        return false;
+    FILE* out = fopen(to.c_str(), "wb");
+    if (!out)
+    {
+        fclose(in);
+        return false;
+    }
+
+    char buf[4096];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, len, out);
+    fclose(in);
+    return fclose(out) == 0;
+}
+
+// Find the event of a path; returns -1 if there is none
+static int find_event(const std::vector<FontWatchEvent>& events, const std::string& path)
+{
+    std::wstring wide = wide_from_path(path);
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        if (events[i].path == wide)
+            return (int)i;
+    }
+    return -1;
+}
+
+// Number of faces of a font file as seen through the shared mapping, or -1
+static int count_faces(FT_Library lib, const std::string& path)
+{
+    const FontFileMapping* mapping = MapFontFile(wide_from_path(path).c_str());
+    if (!mapping)
+        return -1;
+
+    FT_Face face;
+    int num_faces = -1;
+    if (FT_New_Memory_Face(lib, mapping->data, (FT_Long)mapping->size, 0, &face) == 0)
+    {
+        num_faces = (int)face->num_faces;
+        FT_Done_Face(face);
+    }
+    UnmapFontFile(mapping);
+    return num_faces;
+}
+
+START_TEST(FontWatcher)
+{
+    const int num_fonts = (int)(sizeof(test_fonts) / sizeof(test_fonts[0]));
+    std::string fixtures = (emutest_argc >= 2) ? emutest_argv[1] : "tests";
+
+    std::string dir = make_temp_dir();
+    ok(!dir.empty(), "Cannot create a temporary directory\n");
+    if (dir.empty())
+        return;
+
+    // Files present before watching must not show up
+    for (int i = 0; i < num_fonts; ++i)
+    {
+        std::string to = dir + PATH_SEP "old_" + test_fonts[i];
+        ok(copy_file(fixtures + PATH_SEP + test_fonts[i], to), "Cannot copy %s\n", test_fonts[i]);
+    }
+
+    FontWatcher* watcher = OpenFontWatcher(wide_from_path(dir).c_str());
+    ok(watcher != NULL, "OpenFontWatcher failed\n");
+    if (!watcher)
+        return;
+
+    FT_Library lib;
+    ok_int(FT_Init_FreeType(&lib), 0);
+
+    std::vector<FontWatchEvent> events;
+    ok(ReadFontWatcher(watcher, 0, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 0);
+
+    // Adding: one ADDED event per file, even though each copy is a create and a write
+    for (int i = 0; i < num_fonts; ++i)
+        copy_file(fixtures + PATH_SEP + test_fonts[i], dir + PATH_SEP + test_fonts[i]);
+
+    events.clear();
+    ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), num_fonts);
+    for (int i = 0; i < num_fonts; ++i)
+    {
+        std::string path = dir + PATH_SEP + test_fonts[i];
+        int index = find_event(events, path);
+        ok(index >= 0, "No event for %s\n", test_fonts[i]);
+        if (index >= 0)
+            ok_int(events[index].action, FONT_WATCH_ADDED);
+        ok(count_faces(lib, path) > 0, "%s cannot be loaded\n", test_fonts[i]);
+    }
+    ok_int(count_faces(lib, dir + PATH_SEP "TTCTestV.ttc"), 3);
+    ok_int(GetMappedFontFileCount(), 0);
+
+    // A file rewritten with the same size right after it was mapped gets a new
+    // mapping, and the old one keeps the old contents. Windows may refuse the
+    // rewrite while the file is mapped.
+    std::string example_copy = dir + PATH_SEP "ExampleFont.ttf";
+    const FontFileMapping* before = MapFontFile(wide_from_path(example_copy).c_str());
+    ok(before != NULL, "MapFontFile failed\n");
+    if (before)
+    {
+        unsigned char old_last = before->data[before->size - 1];
+        std::vector<unsigned char> contents(before->data, before->data + before->size);
+        contents[contents.size() - 1] ^= 0xFF;
+        FILE* fp = fopen(example_copy.c_str(), "wb");
+        if (fp)
+        {
+            fwrite(contents.data(), 1, contents.size(), fp);
+            fclose(fp);
+        }
+
+        const FontFileMapping* after = MapFontFile(wide_from_path(example_copy).c_str());
+        ok(after != NULL, "MapFontFile failed\n");
+        if (after && fp)
+        {
+            ok(after != before, "The stale mapping was returned\n");
+            ok_int(after->size, contents.size());
+            ok_int(after->data[after->size - 1], contents[contents.size() - 1]);
+        }
+        ok_int(before->data[before->size - 1], old_last);
+        if (after)
+            UnmapFontFile(after);
+
+        events.clear();
+        ReadFontWatcher(watcher, 1000, events); // The rewrite
+
+        // Truncating the file leaves the old mapping readable
+        fp = fopen(example_copy.c_str(), "wb");
+        if (fp)
+        {
+            fwrite(contents.data(), 1, contents.size() / 2, fp);
+            fclose(fp);
+        }
+        ok_int(before->data[before->size - 1], old_last);
+        UnmapFontFile(before);
+    }
+    ok_int(GetMappedFontFileCount(), 0);
+    events.clear();
+    ReadFontWatcher(watcher, 1000, events); // The truncation
+
+    // Rewriting one file reports that file only
+    std::string tahoma = dir + PATH_SEP "ReactOSTestTahoma.ttf";
+    copy_file(fixtures + PATH_SEP "ExampleFont.ttf", tahoma);
+    events.clear();
+    ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 1);
+    if (events.size() == 1)
+    {
+        ok_int(events[0].action, FONT_WATCH_MODIFIED);
+        ok(events[0].path == wide_from_path(tahoma), "Wrong path\n");
+    }
+
+    // Removing
+    std::string example = dir + PATH_SEP "ExampleFont.ttf";
+    remove(example.c_str());
+    events.clear();
+    ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 1);
+    if (events.size() == 1)
+    {
+        ok_int(events[0].action, FONT_WATCH_REMOVED);
+        ok(events[0].path == wide_from_path(example), "Wrong path\n");
+    }
+
+    // Removed and created again in one batch is a modification
+    std::string shadows = dir + PATH_SEP "Shadows_Into_Light.ttf";
+    remove(shadows.c_str());
+    copy_file(fixtures + PATH_SEP "Shadows_Into_Light.ttf", shadows);
+    // Created and removed in one batch is a removal
+    std::string temp = dir + PATH_SEP "Temp.ttf";
+    copy_file(fixtures + PATH_SEP "ExampleFont.ttf", temp);
+    remove(temp.c_str());
+    events.clear();
+    ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 2);
+    int index = find_event(events, shadows);
+    ok(index >= 0 && events[index].action == FONT_WATCH_MODIFIED, "Wrong event for %s\n", shadows.c_str());
+    index = find_event(events, temp);
+    ok(index >= 0 && events[index].action == FONT_WATCH_REMOVED, "Wrong event for %s\n", temp.c_str());
+
+    // Renaming
+    std::string panose = dir + PATH_SEP "PanosePitchTest.ttf";
+    std::string renamed = dir + PATH_SEP "Renamed.ttf";
+    rename(panose.c_str(), renamed.c_str());
+    events.clear();
+    ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 2);
+    index = find_event(events, panose);
+    ok(index >= 0 && events[index].action == FONT_WATCH_REMOVED, "Wrong event for %s\n", panose.c_str());
+    index = find_event(events, renamed);
+    ok(index >= 0 && events[index].action == FONT_WATCH_ADDED, "Wrong event for %s\n", renamed.c_str());
+
+    // A file still being written is reported once it is closed
+    std::string partial = dir + PATH_SEP "Partial.ttf";
+    FILE* fp = fopen(partial.c_str(), "wb");
+    ok(fp != NULL, "Cannot create %s\n", partial.c_str());
+    if (fp)
+    {
+        fwrite("\0\1\0\0", 1, 4, fp);
+        fflush(fp);
+        events.clear();
+        ok(ReadFontWatcher(watcher, 300, events), "ReadFontWatcher failed\n");
+        ok_int(events.size(), 0);
+
+        fclose(fp);
+        events.clear();
+        ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+        ok_int(events.size(), 1);
+        if (events.size() == 1)
+        {
+            ok_int(events[0].action, FONT_WATCH_ADDED);
+            ok(events[0].path == wide_from_path(partial), "Wrong path\n");
+        }
+    }
+
+    // Nothing else is pending
+    events.clear();
+    ok(ReadFontWatcher(watcher, 100, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 0);
+
+    FT_Done_FreeType(lib);
+
+    const char* leftovers[] = { "PanosePitchTest.ttf", "ReactOSTestTahoma.ttf",
+                                "Shadows_Into_Light.ttf", "TTCTestV.ttc", "Renamed.ttf", "Partial.ttf" };
+    for (size_t i = 0; i < sizeof(leftovers) / sizeof(leftovers[0]); ++i)
+        remove((dir + PATH_SEP + leftovers[i]).c_str());
+    for (int i = 0; i < num_fonts; ++i)
+        remove((dir + PATH_SEP "old_" + test_fonts[i]).c_str());
+    events.clear();
+    ReadFontWatcher(watcher, 1000, events); // The removals
+
+#ifdef _WIN32
+    CloseFontWatcher(watcher);
+    remove_dir(dir);
+#else
+    // Removing the directory itself asks for a rescan, then the watcher stops
+    remove_dir(dir);
+    events.clear();
+    ok(ReadFontWatcher(watcher, 1000, events), "ReadFontWatcher failed\n");
+    ok_int(events.size(), 1);
+    if (events.size() == 1)
+    {
+        ok_int(events[0].action, FONT_WATCH_RESCAN);
+        ok(events[0].path == wide_from_path(dir), "Wrong path\n");
+    }
+    events.clear();
+    ok(!ReadFontWatcher(watcher, 100, events), "ReadFontWatcher succeeded\n");
+    ok_int(events.size(), 0);
+    CloseFontWatcher(watcher);
+#endif
+}
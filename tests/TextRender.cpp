@@ -0,0 +1,315 @@
+/*
+ * PROJECT:     EmuType tests
+ * LICENSE:     MIT
+ * PURPOSE:     Test for the headless text pipeline
+ *
+ * Usage: TextRender <directory of the test fonts>
+ */
+
+#include "emutest.h"
+#include "../textrender.h"
+#include "../blend.h"
+#include "../utf8.h"
+#include <string>
+#include <vector>
+
+#define WIDTH   320
+#define HEIGHT  80
+#define STRIDE  (WIDTH + 16) // Columns past the width must never be written
+#define WHITE   0xFFFFFF
+#define BLACK   0x000000
+#define PADDING 0xDEADBEEF
+
+static std::vector<uint16_t> utf16(const char* ascii)
+{
+    std::vector<uint16_t> text;
+    for (; *ascii; ++ascii)
+        text.push_back((uint8_t)*ascii);
+    return text;
+}
+
+struct Canvas {
+    std::vector<uint32_t> pixels;
+    TextSurface surface;
+
+    Canvas()
+        : pixels(STRIDE * HEIGHT)
+    {
+        for (int y = 0; y < HEIGHT; ++y)
+        {
+            for (int x = 0; x < STRIDE; ++x)
+                pixels[y * STRIDE + x] = (x < WIDTH) ? WHITE : PADDING;
+        }
+        TextSurface init = { pixels.data(), STRIDE, WIDTH, HEIGHT, { 0, 0, WIDTH, HEIGHT } };
+        surface = init;
+    }
+
+    uint32_t at(int x, int y) const
+    {
+        return pixels[y * STRIDE + x];
+    }
+
+    // The box of the pixels that are not background; left > right if none
+    TextRect ink(uint32_t background) const
+    {
+        TextRect box = { WIDTH, HEIGHT, -1, -1 };
+        for (int y = 0; y < HEIGHT; ++y)
+        {
+            for (int x = 0; x < WIDTH; ++x)
+            {
+                if (at(x, y) == background)
+                    continue;
+                if (x < box.left) box.left = x;
+                if (y < box.top) box.top = y;
+                if (x > box.right) box.right = x;
+                if (y > box.bottom) box.bottom = y;
+            }
+        }
+        return box;
+    }
+
+    int count_padding(void) const
+    {
+        int count = 0;
+        for (int y = 0; y < HEIGHT; ++y)
+        {
+            for (int x = WIDTH; x < STRIDE; ++x)
+                count += (at(x, y) == PADDING);
+        }
+        return count;
+    }
+};
+
+static void draw(Canvas& canvas, TextFace* face, unsigned align, int x, int y, const char* ascii,
+                 bool opaque = false, unsigned options = 0, const TextRect* rect = NULL,
+                 const int* dx = NULL)
+{
+    TextState state = { BLACK, 0x00FF00, opaque, align, BLEND_GAMMA_LINEAR, 0 };
+    std::vector<uint16_t> text = utf16(ascii);
+    ok(RenderText(&canvas.surface, face, &state, x, y, options, rect,
+                  text.data(), (int)text.size(), dx),
+       "RenderText failed for '%s'\n", ascii);
+}
+
+static void test_basic(TextFace* face)
+{
+    Canvas canvas;
+    draw(canvas, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Hello");
+    TextRect ink = canvas.ink(WHITE);
+    ok(ink.left >= 10 && ink.left < 20, "ink.left: %d\n", ink.left);
+    ok(ink.top >= 10 && ink.bottom < 10 + 40, "ink: %d to %d\n", ink.top, ink.bottom);
+    ok(ink.right > ink.left + 20, "ink: %d to %d\n", ink.left, ink.right);
+    ok_int(canvas.count_padding(), 16 * HEIGHT);
+
+    // Black text has black pixels in it
+    int black = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = 0; x < WIDTH; ++x)
+            black += (canvas.at(x, y) == BLACK);
+    }
+    ok(black > 0, "no black pixels\n");
+
+    // Nothing is drawn for no text
+    Canvas empty;
+    draw(empty, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "");
+    ok(empty.ink(WHITE).right < 0, "ink without text\n");
+}
+
+static void test_align(TextFace* face)
+{
+    // Right aligned text is left aligned text moved left by its width
+    Canvas left, right;
+    draw(left, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Align");
+    draw(right, face, TEXT_ALIGN_RIGHT | TEXT_ALIGN_TOP, 300, 10, "Align");
+    TextRect left_ink = left.ink(WHITE), right_ink = right.ink(WHITE);
+    int shift = right_ink.left - left_ink.left;
+    ok(right_ink.right <= 300 + 2 && right_ink.right >= 300 - 10, "right ink ends at %d\n", right_ink.right);
+    ok_int(right_ink.top, left_ink.top);
+
+    int differ = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = left_ink.left; x <= left_ink.right; ++x)
+            differ += (left.at(x, y) != right.at(x + shift, y));
+    }
+    ok_int(differ, 0);
+
+    // Centered text at the middle of both is halfway between them
+    Canvas center;
+    draw(center, face, TEXT_ALIGN_CENTER | TEXT_ALIGN_TOP, (10 + 300) / 2, 10, "Align");
+    TextRect center_ink = center.ink(WHITE);
+    int halfway = (left_ink.left + right_ink.left) / 2;
+    ok(center_ink.left >= halfway - 1 && center_ink.left <= halfway + 1,
+       "center ink at %d, left %d, right %d\n", center_ink.left, left_ink.left, right_ink.left);
+
+    // The baseline is below the top of the cell
+    Canvas top, bottom;
+    draw(top, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Align");
+    draw(bottom, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_BOTTOM, 10, 70, "Align");
+    ok(bottom.ink(WHITE).bottom > top.ink(WHITE).bottom, "bottom aligned text is not lower\n");
+}
+
+static void test_clip_and_opaque(TextFace* face)
+{
+    // Nothing is drawn outside the clip rectangle
+    Canvas clipped;
+    TextRect half = { 0, 0, 40, HEIGHT };
+    clipped.surface.clip = half;
+    draw(clipped, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Clipped text");
+    TextRect ink = clipped.ink(WHITE);
+    ok(ink.right >= 10 && ink.right < 40, "ink.right: %d\n", ink.right);
+
+    // Nor outside the rectangle of TEXT_OPTION_CLIPPED
+    Canvas option;
+    TextRect rect = { 0, 0, 40, HEIGHT };
+    draw(option, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Clipped text",
+         false, TEXT_OPTION_CLIPPED, &rect);
+    ink = option.ink(WHITE);
+    ok(ink.right >= 10 && ink.right < 40, "ink.right: %d\n", ink.right);
+
+    // TEXT_OPTION_OPAQUE fills the rectangle with the background
+    Canvas filled;
+    TextRect fill = { 5, 5, 100, 50 };
+    draw(filled, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 200, 10, "x",
+         false, TEXT_OPTION_OPAQUE, &fill);
+    ok(filled.at(5, 5) == 0x00FF00 && filled.at(99, 49) == 0x00FF00, "not filled\n");
+    ok(filled.at(4, 5) == WHITE && filled.at(100, 49) == WHITE && filled.at(99, 50) == WHITE,
+       "filled too much\n");
+
+    // In OPAQUE mode the glyph boxes get the background too
+    Canvas opaque;
+    draw(opaque, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Opaque", true);
+    int background = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = 0; x < WIDTH; ++x)
+            background += (opaque.at(x, y) == 0x00FF00);
+    }
+    ok(background > 0, "no background in OPAQUE mode\n");
+    ok_int(opaque.count_padding(), 16 * HEIGHT);
+}
+
+static void test_dx(TextFace* face)
+{
+    // With dx, the second glyph is exactly dx[0] pixels after the first
+    Canvas one, two;
+    static const int dx[] = { 60, 60 };
+    draw(one, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "H", false, 0, NULL, dx);
+    draw(two, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "HH", false, 0, NULL, dx);
+    TextRect ink_one = one.ink(WHITE), ink_two = two.ink(WHITE);
+    ok_int(ink_two.left, ink_one.left);
+    ok_int(ink_two.right, ink_one.right + 60);
+    ok_int(ink_two.top, ink_one.top);
+    ok_int(ink_two.bottom, ink_one.bottom);
+}
+
+static int darkness(const Canvas& canvas)
+{
+    int sum = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = 0; x < WIDTH; ++x)
+            sum += 255 - (int)((canvas.at(x, y) >> 8) & 0xFF);
+    }
+    return sum;
+}
+
+static void test_gamma(TextFace* face)
+{
+    // Gamma 1.0 is linear blending, and a higher gamma thins dark text
+    std::vector<uint16_t> text = utf16("Gamma");
+    Canvas linear, same, corrected;
+    TextState state = { BLACK, WHITE, false, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, BLEND_GAMMA_LINEAR, 0 };
+    RenderText(&linear.surface, face, &state, 10, 10, 0, NULL, text.data(), (int)text.size(), NULL);
+    state.gamma_level = 0;
+    RenderText(&same.surface, face, &state, 10, 10, 0, NULL, text.data(), (int)text.size(), NULL);
+    ok(linear.pixels == same.pixels, "gamma level 0 is not linear\n");
+
+    state.gamma_level = 2200;
+    RenderText(&corrected.surface, face, &state, 10, 10, 0, NULL, text.data(), (int)text.size(), NULL);
+    ok(darkness(corrected) < darkness(linear), "darkness %d, linear %d\n",
+       darkness(corrected), darkness(linear));
+    ok_int(corrected.count_padding(), 16 * HEIGHT);
+}
+
+static void test_mono(FT_Face ft_face)
+{
+    // 1bpp glyphs have only the text color
+    TextFace* face = OpenTextFace(ft_face, -20, FT_LOAD_RENDER | FT_LOAD_TARGET_MONO);
+    ok(face != NULL, "OpenTextFace failed\n");
+    if (!face)
+        return;
+
+    Canvas canvas;
+    draw(canvas, face, TEXT_ALIGN_LEFT | TEXT_ALIGN_TOP, 10, 10, "Mono");
+    int other = 0, black = 0;
+    for (int y = 0; y < HEIGHT; ++y)
+    {
+        for (int x = 0; x < WIDTH; ++x)
+        {
+            black += (canvas.at(x, y) == BLACK);
+            other += (canvas.at(x, y) != BLACK && canvas.at(x, y) != WHITE);
+        }
+    }
+    ok(black > 0, "no black pixels\n");
+    ok_int(other, 0);
+    CloseTextFace(face);
+}
+
+static void test_utf16(void)
+{
+    // The text of emutext: pairs above U+FFFF, U+FFFD for what is not a code point
+    std::vector<uint16_t> text = utf16_from_utf8("A\xF0\x9F\x98\x80");
+    ok_int(text.size(), 3);
+    if (text.size() == 3)
+    {
+        ok_int(text[1], 0xD83D);
+        ok_int(text[2], 0xDE00);
+    }
+    text = utf16_from_utf8("\xF4\x90\x80\x80"); // U+110000
+    ok(text.size() == 1 && text[0] == 0xFFFD, "above U+10FFFF\n");
+    text = utf16_from_utf8("\xED\xA0\x80"); // U+D800
+    ok(text.size() == 1 && text[0] == 0xFFFD, "surrogate\n");
+    text = utf16_from_utf8("\xE3\x81"); // Cut short
+    ok(text.size() == 1 && text[0] == 0xFFFD, "truncated sequence\n");
+}
+
+START_TEST(TextRender)
+{
+    std::string fixtures = (emutest_argc >= 2) ? emutest_argv[1] : "tests";
+    std::string path = fixtures + "/ReactOSTestTahoma.ttf";
+
+    test_utf16();
+
+    FT_Library library;
+    FT_Face ft_face;
+    ok(FT_Init_FreeType(&library) == 0, "FT_Init_FreeType failed\n");
+    if (FT_New_Face(library, path.c_str(), 0, &ft_face) != 0)
+    {
+        ok(0, "%s: cannot open\n", path.c_str());
+        FT_Done_FreeType(library);
+        return;
+    }
+
+    // Check the ppem of cell and em heights
+    ok_int(CalcPpemForHeight(ft_face, -20), 20);
+    ok_int(CalcPpemForHeight(ft_face, 0), 16);
+    ok(CalcPpemForHeight(ft_face, 20) < 20, "cell height 20 gives ppem %d\n", CalcPpemForHeight(ft_face, 20));
+
+    TextFace* face = OpenTextFace(ft_face, -24, FT_LOAD_RENDER | FT_LOAD_TARGET_NORMAL);
+    ok(face != NULL, "OpenTextFace failed\n");
+    if (face)
+    {
+        test_basic(face);
+        test_align(face);
+        test_clip_and_opaque(face);
+        test_dx(face);
+        test_gamma(face);
+        CloseTextFace(face);
+    }
+    test_mono(ft_face);
+
+    FT_Done_Face(ft_face);
+    FT_Done_FreeType(library);
+}
@@ -0,0 +1,62 @@
+/*
+ * PROJECT:     EmuType tests
+ * LICENSE:     MIT
+ * PURPOSE:     Minimal apitest-style harness for the portable tests
+ *
+ * Usage: START_TEST(Name) { ... ok(cond, "fmt\n", ...); ... }
+ * skip("fmt\n", ...) reports tests that cannot run here.
+ * The test executable exits with the number of failures.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+
+static int emutest_executed = 0;
+static int emutest_failures = 0;
+static int emutest_skipped = 0;
+static int emutest_argc = 0;
+static char** emutest_argv = NULL;
+
+static inline void emutest_ok(const char* file, int line, int condition, const char* format, ...)
+{
+    ++emutest_executed;
+    if (condition)
+        return;
+
+    ++emutest_failures;
+    printf("%s:%d: Test failed: ", file, line);
+    va_list va;
+    va_start(va, format);
+    vprintf(format, va);
+    va_end(va);
+}
+
+static inline void emutest_skip(const char* file, int line, const char* format, ...)
+{
+    ++emutest_skipped;
+    printf("%s:%d: Tests skipped: ", file, line);
+    va_list va;
+    va_start(va, format);
+    vprintf(format, va);
+    va_end(va);
+}
+
+#define ok(condition, ...) emutest_ok(__FILE__, __LINE__, !!(condition), __VA_ARGS__)
+#define ok_int(expression, result) \
+    ok((expression) == (result), "Wrong value for '%s', expected: " #result " (%d), got: %d\n", \
+       #expression, (int)(result), (int)(expression))
+#define skip(...) emutest_skip(__FILE__, __LINE__, __VA_ARGS__)
+
+#define START_TEST(name) \
+    static void func_##name(void); \
+    int main(int argc, char** argv) \
+    { \
+        emutest_argc = argc; \
+        emutest_argv = argv; \
+        func_##name(); \
+        printf("%s: %d tests executed (0 marked as todo, %d failures), %d skipped.\n", \
+               #name, emutest_executed, emutest_failures, emutest_skipped); \
+        return emutest_failures; \
+    } \
+    static void func_##name(void)
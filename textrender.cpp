@@ -0,0 +1,440 @@
+// textrender.cpp --- Drawing text into a 32bpp pixel surface on the CPU
+// Author: katahiromz
+// License: MIT
+#include "textrender.h"
+#include "blend.h"
+#include <stdlib.h>
+#include <unordered_map>
+#include FT_TRUETYPE_TABLES_H
+#include FT_WINFONTS_H
+
+// ---------------------------------------------------------------------------
+// Font metrics
+
+// lfHeight > 0 is the cell height: ppem = units_per_EM * height / (winAscent + winDescent)
+// lfHeight < 0 is the em height:   ppem = -height
+// lfHeight == 0 is the default em height of 16 pixels
+// usWinAscent/usWinDescent of the OS/2 table are used as Windows does, or
+// the hhea Ascender/Descender when they sum to zero.
+int CalcPpemForHeight(FT_Face face, int height)
+{
+    if (height == 0) height = -16;   // Windows default
+
+    if (height < 0)
+        return -height;   // em-height: ppem == |height|
+
+    // Cell-height path: derive ppem from usWinAscent + usWinDescent
+    TT_OS2*        pOS2  = (TT_OS2*)       FT_Get_Sfnt_Table(face, FT_SFNT_OS2);
+    TT_HoriHeader* pHori = (TT_HoriHeader*)FT_Get_Sfnt_Table(face, FT_SFNT_HHEA);
+
+    int units;
+    if (pOS2)
+    {
+        // Some broken fonts store a huge negative value in usWinDescent
+        // (signed overflow). Take the absolute value to compensate.
+        int winAscent  = (int)pOS2->usWinAscent;
+        int winDescent = (int)abs((int16_t)pOS2->usWinDescent);
+
+        if (winAscent + winDescent != 0)
+            units = winAscent + winDescent;
+        else if (pHori)
+            units = (int)pHori->Ascender - (int)pHori->Descender;
+        else
+            units = (int)face->units_per_EM;
+    }
+    else if (pHori)
+        units = (int)pHori->Ascender - (int)pHori->Descender;
+    else
+        units = (int)face->units_per_EM;
+
+    // ppem = units_per_EM * height / units
+    int ppem = (int)FT_MulDiv((FT_Long)face->units_per_EM, (FT_Long)height, (FT_Long)units);
+
+    // If rounding caused us to exceed the requested height, step down by one
+    if (ppem > 1 && (int)FT_MulDiv((FT_Long)units, (FT_Long)ppem, (FT_Long)face->units_per_EM) > height)
+        --ppem;
+
+    return (ppem > 0) ? ppem : 1;
+}
+
+void GetOutlineExtents(FT_Face face, int ppem, int* ascent, int* descent)
+{
+    TT_OS2* os2 = (TT_OS2*)FT_Get_Sfnt_Table(face, FT_SFNT_OS2);
+    if (os2 && (os2->usWinAscent != 0 || os2->usWinDescent != 0))
+    {
+        FT_Fixed em_scale = FT_MulDiv((FT_Long)ppem, 1 << 16, (FT_Long)face->units_per_EM);
+        *ascent  = (int)FT_MulFix((FT_Long)os2->usWinAscent,  em_scale);
+        *descent = (int)FT_MulFix((FT_Long)os2->usWinDescent, em_scale);
+    }
+    else
+    {
+        *ascent  = (face->size->metrics.ascender  + 32) >> 6;
+        *descent = (-face->size->metrics.descender + 32) >> 6;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Layout
+
+// The code point at text[*i], advancing *i past a surrogate pair
+static unsigned long next_codepoint(const uint16_t* text, int count, int* i)
+{
+    unsigned long ch = text[*i];
+    if (ch >= 0xD800 && ch <= 0xDBFF && *i + 1 < count &&
+        text[*i + 1] >= 0xDC00 && text[*i + 1] <= 0xDFFF)
+    {
+        ++*i;
+        ch = 0x10000 + ((ch - 0xD800) << 10) + (text[*i] - 0xDC00);
+    }
+    return ch;
+}
+
+static inline int glyph_pixel_width(const FT_Bitmap* bitmap)
+{
+    int width = (int)bitmap->width;
+    return (bitmap->pixel_mode == FT_PIXEL_MODE_LCD) ? width / 3 : width;
+}
+
+void GetTextOrigin(unsigned align, int x, int y, int width, int height,
+                   int ascent, int descent, int* pen_x, int* baseline_y)
+{
+    unsigned h_align = align & (TEXT_ALIGN_LEFT | TEXT_ALIGN_CENTER | TEXT_ALIGN_RIGHT);
+    unsigned v_align = align & (TEXT_ALIGN_TOP | TEXT_ALIGN_BASELINE | TEXT_ALIGN_BOTTOM);
+
+    *baseline_y = y + ascent;
+    if (h_align == TEXT_ALIGN_CENTER)
+    {
+        x -= width / 2;
+        y -= height / 2;
+    }
+    else if (h_align == TEXT_ALIGN_RIGHT)
+    {
+        x -= width;
+        y -= height;
+    }
+    *pen_x = x;
+
+    if (v_align == TEXT_ALIGN_BASELINE)
+        *baseline_y = y - descent;
+    else if (v_align == TEXT_ALIGN_BOTTOM)
+        *baseline_y = y;
+}
+
+TextRect LayoutText(std::vector<PlacedGlyph>& glyphs, TextGlyphProc proc, void* context,
+                    const uint16_t* text, int count, int pen_x, int baseline_y,
+                    const int* dx, FT_Vector dx_direction)
+{
+    TextRect box = { 0, 0, 0, 0 };
+    bool empty = true;
+    FT_Pos x26 = (FT_Pos)pen_x << 6, y26 = (FT_Pos)baseline_y << 6;
+    int dx_accumulated = 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        unsigned long codepoint = next_codepoint(text, count, &i);
+
+        TextGlyph glyph;
+        if (!proc(context, codepoint, &glyph))
+            continue;
+
+        PlacedGlyph placed = { glyph.bitmap, (int)(x26 >> 6) + glyph.bitmap_left,
+                               (int)(y26 >> 6) - glyph.bitmap_top };
+        int width = glyph_pixel_width(glyph.bitmap), height = (int)glyph.bitmap->rows;
+        if (width > 0 && height > 0)
+        {
+            if (empty)
+            {
+                empty = false;
+                box.left = placed.x;
+                box.top = placed.y;
+                box.right = placed.x + width;
+                box.bottom = placed.y + height;
+            }
+            else
+            {
+                if (placed.x < box.left) box.left = placed.x;
+                if (placed.y < box.top) box.top = placed.y;
+                if (placed.x + width > box.right) box.right = placed.x + width;
+                if (placed.y + height > box.bottom) box.bottom = placed.y + height;
+            }
+            glyphs.push_back(placed);
+        }
+
+        if (dx)
+        {
+            dx_accumulated += dx[i];
+            FT_Pos distance = (FT_Pos)dx_accumulated << 6;
+            x26 = ((FT_Pos)pen_x << 6) + FT_MulFix(distance, dx_direction.x);
+            y26 = ((FT_Pos)baseline_y << 6) + FT_MulFix(distance, dx_direction.y);
+        }
+        else
+        {
+            x26 += glyph.advance.x;
+            y26 -= glyph.advance.y; // FreeType's y axis is up
+        }
+    }
+    return box;
+}
+
+// ---------------------------------------------------------------------------
+// Compositing
+
+// The clip rectangle of the surface, within its bounds
+static TextRect get_surface_clip(const TextSurface* surface)
+{
+    TextRect clip = surface->clip;
+    if (clip.left < 0) clip.left = 0;
+    if (clip.top < 0) clip.top = 0;
+    if (clip.right > surface->width) clip.right = surface->width;
+    if (clip.bottom > surface->height) clip.bottom = surface->height;
+    return clip;
+}
+
+// Blend a row of coverage of bytes_per_pixel corrected for gamma, a chunk at a time
+static void blend_corrected_row(BlendRowProc blend_row, uint32_t* dst, const uint8_t* coverage,
+                                int count, int bytes_per_pixel, const TextState* state,
+                                const BlendGamma* gamma)
+{
+    const int chunk = 128;
+    uint8_t corrected[chunk * 3];
+    for (int done = 0; done < count; done += chunk)
+    {
+        int n = (count - done < chunk) ? count - done : chunk;
+        if (bytes_per_pixel == 3)
+            CorrectLcdCoverage(corrected, coverage + done * 3, n, gamma);
+        else
+            CorrectGrayCoverage(corrected, coverage + done, n, gamma);
+        blend_row(dst + done, corrected, n, state->text_pixel, state->bk_pixel);
+    }
+}
+
+// Draw a glyph bitmap with its top-left at (left, top), within clip, with
+// the coverage corrected by gamma unless it is NULL
+static void draw_glyph(TextSurface* surface, const TextRect& clip, const FT_Bitmap* bitmap,
+                       int left, int top, const TextState* state, const BlendGamma* gamma)
+{
+    int w = glyph_pixel_width(bitmap);
+    int h = (int)bitmap->rows;
+    if (w <= 0 || h <= 0 || !bitmap->buffer)
+        return;
+
+    int x0 = (clip.left - left > 0) ? clip.left - left : 0;
+    int y0 = (clip.top - top > 0) ? clip.top - top : 0;
+    int x1 = (clip.right - left < w) ? clip.right - left : w;
+    int y1 = (clip.bottom - top < h) ? clip.bottom - top : h;
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    const BlendKernels* kernels = GetBestBlendKernels();
+    BlendMonoRowProc blend_mono_row = state->opaque ? kernels->mono_opaque : kernels->mono_transparent;
+    BlendRowProc blend_row;
+    if (bitmap->pixel_mode == FT_PIXEL_MODE_LCD)
+        blend_row = state->opaque ? kernels->lcd_opaque : kernels->lcd_transparent;
+    else
+        blend_row = state->opaque ? kernels->gray_opaque : kernels->gray_transparent;
+    uint32_t fg_pixel = state->text_pixel, bg_pixel = state->bk_pixel;
+
+    int src_pitch = (bitmap->pitch < 0) ? -bitmap->pitch : bitmap->pitch;
+    for (int row = y0; row < y1; ++row)
+    {
+        const uint8_t* src = bitmap->buffer + row * src_pitch;
+        uint32_t* dst = surface->bits + (top + row) * surface->stride + left + x0;
+        switch (bitmap->pixel_mode)
+        {
+        case FT_PIXEL_MODE_MONO:
+            blend_mono_row(dst, src, x0, x1 - x0, fg_pixel, bg_pixel);
+            break;
+        case FT_PIXEL_MODE_LCD:
+            if (gamma)
+                blend_corrected_row(blend_row, dst, src + x0 * 3, x1 - x0, 3, state, gamma);
+            else
+                blend_row(dst, src + x0 * 3, x1 - x0, fg_pixel, bg_pixel);
+            break;
+        default:
+            if (gamma)
+                blend_corrected_row(blend_row, dst, src + x0, x1 - x0, 1, state, gamma);
+            else
+                blend_row(dst, src + x0, x1 - x0, fg_pixel, bg_pixel);
+            break;
+        }
+    }
+}
+
+void DrawPlacedGlyphs(TextSurface* surface, const PlacedGlyph* glyphs, size_t count,
+                      int origin_x, int origin_y, const TextState* state)
+{
+    TextRect clip = get_surface_clip(surface);
+    const BlendGamma* gamma = GetBlendGamma(state->text_pixel, state->gamma_level,
+                                            state->contrast_level);
+    for (size_t i = 0; i < count; ++i)
+    {
+        draw_glyph(surface, clip, glyphs[i].bitmap,
+                   glyphs[i].x - origin_x, glyphs[i].y - origin_y, state, gamma);
+    }
+}
+
+void FillTextRect(TextSurface* surface, const TextRect* rect, uint32_t pixel)
+{
+    TextRect clip = get_surface_clip(surface);
+    int left = (rect->left > clip.left) ? rect->left : clip.left;
+    int top = (rect->top > clip.top) ? rect->top : clip.top;
+    int right = (rect->right < clip.right) ? rect->right : clip.right;
+    int bottom = (rect->bottom < clip.bottom) ? rect->bottom : clip.bottom;
+
+    for (int y = top; y < bottom; ++y)
+    {
+        uint32_t* dst = surface->bits + y * surface->stride;
+        for (int x = left; x < right; ++x)
+            dst[x] = pixel;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Headless text rendering
+
+struct TextFaceGlyph {
+    FT_Bitmap bitmap; // bitmap.buffer points into pixels
+    int bitmap_left;
+    int bitmap_top;
+    FT_Vector advance;
+    std::vector<uint8_t> pixels;
+};
+
+struct TextFace {
+    FT_Face face;
+    FT_Int32 load_flags;
+    int ascent;
+    int descent;
+    std::unordered_map<FT_UInt, TextFaceGlyph> glyphs; // Rendered glyphs by index
+};
+
+TextFace* OpenTextFace(FT_Face face, int height, FT_Int32 load_flags)
+{
+    TextFace* text_face = new TextFace;
+    text_face->face = face;
+    text_face->load_flags = load_flags;
+
+    FT_Set_Transform(face, NULL, NULL);
+    if (FT_IS_SCALABLE(face))
+    {
+        int ppem = CalcPpemForHeight(face, height);
+        if (FT_Set_Pixel_Sizes(face, 0, ppem) != 0)
+        {
+            delete text_face;
+            return NULL;
+        }
+        GetOutlineExtents(face, ppem, &text_face->ascent, &text_face->descent);
+    }
+    else
+    {
+        // The strike nearest to the cell height
+        int target = abs(height), best = -1;
+        for (int i = 0; i < face->num_fixed_sizes; ++i)
+        {
+            if (best < 0 || abs(face->available_sizes[i].height - target) <
+                            abs(face->available_sizes[best].height - target))
+            {
+                best = i;
+            }
+        }
+        if (best < 0 || FT_Select_Size(face, best) != 0)
+        {
+            delete text_face;
+            return NULL;
+        }
+
+        FT_WinFNT_HeaderRec header;
+        if (FT_Get_WinFNT_Header(face, &header) == 0)
+        {
+            text_face->ascent = header.ascent;
+            text_face->descent = header.pixel_height - header.ascent;
+        }
+        else
+        {
+            text_face->ascent = (face->size->metrics.ascender + 32) >> 6;
+            text_face->descent = ((face->size->metrics.height + 32) >> 6) - text_face->ascent;
+        }
+    }
+    return text_face;
+}
+
+void CloseTextFace(TextFace* text_face)
+{
+    delete text_face;
+}
+
+bool GetTextFaceGlyph(void* context, unsigned long codepoint, TextGlyph* glyph)
+{
+    TextFace* text_face = (TextFace*)context;
+    FT_UInt index = FT_Get_Char_Index(text_face->face, codepoint);
+
+    auto found = text_face->glyphs.find(index);
+    if (found == text_face->glyphs.end())
+    {
+        if (FT_Load_Glyph(text_face->face, index, text_face->load_flags) != 0)
+            return false;
+
+        FT_GlyphSlot slot = text_face->face->glyph;
+        TextFaceGlyph& entry = text_face->glyphs[index];
+        entry.bitmap = slot->bitmap;
+        entry.bitmap_left = slot->bitmap_left;
+        entry.bitmap_top = slot->bitmap_top;
+        entry.advance = slot->advance;
+
+        size_t src_pitch = (slot->bitmap.pitch < 0) ? -slot->bitmap.pitch : slot->bitmap.pitch;
+        size_t size = src_pitch * slot->bitmap.rows;
+        if (size && slot->bitmap.buffer)
+            entry.pixels.assign(slot->bitmap.buffer, slot->bitmap.buffer + size);
+        entry.bitmap.buffer = entry.pixels.empty() ? NULL : entry.pixels.data();
+        found = text_face->glyphs.find(index);
+    }
+
+    const TextFaceGlyph& entry = found->second;
+    glyph->bitmap = &entry.bitmap;
+    glyph->bitmap_left = entry.bitmap_left;
+    glyph->bitmap_top = entry.bitmap_top;
+    glyph->advance = entry.advance;
+    return true;
+}
+
+bool RenderText(TextSurface* surface, TextFace* text_face, const TextState* state,
+                int x, int y, unsigned options, const TextRect* rect,
+                const uint16_t* text, int count, const int* dx)
+{
+    if (count < 0 || (count > 0 && !text))
+        return false;
+
+    if (rect && (options & TEXT_OPTION_OPAQUE))
+        FillTextRect(surface, rect, state->bk_pixel);
+
+    // Measure with the advances rounded up to whole pixels, as EmulatedExtTextOutW
+    FT_Pos total_x = 0, total_y = 0;
+    for (int i = 0; i < count; ++i)
+    {
+        TextGlyph glyph;
+        if (!GetTextFaceGlyph(text_face, next_codepoint(text, count, &i), &glyph))
+            continue;
+        total_x += (glyph.advance.x + 63) & ~63;
+        total_y += (glyph.advance.y + 63) & ~63;
+    }
+
+    int pen_x, baseline_y;
+    GetTextOrigin(state->align, x, y, (int)(total_x >> 6), (int)(total_y >> 6),
+                  text_face->ascent, text_face->descent, &pen_x, &baseline_y);
+
+    std::vector<PlacedGlyph> glyphs;
+    FT_Vector dx_direction = { 1 << 16, 0 };
+    LayoutText(glyphs, GetTextFaceGlyph, text_face, text, count, pen_x, baseline_y, dx, dx_direction);
+
+    TextSurface target = *surface;
+    if (rect && (options & TEXT_OPTION_CLIPPED))
+    {
+        if (rect->left > target.clip.left) target.clip.left = rect->left;
+        if (rect->top > target.clip.top) target.clip.top = rect->top;
+        if (rect->right < target.clip.right) target.clip.right = rect->right;
+        if (rect->bottom < target.clip.bottom) target.clip.bottom = rect->bottom;
+    }
+    if (!glyphs.empty())
+        DrawPlacedGlyphs(&target, &glyphs[0], glyphs.size(), 0, 0, state);
+    return true;
+}
@@ -0,0 +1,117 @@
+// textrender.h --- Drawing text into a 32bpp pixel surface on the CPU
+// Author: katahiromz
+// License: MIT
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+// The pipeline under EmulatedExtTextOutW, free of GDI: glyph layout, text
+// alignment and compositing. EmulatedExtTextOutW draws on a surface over the
+// DIB section it copies the destination into; a headless caller draws on a
+// buffer of its own with RenderText.
+
+struct TextRect {
+    int left, top, right, bottom;
+};
+
+// A caller-owned top-down surface of 32bpp 0x00RRGGBB pixels, as a BI_RGB DIB
+struct TextSurface {
+    uint32_t* bits;
+    int stride;    // In pixels
+    int width;
+    int height;
+    TextRect clip; // Nothing outside it is drawn
+};
+
+// The values of GDI's TA_* and ETO_* flags
+#define TEXT_ALIGN_LEFT     0
+#define TEXT_ALIGN_RIGHT    2
+#define TEXT_ALIGN_CENTER   6
+#define TEXT_ALIGN_TOP      0
+#define TEXT_ALIGN_BOTTOM   8
+#define TEXT_ALIGN_BASELINE 24
+#define TEXT_OPTION_OPAQUE  2 // Fill the rectangle with the background first
+#define TEXT_OPTION_CLIPPED 4 // Clip the text to the rectangle
+
+// The drawing state of a device context
+struct TextState {
+    uint32_t text_pixel; // 0x00RRGGBB
+    uint32_t bk_pixel;   // 0x00RRGGBB
+    bool opaque;         // OPAQUE background mode: glyph boxes get bk_pixel
+    unsigned align;      // TEXT_ALIGN_* flags
+    int gamma_level;     // Of GetBlendGamma; 0 or BLEND_GAMMA_LINEAR to blend linearly
+    int contrast_level;  // Of GetBlendGamma
+};
+
+// A rendered glyph, as supplied to the layout
+struct TextGlyph {
+    const FT_Bitmap* bitmap; // Must stay valid until the string is drawn
+    int bitmap_left;
+    int bitmap_top;
+    FT_Vector advance;       // 26.6, with y up as in FreeType
+};
+
+// Supply the glyph of a code point. Returns false to skip the character.
+typedef bool (*TextGlyphProc)(void* context, unsigned long codepoint, TextGlyph* glyph);
+
+// A glyph bitmap with its top-left at (x, y)
+struct PlacedGlyph {
+    const FT_Bitmap* bitmap;
+    int x, y;
+};
+
+// The ppem of a LOGFONT height, as Wine's calc_ppem_for_height
+int CalcPpemForHeight(FT_Face face, int height);
+
+// The pixel ascent and descent of an outline face at ppem, from the OS/2
+// usWinAscent and usWinDescent, or from the size metrics without them
+void GetOutlineExtents(FT_Face face, int ppem, int* ascent, int* descent);
+
+// The start of the baseline of a string of width x height pixels whose
+// reference point is (x, y), as EmulatedExtTextOutW aligns text
+void GetTextOrigin(unsigned align, int x, int y, int width, int height,
+                   int ascent, int descent, int* pen_x, int* baseline_y);
+
+// Place the glyphs of UTF-16 text from the start of its baseline. dx, if not
+// NULL, gives the advance of each code unit in pixels along dx_direction
+// (16.16) instead of the glyph advances. Returns the union of the glyph boxes.
+TextRect LayoutText(std::vector<PlacedGlyph>& glyphs, TextGlyphProc proc, void* context,
+                    const uint16_t* text, int count, int pen_x, int baseline_y,
+                    const int* dx, FT_Vector dx_direction);
+
+// Composite the glyphs, moved by (-origin_x, -origin_y), on the surface
+void DrawPlacedGlyphs(TextSurface* surface, const PlacedGlyph* glyphs, size_t count,
+                      int origin_x, int origin_y, const TextState* state);
+
+// Fill a rectangle of the surface, within the clip rectangle
+void FillTextRect(TextSurface* surface, const TextRect* rect, uint32_t pixel);
+
+// ---------------------------------------------------------------------------
+// Headless text rendering with a FreeType face
+//
+// A minimal font side for tools and tests, not that of EmulatedExtTextOutW:
+// the ppem comes from CalcPpemForHeight without the VDMX table, code points
+// map through the selected charmap only, with no linked fonts and no raster
+// codepage, and the glyphs are cached per TextFace (at most one entry per
+// glyph of the face) rather than in the realized font and glyph caches of
+// emutype.
+
+struct TextFace;
+
+// Use a face (owned by the caller) at a LOGFONT height, rendering glyphs with
+// load_flags (FT_LOAD_RENDER and a target). Returns NULL on failure.
+TextFace* OpenTextFace(FT_Face face, int height, FT_Int32 load_flags);
+void CloseTextFace(TextFace* text_face);
+
+// The glyph supplier of the face, for LayoutText
+bool GetTextFaceGlyph(void* text_face, unsigned long codepoint, TextGlyph* glyph);
+
+// Draw UTF-16 text as ExtTextOutW does, with (x, y) the reference point of
+// state->align and options of TEXT_OPTION_* for rect
+bool RenderText(TextSurface* surface, TextFace* text_face, const TextState* state,
+                int x, int y, unsigned options, const TextRect* rect,
+                const uint16_t* text, int count, const int* dx);
@@ -0,0 +1,94 @@
+// utf8.h --- UTF-8 conversion of wide paths and of text
+// Author: katahiromz
+// License: MIT
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// wchar_t holds UTF-32 outside Windows
+inline std::string utf8_from_wide(const std::wstring& wide)
+{
+    std::string utf8;
+    for (size_t i = 0; i < wide.size(); ++i)
+    {
+        unsigned long ch = (unsigned long)wide[i];
+        if (ch < 0x80)
+        {
+            utf8 += (char)ch;
+        }
+        else if (ch < 0x800)
+        {
+            utf8 += (char)(0xC0 | (ch >> 6));
+            utf8 += (char)(0x80 | (ch & 0x3F));
+        }
+        else if (ch < 0x10000)
+        {
+            utf8 += (char)(0xE0 | (ch >> 12));
+            utf8 += (char)(0x80 | ((ch >> 6) & 0x3F));
+            utf8 += (char)(0x80 | (ch & 0x3F));
+        }
+        else
+        {
+            utf8 += (char)(0xF0 | (ch >> 18));
+            utf8 += (char)(0x80 | ((ch >> 12) & 0x3F));
+            utf8 += (char)(0x80 | ((ch >> 6) & 0x3F));
+            utf8 += (char)(0x80 | (ch & 0x3F));
+        }
+    }
+    return utf8;
+}
+
+// Decode the code point at utf8[*i] and move *i past it. Invalid sequences,
+// surrogates and values above U+10FFFF become U+FFFD.
+inline unsigned long decode_utf8(const std::string& utf8, size_t* i)
+{
+    unsigned char lead = (unsigned char)utf8[*i];
+    int trail;
+    unsigned long ch;
+    if (lead < 0x80)                { ch = lead;        trail = 0; }
+    else if ((lead & 0xE0) == 0xC0) { ch = lead & 0x1F; trail = 1; }
+    else if ((lead & 0xF0) == 0xE0) { ch = lead & 0x0F; trail = 2; }
+    else if ((lead & 0xF8) == 0xF0) { ch = lead & 0x07; trail = 3; }
+    else                            { ch = 0xFFFD;      trail = -1; }
+
+    ++*i;
+    for (int k = 0; k < trail; ++k, ++*i)
+    {
+        if (*i >= utf8.size() || ((unsigned char)utf8[*i] & 0xC0) != 0x80)
+            return 0xFFFD;
+        ch = (ch << 6) | ((unsigned char)utf8[*i] & 0x3F);
+    }
+    if (ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+        return 0xFFFD;
+    return ch;
+}
+
+inline std::wstring wide_from_utf8(const std::string& utf8)
+{
+    std::wstring wide;
+    for (size_t i = 0; i < utf8.size(); )
+        wide += (wchar_t)decode_utf8(utf8, &i);
+    return wide;
+}
+
+// UTF-16 code units, with surrogate pairs above U+FFFF
+inline std::vector<uint16_t> utf16_from_utf8(const std::string& utf8)
+{
+    std::vector<uint16_t> text;
+    for (size_t i = 0; i < utf8.size(); )
+    {
+        unsigned long ch = decode_utf8(utf8, &i);
+        if (ch >= 0x10000)
+        {
+            text.push_back((uint16_t)(0xD800 + ((ch - 0x10000) >> 10)));
+            text.push_back((uint16_t)(0xDC00 + ((ch - 0x10000) & 0x3FF)));
+        }
+        else
+        {
+            text.push_back((uint16_t)ch);
+        }
+    }
+    return text;
+}